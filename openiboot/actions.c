@@ -321,25 +321,60 @@ static void* ramdisk = NULL;
 static uint32_t ramdiskSize;
 static uint32_t ramdiskRealSize;
 
-void set_ramdisk(void* location, int size) {
+// Images are loaded into a fresh buffer that only replaces the current one
+// once the load has succeeded, so a failed load keeps the old image.
+static void* loadingImage = NULL;
+
+static void* alloc_image(uint32_t size) {
+	if(loadingImage)
+		free(loadingImage);
+
+	loadingImage = malloc(size);
+	return loadingImage;
+}
+
+static void discard_image() {
+	if(loadingImage)
+		free(loadingImage);
+
+	loadingImage = NULL;
+}
+
+static void ramdisk_loaded(uint32_t size) {
 	if(ramdisk)
 		free(ramdisk);
 
-	// the gzip file format places the uncompressed length in the last four bytes of the file. Read it and calculate the size in KB.
-	ramdiskRealSize = ((*((uint32_t*)((uint8_t*)location + size - sizeof(uint32_t)))) + 1023) / 1024;
-
+	ramdisk = loadingImage;
 	ramdiskSize = size;
-	ramdisk = malloc(size);
-	memcpy(ramdisk, location, size);
+	loadingImage = NULL;
+
+	// the gzip file format places the uncompressed length in the last four bytes of the file. Read it and calculate the size in KB.
+	ramdiskRealSize = ((*((uint32_t*)((uint8_t*)ramdisk + ramdiskSize - sizeof(uint32_t)))) + 1023) / 1024;
 }
 
-void set_kernel(void* location, int size) {
+static void kernel_loaded(uint32_t size) {
 	if(kernel)
 		free(kernel);
 
+	kernel = loadingImage;
 	kernelSize = size;
-	kernel = malloc(size);
-	memcpy(kernel, location, size);
+	loadingImage = NULL;
+}
+
+void set_ramdisk(void* location, int size) {
+	if(!alloc_image(size))
+		return;
+
+	memcpy(loadingImage, location, size);
+	ramdisk_loaded(size);
+}
+
+void set_kernel(void* location, int size) {
+	if(!alloc_image(size))
+		return;
+
+	memcpy(loadingImage, location, size);
+	kernel_loaded(size);
 }
 
 #define INITRD_LOAD 0x06000000
@@ -569,30 +604,31 @@ int setup_boot()
 				return -1;
 			}
 
+			// load straight into the buffers the kernel and ramdisk are kept in
 			uint32_t size;
-			uint8_t *data = script_load_file(currentEntry->kernel, &size);
+			uint8_t *data = script_load_file_alloc(currentEntry->kernel, &size, alloc_image);
 			if(data == NULL)
 			{
+				discard_image();
 				bufferPrintf("setup: Failed to load kernel!\n");
 				return -1;
 			}
 
 			bufferPrintf("setup: Loaded kernel at 0x%08x.\n", data);
-			set_kernel(data, size);
-			free(data);
+			kernel_loaded(size);
 
 			if(currentEntry->ramdisk != NULL)
 			{
-				data = script_load_file(currentEntry->ramdisk, &size);
+				data = script_load_file_alloc(currentEntry->ramdisk, &size, alloc_image);
 				if(data == NULL)
 				{
+					discard_image();
 					bufferPrintf("setup: Failed to load ramdisk.\n");
 					return -1;
 				}
 
 				bufferPrintf("setup: Loaded ramdisk at 0x%08x.\n", data);
-				set_ramdisk(data, size);
-				free(data);
+				ramdisk_loaded(size);
 			}
 
 			if(currentEntry->path == NULL)
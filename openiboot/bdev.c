@@ -1,9 +1,103 @@
 #include "bdev.h"
 #include "arm/arm.h"
+#include "commands.h"
 #include "util.h"
 
 static LinkedList bdev_list = {&bdev_list, &bdev_list};
 
+// Read-ahead: each handle watches for reads that start where its last one
+// ended, and while that keeps up the window it reads ahead doubles, from
+// BDEV_RA_MIN up to BdevReadAheadMax. Prefetched data goes into a small pool
+// of buffers shared by all handles, keyed by device and absolute offset, and
+// writes through any handle or block_device_invalidate drop the buffers they
+// overlap.
+#define BDEV_RA_BUFFERS 4
+#define BDEV_RA_MIN (16 * 1024)
+
+typedef struct _bdev_ra_buffer
+{
+	block_device_t *device;
+	int64_t start;
+	int size;
+	int capacity;
+	uint32_t lastUse;
+	uint8_t *data;
+} bdev_ra_buffer_t;
+
+int BdevReadAheadMax = 128 * 1024;
+
+static bdev_ra_buffer_t bdev_ra_pool[BDEV_RA_BUFFERS];
+static uint32_t bdev_ra_clock = 0;
+static uint32_t bdev_ra_hits = 0;
+static uint32_t bdev_ra_fills = 0;
+static uint32_t bdev_ra_direct = 0;
+static uint64_t bdev_ra_bytes = 0;
+
+static void bdev_ra_invalidate(block_device_t *_bdev, int64_t _start, int64_t _end)
+{
+	int i;
+	for(i = 0; i < BDEV_RA_BUFFERS; i++)
+	{
+		bdev_ra_buffer_t *buf = &bdev_ra_pool[i];
+		if(buf->device == _bdev && buf->start < _end && (buf->start + buf->size) > _start)
+			buf->device = NULL;
+	}
+}
+
+static bdev_ra_buffer_t *bdev_ra_find(block_device_t *_bdev, int64_t _off)
+{
+	int i;
+	for(i = 0; i < BDEV_RA_BUFFERS; i++)
+	{
+		bdev_ra_buffer_t *buf = &bdev_ra_pool[i];
+		if(buf->device == _bdev && _off >= buf->start && _off < (buf->start + buf->size))
+		{
+			buf->lastUse = ++bdev_ra_clock;
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+static bdev_ra_buffer_t *bdev_ra_victim(int _size)
+{
+	bdev_ra_buffer_t *victim = &bdev_ra_pool[0];
+	int i;
+	for(i = 1; i < BDEV_RA_BUFFERS; i++)
+	{
+		bdev_ra_buffer_t *buf = &bdev_ra_pool[i];
+		if(victim->device != NULL && (buf->device == NULL || buf->lastUse < victim->lastUse))
+			victim = buf;
+	}
+
+	victim->device = NULL;
+	if(victim->capacity < _size)
+	{
+		if(victim->data)
+			free(victim->data);
+
+		victim->data = malloc(_size);
+		victim->capacity = victim->data ? _size : 0;
+		if(!victim->data)
+			return NULL;
+	}
+
+	return victim;
+}
+
+static void bdev_ra_release()
+{
+	int i;
+	for(i = 0; i < BDEV_RA_BUFFERS; i++)
+	{
+		if(bdev_ra_pool[i].data)
+			free(bdev_ra_pool[i].data);
+
+		memset(&bdev_ra_pool[i], 0, sizeof(bdev_ra_buffer_t));
+	}
+}
+
 static inline block_device_t *bdev_get(LinkedList *_ptr)
 {
 	return CONTAINER_OF(block_device_t, list_ptr, _ptr);
@@ -55,6 +149,487 @@ static int block_device_sync_raw(block_device_t *_bdev)
 	return _bdev->sync(_bdev);
 }
 
+static int block_device_read_at_driver(block_device_t *_bdev, int64_t _off, void *_dest, int _sz)
+{
+	if(_bdev->read_at)
+		return _bdev->read_at(_bdev, _off, _dest, _sz);
+
+	int ret = block_device_seek_raw(_bdev, seek_begin, _off);
+	if(ret < 0)
+		return ret;
+
+	return block_device_read_raw(_bdev, _dest, _sz);
+}
+
+static int block_device_write_at_driver(block_device_t *_bdev, int64_t _off, void *_src, int _sz)
+{
+	if(_bdev->write_at)
+		return _bdev->write_at(_bdev, _off, _src, _sz);
+
+	int ret = block_device_seek_raw(_bdev, seek_begin, _off);
+	if(ret < 0)
+		return ret;
+
+	return block_device_write_raw(_bdev, _src, _sz);
+}
+
+// Block cache: small positional I/O on any device goes through a fixed set
+// of BDEV_CACHE_LINE sized lines, hashed by device and line number and
+// evicted with CLOCK. In write-through mode writes reach the device at once
+// and patch any cached copy; in write-back mode small writes only dirty the
+// cache until the line is evicted, the device is synced or its last handle
+// is closed. Larger transfers bypass the lines, flushing whatever dirty data
+// they overlap. Lines stay cached while a device is closed; anything that
+// writes to it outside this layer (mtd_write and friends) has to call
+// block_device_invalidate first.
+#define BDEV_CACHE_LINE 4096
+#define BDEV_CACHE_LINES 64
+#define BDEV_CACHE_BUCKETS 64
+#define BDEV_CACHE_MAX_IO (16 * 1024)
+
+typedef struct _bdev_cache_line
+{
+	block_device_t *device;
+	int64_t lba;
+	int next;
+	uint8_t referenced;
+	uint8_t dirty;
+	uint8_t *data;
+} bdev_cache_line_t;
+
+typedef enum _bdev_cache_lookup
+{
+	bdev_cache_find,
+	bdev_cache_fill,
+	bdev_cache_claim,
+} bdev_cache_lookup_t;
+
+bdev_cache_mode_t BdevCacheMode = bdev_cache_write_through;
+
+static bdev_cache_line_t *bdev_cache_lines = NULL;
+static int bdev_cache_buckets[BDEV_CACHE_BUCKETS];
+static int bdev_cache_hand = 0;
+static int bdev_cache_dirty = 0;
+static uint32_t bdev_cache_hits = 0;
+static uint32_t bdev_cache_misses = 0;
+static uint32_t bdev_cache_bypass = 0;
+static uint32_t bdev_cache_dev_reads = 0;
+static uint32_t bdev_cache_dev_writes = 0;
+static uint32_t bdev_cache_writes_absorbed = 0;
+
+static int bdev_cache_hash(block_device_t *_bdev, int64_t _lba)
+{
+	return (int)((((uint32_t)_lba * 2654435761U) ^ ((uint32_t)_bdev >> 4)) % BDEV_CACHE_BUCKETS);
+}
+
+static int bdev_cache_setup()
+{
+	int i;
+
+	if(bdev_cache_lines)
+		return 0;
+
+	bdev_cache_lines = malloc(sizeof(bdev_cache_line_t) * BDEV_CACHE_LINES);
+	if(!bdev_cache_lines)
+		return -1;
+
+	memset(bdev_cache_lines, 0, sizeof(bdev_cache_line_t) * BDEV_CACHE_LINES);
+	for(i = 0; i < BDEV_CACHE_BUCKETS; i++)
+		bdev_cache_buckets[i] = -1;
+
+	return 0;
+}
+
+static void bdev_cache_unhash(int _idx)
+{
+	bdev_cache_line_t *line = &bdev_cache_lines[_idx];
+	int *ptr = &bdev_cache_buckets[bdev_cache_hash(line->device, line->lba)];
+
+	while(*ptr != -1)
+	{
+		if(*ptr == _idx)
+		{
+			*ptr = line->next;
+			break;
+		}
+
+		ptr = &bdev_cache_lines[*ptr].next;
+	}
+
+	line->device = NULL;
+}
+
+static int bdev_cache_writeback(bdev_cache_line_t *_line)
+{
+	if(!_line->dirty)
+		return 0;
+
+	bdev_cache_dev_writes++;
+	int ret = block_device_write_at_driver(_line->device, _line->lba * BDEV_CACHE_LINE, _line->data, BDEV_CACHE_LINE);
+	if(ret < 0)
+		return ret;
+
+	_line->dirty = FALSE;
+	bdev_cache_dirty--;
+	return 0;
+}
+
+static bdev_cache_line_t *bdev_cache_get(block_device_t *_bdev, int64_t _lba, bdev_cache_lookup_t _mode)
+{
+	int bucket = bdev_cache_hash(_bdev, _lba);
+	int idx;
+
+	if(bdev_cache_setup())
+		return NULL;
+
+	for(idx = bdev_cache_buckets[bucket]; idx != -1; idx = bdev_cache_lines[idx].next)
+	{
+		bdev_cache_line_t *line = &bdev_cache_lines[idx];
+		if(line->device == _bdev && line->lba == _lba)
+		{
+			line->referenced = TRUE;
+			bdev_cache_hits++;
+			return line;
+		}
+	}
+
+	if(_mode == bdev_cache_find)
+		return NULL;
+
+	bdev_cache_misses++;
+
+	// CLOCK: pass over lines that were used since the hand last came by.
+	bdev_cache_line_t *victim;
+	for(;;)
+	{
+		idx = bdev_cache_hand;
+		bdev_cache_hand = (bdev_cache_hand + 1) % BDEV_CACHE_LINES;
+
+		victim = &bdev_cache_lines[idx];
+		if(victim->device && victim->referenced)
+		{
+			victim->referenced = FALSE;
+			continue;
+		}
+
+		break;
+	}
+
+	if(victim->device)
+	{
+		if(bdev_cache_writeback(victim) < 0)
+			return NULL;
+
+		bdev_cache_unhash(idx);
+	}
+
+	if(!victim->data)
+	{
+		victim->data = malloc(BDEV_CACHE_LINE);
+		if(!victim->data)
+			return NULL;
+	}
+
+	if(_mode == bdev_cache_fill)
+	{
+		bdev_cache_dev_reads++;
+		if(block_device_read_at_driver(_bdev, _lba * BDEV_CACHE_LINE, victim->data, BDEV_CACHE_LINE) < 0)
+			return NULL;
+	}
+
+	victim->device = _bdev;
+	victim->lba = _lba;
+	victim->referenced = TRUE;
+	victim->dirty = FALSE;
+	victim->next = bdev_cache_buckets[bucket];
+	bdev_cache_buckets[bucket] = idx;
+
+	return victim;
+}
+
+// Writes back dirty lines of a device that overlap [_start, _end).
+static int bdev_cache_flush_range(block_device_t *_bdev, int64_t _start, int64_t _end)
+{
+	int ret = 0;
+	int i;
+
+	if(!bdev_cache_dirty)
+		return 0;
+
+	for(i = 0; i < BDEV_CACHE_LINES; i++)
+	{
+		bdev_cache_line_t *line = &bdev_cache_lines[i];
+		if(line->device != _bdev || !line->dirty)
+			continue;
+
+		int64_t lineStart = line->lba * BDEV_CACHE_LINE;
+		if(lineStart >= _end || (lineStart + BDEV_CACHE_LINE) <= _start)
+			continue;
+
+		if(bdev_cache_writeback(line) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+// Forgets clean lines of a device (or of every device if _bdev is NULL) that
+// overlap [_start, _end). Dirty lines hold the only copy of their data, so
+// they stay until they have been written back.
+static void bdev_cache_drop(block_device_t *_bdev, int64_t _start, int64_t _end)
+{
+	int i;
+
+	if(!bdev_cache_lines)
+		return;
+
+	for(i = 0; i < BDEV_CACHE_LINES; i++)
+	{
+		bdev_cache_line_t *line = &bdev_cache_lines[i];
+		if(!line->device || line->dirty || (_bdev && line->device != _bdev))
+			continue;
+
+		int64_t lineStart = line->lba * BDEV_CACHE_LINE;
+		if(lineStart >= _end || (lineStart + BDEV_CACHE_LINE) <= _start)
+			continue;
+
+		bdev_cache_unhash(i);
+	}
+}
+
+// Only for devices that are going away: their unwritten lines are lost.
+static void bdev_cache_discard(block_device_t *_bdev)
+{
+	int lost = 0;
+	int i;
+
+	if(!bdev_cache_lines)
+		return;
+
+	for(i = 0; i < BDEV_CACHE_LINES; i++)
+	{
+		bdev_cache_line_t *line = &bdev_cache_lines[i];
+		if(line->device != _bdev)
+			continue;
+
+		if(line->dirty)
+		{
+			line->dirty = FALSE;
+			bdev_cache_dirty--;
+			lost++;
+		}
+
+		bdev_cache_unhash(i);
+	}
+
+	if(lost)
+		bufferPrintf("bdev: Discarded %d unwritten cache lines of 0x%p.\n", lost, _bdev);
+}
+
+static int bdev_cache_flush_all()
+{
+	int ret = 0;
+	int i;
+
+	if(!bdev_cache_dirty)
+		return 0;
+
+	for(i = 0; i < BDEV_CACHE_LINES; i++)
+	{
+		if(bdev_cache_lines[i].device && bdev_cache_writeback(&bdev_cache_lines[i]) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+// Brings cached copies in line with data written straight to the device.
+static void bdev_cache_patch(block_device_t *_bdev, int64_t _off, const uint8_t *_src, int _sz)
+{
+	int64_t lba;
+
+	if(!bdev_cache_lines)
+		return;
+
+	for(lba = _off / BDEV_CACHE_LINE; (lba * BDEV_CACHE_LINE) < (_off + _sz); lba++)
+	{
+		int idx;
+		for(idx = bdev_cache_buckets[bdev_cache_hash(_bdev, lba)]; idx != -1; idx = bdev_cache_lines[idx].next)
+		{
+			bdev_cache_line_t *line = &bdev_cache_lines[idx];
+			if(line->device != _bdev || line->lba != lba)
+				continue;
+
+			int64_t lineStart = lba * BDEV_CACHE_LINE;
+			int64_t start = (_off > lineStart) ? _off : lineStart;
+			int64_t end = ((_off + _sz) < (lineStart + BDEV_CACHE_LINE)) ? (_off + _sz) : (lineStart + BDEV_CACHE_LINE);
+			memcpy(line->data + (start - lineStart), _src + (start - _off), end - start);
+			break;
+		}
+	}
+}
+
+static int block_device_read_at_raw(block_device_t *_bdev, int64_t _off, void *_dest, int _sz)
+{
+	uint8_t *dest = _dest;
+	int done = 0;
+
+	if(BdevCacheMode == bdev_cache_off || _sz > BDEV_CACHE_MAX_IO)
+	{
+		if(BdevCacheMode != bdev_cache_off)
+			bdev_cache_bypass++;
+
+		if(bdev_cache_flush_range(_bdev, _off, _off + _sz) < 0)
+			return -1;
+
+		return block_device_read_at_driver(_bdev, _off, _dest, _sz);
+	}
+
+	while(done < _sz)
+	{
+		int64_t off = _off + done;
+		int64_t lba = off / BDEV_CACHE_LINE;
+		int lineOffset = (int)(off - (lba * BDEV_CACHE_LINE));
+		int amt = BDEV_CACHE_LINE - lineOffset;
+		if(amt > (_sz - done))
+			amt = _sz - done;
+
+		bdev_cache_line_t *line = bdev_cache_get(_bdev, lba, bdev_cache_fill);
+		if(line)
+			memcpy(dest + done, line->data + lineOffset, amt);
+		else
+		{
+			// the line couldn't be read whole, e.g. at the end of the device
+			int ret = block_device_read_at_driver(_bdev, off, dest + done, amt);
+			if(ret < 0)
+				return ret;
+		}
+
+		done += amt;
+	}
+
+	return _sz;
+}
+
+static int block_device_write_at_raw(block_device_t *_bdev, int64_t _off, void *_src, int _sz)
+{
+	uint8_t *src = _src;
+	int done = 0;
+
+	if(BdevCacheMode != bdev_cache_write_back || _sz > BDEV_CACHE_MAX_IO)
+	{
+		int ret = block_device_write_at_driver(_bdev, _off, _src, _sz);
+		if(ret >= 0)
+			bdev_cache_patch(_bdev, _off, _src, _sz);
+
+		return ret;
+	}
+
+	while(done < _sz)
+	{
+		int64_t off = _off + done;
+		int64_t lba = off / BDEV_CACHE_LINE;
+		int lineOffset = (int)(off - (lba * BDEV_CACHE_LINE));
+		int amt = BDEV_CACHE_LINE - lineOffset;
+		if(amt > (_sz - done))
+			amt = _sz - done;
+
+		bdev_cache_line_t *line = bdev_cache_get(_bdev, lba, (amt == BDEV_CACHE_LINE) ? bdev_cache_claim : bdev_cache_fill);
+		if(line)
+		{
+			memcpy(line->data + lineOffset, src + done, amt);
+			if(!line->dirty)
+			{
+				line->dirty = TRUE;
+				bdev_cache_dirty++;
+			}
+
+			bdev_cache_writes_absorbed++;
+		}
+		else
+		{
+			int ret = block_device_write_at_driver(_bdev, off, src + done, amt);
+			if(ret < 0)
+				return ret;
+		}
+
+		done += amt;
+	}
+
+	return _sz;
+}
+
+static int block_device_readv_at_raw(block_device_t *_bdev, const block_device_iovec_t *_vec, int _count)
+{
+	int total = 0;
+	int i;
+
+	if(_bdev->readv_at && BdevCacheMode == bdev_cache_off)
+		return _bdev->readv_at(_bdev, _vec, _count);
+
+	if(_bdev->readv_at)
+	{
+		// only go piece by piece when some of them are small enough to cache
+		for(i = 0; i < _count; i++)
+		{
+			if(_vec[i].size <= BDEV_CACHE_MAX_IO)
+				break;
+		}
+
+		if(i == _count)
+		{
+			for(i = 0; i < _count; i++)
+			{
+				if(bdev_cache_flush_range(_bdev, _vec[i].offset, _vec[i].offset + _vec[i].size) < 0)
+					return -1;
+			}
+
+			bdev_cache_bypass++;
+			return _bdev->readv_at(_bdev, _vec, _count);
+		}
+	}
+
+	for(i = 0; i < _count; i++)
+	{
+		int ret = block_device_read_at_raw(_bdev, _vec[i].offset, _vec[i].buffer, _vec[i].size);
+		if(ret < 0)
+			return ret;
+
+		total += _vec[i].size;
+	}
+
+	return total;
+}
+
+static int block_device_writev_at_raw(block_device_t *_bdev, const block_device_iovec_t *_vec, int _count)
+{
+	int total = 0;
+	int i;
+
+	if(_bdev->writev_at && BdevCacheMode != bdev_cache_write_back)
+	{
+		int ret = _bdev->writev_at(_bdev, _vec, _count);
+		if(ret >= 0)
+		{
+			for(i = 0; i < _count; i++)
+				bdev_cache_patch(_bdev, _vec[i].offset, _vec[i].buffer, _vec[i].size);
+		}
+
+		return ret;
+	}
+
+	for(i = 0; i < _count; i++)
+	{
+		int ret = block_device_write_at_raw(_bdev, _vec[i].offset, _vec[i].buffer, _vec[i].size);
+		if(ret < 0)
+			return ret;
+
+		total += _vec[i].size;
+	}
+
+	return total;
+}
+
 int block_device_init(block_device_t *_bdev)
 {
 	memset(&_bdev->mbr, 0, sizeof(MBR));
@@ -63,6 +638,7 @@ int block_device_init(block_device_t *_bdev)
 	_bdev->list_ptr.next = NULL;
 	_bdev->list_ptr.prev = NULL;
 	_bdev->setup_done = 0;
+	_bdev->open_count = 0;
 	_bdev->part_mode = partitioning_unknown;
 	_bdev->mbr_records = _bdev->mbr.partitions;
 	_bdev->gpt_records = malloc(sizeof(GPTPartitionRecord)*128);
@@ -208,6 +784,19 @@ void block_device_unregister(block_device_t *_bdev)
 		_bdev->list_ptr.next = NULL;
 		LeaveCriticalSection();
 	}
+
+	bdev_ra_invalidate(_bdev, 0, 0x7FFFFFFFFFFFFFFFLL);
+	bdev_cache_flush_range(_bdev, 0, 0x7FFFFFFFFFFFFFFFLL);
+	bdev_cache_discard(_bdev);
+}
+
+int block_device_invalidate(block_device_t *_bdev, int64_t _off, int64_t _sz)
+{
+	bdev_ra_invalidate(_bdev, _off, _off + _sz);
+
+	int ret = bdev_cache_flush_range(_bdev, _off, _off + _sz);
+	bdev_cache_drop(_bdev, _off, _off + _sz);
+	return ret;
 }
 
 block_device_t *block_device_find(block_device_t *_prev)
@@ -274,14 +863,17 @@ block_device_handle_t block_device_open(block_device_t *_bdev, int _idx)
 	switch(_bdev->part_mode)
 	{
 	case partitioning_none:
+		_bdev->open_count++;
 		return ret;
 
 	case partitioning_mbr:
 		ret->mbr_record = &_bdev->mbr_records[_idx];
+		_bdev->open_count++;
 		return ret;
 		
 	case partitioning_gpt:
 		ret->gpt_record = &_bdev->gpt_records[_idx];
+		_bdev->open_count++;
 		return ret;
 
 	default:
@@ -295,10 +887,57 @@ block_device_handle_t block_device_open(block_device_t *_bdev, int _idx)
 
 void block_device_close(block_device_handle_t _handle)
 {
-	block_device_finish(_handle->device);
+	block_device_t *bdev = _handle->device;
+
+	// Write back what the last user left behind. Lines that fail stay dirty
+	// and will be retried on the next sync, eviction or close.
+	bdev->open_count--;
+	if(bdev->open_count <= 0)
+	{
+		bdev->open_count = 0;
+		if(bdev_cache_flush_range(bdev, 0, 0x7FFFFFFFFFFFFFFFLL) < 0)
+			bufferPrintf("bdev: Failed to write back cached data for 0x%p.\n", bdev);
+	}
+
+	block_device_finish(bdev);
 	free(_handle);
 }
 
+static int64_t block_device_partition_start(block_device_handle_t _handle)
+{
+	int64_t block_size = block_device_block_size(_handle->device);
+	switch(_handle->device->part_mode)
+	{
+	case partitioning_mbr:
+		return _handle->mbr_record->beginLBA * block_size;
+
+	case partitioning_gpt:
+		return _handle->gpt_record->beginLBA * block_size;
+
+	default:
+		return 0;
+	}
+}
+
+static int64_t block_device_partition_end(block_device_handle_t _handle)
+{
+	int64_t block_size = block_device_block_size(_handle->device);
+	switch(_handle->device->part_mode)
+	{
+	case partitioning_mbr:
+		return ((int64_t)_handle->mbr_record->beginLBA + _handle->mbr_record->numSectors) * block_size;
+
+	case partitioning_gpt:
+		return (_handle->gpt_record->endLBA + 1) * block_size;
+
+	default:
+		{
+			int size = block_device_size(_handle->device);
+			return (size > 0) ? size : 0x7FFFFFFFFFFFFFFFLL;
+		}
+	}
+}
+
 int block_device_get_start(block_device_handle_t _handle)
 {
 	int block_size = block_device_block_size(_handle->device);
@@ -318,11 +957,16 @@ int block_device_get_start(block_device_handle_t _handle)
 
 int block_device_read(block_device_handle_t _handle, void *_dest, int _sz)
 {
+	bdev_cache_flush_range(_handle->device, 0, 0x7FFFFFFFFFFFFFFFLL);
 	return block_device_read_raw(_handle->device, _dest, _sz);
 }
 
 int block_device_write(block_device_handle_t _handle, void *_src, int _sz)
 {
+	// the device cursor isn't known here, so drop everything for it
+	if(block_device_invalidate(_handle->device, 0, 0x7FFFFFFFFFFFFFFFLL) < 0)
+		return -1;
+
 	return block_device_write_raw(_handle->device, _src, _sz);
 }
 
@@ -382,5 +1026,229 @@ int block_device_seek(block_device_handle_t _handle, seek_mode_t _mode, int64_t
 
 int block_device_sync(block_device_handle_t _h)
 {
-	return block_device_sync_raw(_h->device);
+	int ret = bdev_cache_flush_range(_h->device, 0, 0x7FFFFFFFFFFFFFFFLL);
+	int sret = block_device_sync_raw(_h->device);
+	return (ret < 0) ? ret : sret;
+}
+
+int block_device_read_at(block_device_handle_t _h, int64_t _off, void *_dest, int _sz)
+{
+	block_device_t *bdev = _h->device;
+	int64_t start = block_device_partition_start(_h) + _off;
+	uint8_t *dest = _dest;
+	int done = 0;
+
+	if(BdevReadAheadMax <= 0 || _sz >= BdevReadAheadMax)
+	{
+		_h->ra_window = 0;
+		return block_device_read_at_raw(bdev, start, _dest, _sz);
+	}
+
+	if(_off != _h->ra_next || _h->ra_next == 0)
+		_h->ra_window = 0;
+	else
+	{
+		// A window that can't hold the rest of the request is never filled,
+		// so start (or catch up) at twice the request size.
+		int min = ((2 * _sz) > BDEV_RA_MIN) ? (2 * _sz) : BDEV_RA_MIN;
+		if(min > BdevReadAheadMax)
+			min = BdevReadAheadMax;
+
+		if(_h->ra_window < min)
+			_h->ra_window = min;
+	}
+
+	_h->ra_next = _off + _sz;
+
+	while(done < _sz)
+	{
+		bdev_ra_buffer_t *buf = bdev_ra_find(bdev, start + done);
+		if(buf)
+		{
+			int avail = (int)(buf->start + buf->size - (start + done));
+			int amt = ((_sz - done) < avail) ? (_sz - done) : avail;
+			memcpy(dest + done, buf->data + (start + done - buf->start), amt);
+			done += amt;
+			bdev_ra_hits++;
+			continue;
+		}
+
+		if(_h->ra_window == 0)
+			break;
+
+		// the cap may have been lowered (and the pool shrunk) since this
+		// handle's window last grew
+		if(_h->ra_window > BdevReadAheadMax)
+			_h->ra_window = BdevReadAheadMax;
+
+		int64_t end = block_device_partition_end(_h);
+		int fill = _h->ra_window;
+		if((start + done + fill) > end)
+			fill = (int)(end - (start + done));
+
+		if(fill < (_sz - done))
+			break;
+
+		buf = bdev_ra_victim(BdevReadAheadMax);
+		if(!buf)
+			break;
+
+		if(fill > buf->capacity)
+			fill = buf->capacity;
+
+		if(fill < (_sz - done))
+			break;
+
+		if(block_device_read_at_raw(bdev, start + done, buf->data, fill) < 0)
+			break;
+
+		buf->device = bdev;
+		buf->start = start + done;
+		buf->size = fill;
+		buf->lastUse = ++bdev_ra_clock;
+		bdev_ra_fills++;
+		bdev_ra_bytes += fill;
+
+		_h->ra_window *= 2;
+		if(_h->ra_window > BdevReadAheadMax)
+			_h->ra_window = BdevReadAheadMax;
+	}
+
+	if(done < _sz)
+	{
+		bdev_ra_direct++;
+		int ret = block_device_read_at_raw(bdev, start + done, dest + done, _sz - done);
+		if(ret < 0)
+			return ret;
+	}
+
+	return _sz;
+}
+
+int block_device_write_at(block_device_handle_t _h, int64_t _off, void *_src, int _sz)
+{
+	int64_t start = block_device_partition_start(_h) + _off;
+	bdev_ra_invalidate(_h->device, start, start + _sz);
+	return block_device_write_at_raw(_h->device, start, _src, _sz);
+}
+
+// Vectors are rebased onto the device in batches, to keep this off the heap.
+#define BDEV_IOVEC_BATCH 16
+
+static int block_device_xfer_vec(block_device_handle_t _h, const block_device_iovec_t *_vec, int _count, int _write)
+{
+	block_device_iovec_t vec[BDEV_IOVEC_BATCH];
+	int64_t start = block_device_partition_start(_h);
+	int total = 0;
+
+	while(_count > 0)
+	{
+		int num = (_count > BDEV_IOVEC_BATCH) ? BDEV_IOVEC_BATCH : _count;
+		int i;
+		for(i = 0; i < num; i++)
+		{
+			vec[i] = _vec[i];
+			vec[i].offset += start;
+		}
+
+		if(_write)
+		{
+			for(i = 0; i < num; i++)
+				bdev_ra_invalidate(_h->device, vec[i].offset, vec[i].offset + vec[i].size);
+		}
+
+		int ret = _write ? block_device_writev_at_raw(_h->device, vec, num)
+			: block_device_readv_at_raw(_h->device, vec, num);
+		if(ret < 0)
+			return ret;
+
+		total += ret;
+		_vec += num;
+		_count -= num;
+	}
+
+	return total;
+}
+
+int block_device_readv_at(block_device_handle_t _h, const block_device_iovec_t *_vec, int _count)
+{
+	return block_device_xfer_vec(_h, _vec, _count, FALSE);
+}
+
+int block_device_writev_at(block_device_handle_t _h, const block_device_iovec_t *_vec, int _count)
+{
+	return block_device_xfer_vec(_h, _vec, _count, TRUE);
+}
+
+void cmd_bdev_readahead(int argc, char** argv)
+{
+	if(argc > 1)
+	{
+		BdevReadAheadMax = parseNumber(argv[1]) * 1024;
+		bdev_ra_release();
+	}
+
+	bufferPrintf("bdev: read-ahead up to %d KB, %d hits, %d fills (%d KB), %d direct reads\r\n",
+			BdevReadAheadMax / 1024, bdev_ra_hits, bdev_ra_fills, (uint32_t)(bdev_ra_bytes / 1024), bdev_ra_direct);
+
+	if(argc > 2)
+	{
+		bdev_ra_hits = 0;
+		bdev_ra_fills = 0;
+		bdev_ra_bytes = 0;
+		bdev_ra_direct = 0;
+	}
+}
+COMMAND("bdev_readahead", "show read-ahead stats, or set the window cap in KB (0 disables)", cmd_bdev_readahead);
+
+void cmd_bdev_cache(int argc, char** argv)
+{
+	static const char *modes[] = { "off", "write-through", "write-back" };
+
+	if(argc > 1)
+	{
+		if(strcmp(argv[1], "off") == 0)
+		{
+			bdev_cache_flush_all();
+			bdev_cache_drop(NULL, 0, 0x7FFFFFFFFFFFFFFFLL);
+			BdevCacheMode = bdev_cache_off;
+		}
+		else if(strcmp(argv[1], "wt") == 0)
+		{
+			bdev_cache_flush_all();
+			BdevCacheMode = bdev_cache_write_through;
+		}
+		else if(strcmp(argv[1], "wb") == 0)
+			BdevCacheMode = bdev_cache_write_back;
+		else if(strcmp(argv[1], "flush") == 0)
+			bdev_cache_flush_all();
+		else if(strcmp(argv[1], "drop") == 0)
+		{
+			bdev_cache_flush_all();
+			bdev_cache_drop(NULL, 0, 0x7FFFFFFFFFFFFFFFLL);
+		}
+		else if(strcmp(argv[1], "reset") == 0)
+		{
+			bdev_cache_hits = 0;
+			bdev_cache_misses = 0;
+			bdev_cache_bypass = 0;
+			bdev_cache_dev_reads = 0;
+			bdev_cache_dev_writes = 0;
+			bdev_cache_writes_absorbed = 0;
+		}
+		else
+		{
+			bufferPrintf("usage: %s [off|wt|wb|flush|drop|reset]\r\n", argv[0]);
+			return;
+		}
+	}
+
+	uint32_t lookups = bdev_cache_hits + bdev_cache_misses;
+	bufferPrintf("bdev: cache %s, %d x %d byte lines, %d dirty\r\n",
+			modes[BdevCacheMode], BDEV_CACHE_LINES, BDEV_CACHE_LINE, bdev_cache_dirty);
+	bufferPrintf("bdev: %d lookups, %d hits (%d%%), %d misses, %d bypassed\r\n",
+			lookups, bdev_cache_hits, lookups ? (bdev_cache_hits * 100 / lookups) : 0, bdev_cache_misses, bdev_cache_bypass);
+	bufferPrintf("bdev: %d line reads, %d line writebacks, %d writes absorbed\r\n",
+			bdev_cache_dev_reads, bdev_cache_dev_writes, bdev_cache_writes_absorbed);
 }
+COMMAND("bdev_cache", "show block cache stats, or change its mode", cmd_bdev_cache);
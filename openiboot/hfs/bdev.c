@@ -1,6 +1,7 @@
 #include "openiboot.h"
 #include "hfs/common.h"
 #include "hfs/bdev.h"
+#include "timer.h"
 #include "util.h"
 
 typedef struct _bdevio_device
@@ -15,21 +16,13 @@ typedef struct _bdevio_device
 static int bdevio_read(io_func *_io, off_t _addr, size_t _sz, void *_dest)
 {
 	bdevio_device_t *bdev = bdevio_device_get(_io);
-	int ret = block_device_seek(bdev->handle, seek_begin, _addr);
-	if(ret < 0)
-		return ret;
-
-	return block_device_read(bdev->handle, _dest, _sz);
+	return block_device_read_at(bdev->handle, _addr, _dest, _sz) >= 0;
 }
 
 static int bdevio_write(io_func *_io, off_t _addr, size_t _sz, void *_src)
 {
 	bdevio_device_t *bdev = bdevio_device_get(_io);
-	int ret = block_device_seek(bdev->handle, seek_begin, _addr);
-	if(ret < 0)
-		return ret;
-
-	return block_device_write(bdev->handle, _src, _sz);
+	return block_device_write_at(bdev->handle, _addr, _src, _sz) >= 0;
 }
 
 void bdevio_close(io_func *_io)
@@ -51,30 +44,241 @@ io_func *bdevio_open(block_device_handle_t _handle)
 	return &ret->io;
 }
 
-bdevfs_device_t *bdevfs_open(int _devIdx, int _pIdx)
+// Mounted volumes stay in this table after their last user closes them, so
+// the volume header and B-trees are only read once per boot. While a mount is
+// idle its allocation bitmap is flushed and its block device handle closed,
+// which lets the device finish (and flush) as it did before. Nothing is left
+// to write back at that point, so an idle mount can be dropped at any time.
+// If the bitmap can't be flushed the mount stays attached instead.
+// The on-disk volume header is remembered on detach; if it reads back any
+// different when the mount is next used, the volume was changed behind our
+// back and is mounted afresh instead.
+typedef struct _bdevfs_mount
+{
+	LinkedList list_ptr;
+	int devIdx;
+	int pIdx;
+	int refs;
+	uint32_t reuses;
+	uint32_t mountTime;
+	block_device_t *bdev;
+	bdevfs_device_t dev;
+	int headerValid;
+	uint8_t header[sizeof(HFSPlusVolumeHeader)];
+} bdevfs_mount_t;
+
+static LinkedList bdevfs_mounts = {&bdevfs_mounts, &bdevfs_mounts};
+
+#define bdevfs_mount_get(x) (CONTAINER_OF(bdevfs_mount_t, list_ptr, (x)))
+#define bdevfs_mount_from_dev(x) (CONTAINER_OF(bdevfs_mount_t, dev, (x)))
+
+static block_device_t *bdevfs_find_device(int _devIdx)
 {
 	block_device_t *dev = NULL;
 	while(_devIdx >= 0 && (dev = block_device_find(dev)))
 		_devIdx--;
 
+	return dev;
+}
+
+static bdevfs_mount_t *bdevfs_find_mount(int _devIdx, int _pIdx)
+{
+	LinkedList *ptr;
+	for(ptr = bdevfs_mounts.next; ptr != &bdevfs_mounts; ptr = ptr->next)
+	{
+		bdevfs_mount_t *mount = bdevfs_mount_get(ptr);
+		if(mount->devIdx == _devIdx && mount->pIdx == _pIdx)
+			return mount;
+	}
+
+	return NULL;
+}
+
+static int bdevfs_read_header(bdevfs_mount_t *_mount, void *_buf)
+{
+	return READ(_mount->dev.io, 1024, sizeof(HFSPlusVolumeHeader), _buf);
+}
+
+// Returns 1 if the volume changed while the mount was idle, in which case
+// the handle is left open for bdevfs_free_mount to use and close.
+static int bdevfs_attach(bdevfs_mount_t *_mount)
+{
+	uint8_t header[sizeof(HFSPlusVolumeHeader)];
+
+	// still attached, the last detach couldn't flush the bitmap
+	if(_mount->dev.handle)
+		return 0;
+
+	_mount->dev.handle = block_device_open(_mount->bdev, _mount->pIdx);
+	if(!_mount->dev.handle)
+		return -1;
+
+	bdevio_device_get(_mount->dev.io)->handle = _mount->dev.handle;
+
+	if(!_mount->headerValid || !bdevfs_read_header(_mount, header)
+			|| memcmp(header, _mount->header, sizeof(header)) != 0)
+		return 1;
+
+	return 0;
+}
+
+static void bdevfs_detach(bdevfs_mount_t *_mount)
+{
+	// The mount isn't clean until its bitmap is on disk, so keep the handle
+	// open and let the next user or the unmount try again.
+	if(!flushAllocationBitmap(_mount->dev.volume))
+	{
+		bufferPrintf("fs: Failed to flush the allocation bitmap of hd%d,%d.\r\n", _mount->devIdx, _mount->pIdx);
+		_mount->headerValid = FALSE;
+		return;
+	}
+
+	_mount->headerValid = bdevfs_read_header(_mount, _mount->header);
+	block_device_close(_mount->dev.handle);
+	_mount->dev.handle = NULL;
+	bdevio_device_get(_mount->dev.io)->handle = NULL;
+}
+
+static void bdevfs_free_mount(bdevfs_mount_t *_mount)
+{
+	LinkedList *prev = _mount->list_ptr.prev;
+	LinkedList *next = _mount->list_ptr.next;
+	prev->next = next;
+	next->prev = prev;
+
+	closeVolume(_mount->dev.volume);
+	bdevio_close(_mount->dev.io);
+	if(_mount->dev.handle)
+		block_device_close(_mount->dev.handle);
+
+	free(_mount);
+}
+
+bdevfs_device_t *bdevfs_open(int _devIdx, int _pIdx)
+{
+	block_device_t *dev = bdevfs_find_device(_devIdx);
 	if(!dev)
 		return NULL;
 
-	block_device_handle_t handle = block_device_open(dev, _pIdx);
-	if(!handle)
+	bdevfs_mount_t *mount = bdevfs_find_mount(_devIdx, _pIdx);
+	if(mount && mount->bdev != dev)
+	{
+		// The device list changed since this was mounted.
+		if(mount->refs > 0)
+			return NULL;
+
+		bdevfs_free_mount(mount);
+		mount = NULL;
+	}
+
+	if(mount && mount->refs == 0)
+	{
+		int ret = bdevfs_attach(mount);
+		if(ret < 0)
+			return NULL;
+
+		if(ret > 0)
+		{
+			bufferPrintf("fs: hd%d,%d changed while unused, remounting.\r\n", _devIdx, _pIdx);
+			bdevfs_free_mount(mount);
+			mount = NULL;
+		}
+	}
+
+	if(mount)
+	{
+		mount->refs++;
+		mount->reuses++;
+		return &mount->dev;
+	}
+
+	mount = malloc(sizeof(bdevfs_mount_t));
+	if(!mount)
+		return NULL;
+
+	memset(mount, 0, sizeof(bdevfs_mount_t));
+	mount->devIdx = _devIdx;
+	mount->pIdx = _pIdx;
+	mount->bdev = dev;
+
+	mount->dev.handle = block_device_open(dev, _pIdx);
+	if(!mount->dev.handle)
+	{
+		free(mount);
+		return NULL;
+	}
+
+	uint64_t start = timer_get_system_microtime();
+	mount->dev.io = bdevio_open(mount->dev.handle);
+	mount->dev.volume = openVolume(mount->dev.io);
+	mount->mountTime = (uint32_t)(timer_get_system_microtime() - start);
+
+	if(!mount->dev.volume)
+	{
+		bdevio_close(mount->dev.io);
+		block_device_close(mount->dev.handle);
+		free(mount);
 		return NULL;
+	}
+
+	LinkedList *prev = bdevfs_mounts.prev;
+	mount->list_ptr.prev = prev;
+	mount->list_ptr.next = &bdevfs_mounts;
+	prev->next = &mount->list_ptr;
+	bdevfs_mounts.prev = &mount->list_ptr;
 
-	bdevfs_device_t *ret = malloc(sizeof(bdevfs_device_t));
-	ret->handle = handle;
-	ret->io = bdevio_open(handle);
-	ret->volume = openVolume(ret->io);
-	return ret;
+	mount->refs = 1;
+	return &mount->dev;
 }
 
 void bdevfs_close(bdevfs_device_t *bdev)
 {
-	closeVolume(bdev->volume);
-	bdevio_close(bdev->io);
-	block_device_close(bdev->handle);
-	free(bdev);
-};
+	bdevfs_mount_t *mount = bdevfs_mount_from_dev(bdev);
+	if(mount->refs <= 0)
+		return;
+
+	mount->refs--;
+	if(mount->refs == 0)
+		bdevfs_detach(mount);
+}
+
+int bdevfs_unmount(int _devIdx, int _pIdx)
+{
+	bdevfs_mount_t *mount = bdevfs_find_mount(_devIdx, _pIdx);
+	if(!mount)
+		return 0;
+
+	if(mount->refs > 0)
+		return -1;
+
+	bdevfs_free_mount(mount);
+	return 0;
+}
+
+void bdevfs_unmount_all()
+{
+	LinkedList *ptr = bdevfs_mounts.next;
+	while(ptr != &bdevfs_mounts)
+	{
+		bdevfs_mount_t *mount = bdevfs_mount_get(ptr);
+		int devIdx = mount->devIdx;
+		int pIdx = mount->pIdx;
+		ptr = ptr->next;
+
+		if(bdevfs_unmount(devIdx, pIdx) == 0)
+			bufferPrintf("fs: Unmounted hd%d,%d.\r\n", devIdx, pIdx);
+		else
+			bufferPrintf("fs: hd%d,%d is busy.\r\n", devIdx, pIdx);
+	}
+}
+
+void bdevfs_print_mounts()
+{
+	LinkedList *ptr;
+	for(ptr = bdevfs_mounts.next; ptr != &bdevfs_mounts; ptr = ptr->next)
+	{
+		bdevfs_mount_t *mount = bdevfs_mount_get(ptr);
+		bufferPrintf("hd%d,%d: %d users, mounted in %d us, reused %d times\r\n",
+				mount->devIdx, mount->pIdx, mount->refs, mount->mountTime, mount->reuses);
+	}
+}
@@ -1,10 +1,221 @@
 #include "hfs/hfsplus.h"
 
+// Every key, record and offset lookup in this file and in catalog.c goes
+// through tree->io with a small read. The node cache sits between the tree
+// and its file: it reads whole nodes on a miss, keeps the most recently used
+// ones in memory and writes through, patching any cached copy, so the tree
+// code never sees stale data.
+#define BTREE_CACHE_NODES 16
+
+typedef struct BTCachedNode {
+	uint32_t num;
+	uint32_t lastUse;
+	int valid;
+	BTNodeDescriptor descriptor;	// host endian copy of the node descriptor
+	unsigned char* data;
+	BTKey** foldedKeys;		// per record, filled in as searches fold them
+	int numFoldedKeys;
+} BTCachedNode;
+
+struct BTNodeCache {
+	io_func io;
+	io_func* backing;
+	size_t nodeSize;
+	uint32_t clock;
+	uint32_t hits;
+	uint32_t misses;
+	BTCachedNode nodes[BTREE_CACHE_NODES];
+};
+
+#define btcache_get(x) (CONTAINER_OF(BTNodeCache, io, (x)))
+
+int BTreeNodeCacheEnabled = TRUE;
+int BTreeBinarySearchEnabled = TRUE;
+int BTreeKeyFoldingEnabled = TRUE;
+uint32_t BTreeKeyCompares = 0;
+
+static void btcacheParseDescriptor(BTCachedNode* node) {
+	memcpy(&node->descriptor, node->data, sizeof(BTNodeDescriptor));
+	FLIPENDIAN(node->descriptor.fLink);
+	FLIPENDIAN(node->descriptor.bLink);
+	FLIPENDIAN(node->descriptor.numRecords);
+}
+
+static void btcacheDropFoldedKeys(BTCachedNode* node) {
+	int i;
+
+	if(node->foldedKeys == NULL)
+		return;
+
+	for(i = 0; i < node->numFoldedKeys; i++)
+		free(node->foldedKeys[i]);
+
+	free(node->foldedKeys);
+	node->foldedKeys = NULL;
+	node->numFoldedKeys = 0;
+}
+
+static BTCachedNode* btcacheGetNode(BTNodeCache* cache, uint32_t num) {
+	BTCachedNode* victim = NULL;
+	int i;
+
+	for(i = 0; i < BTREE_CACHE_NODES; i++) {
+		BTCachedNode* node = &cache->nodes[i];
+		if(node->valid && node->num == num) {
+			node->lastUse = ++cache->clock;
+			cache->hits++;
+			return node;
+		}
+
+		if(victim == NULL || (victim->valid && (!node->valid || node->lastUse < victim->lastUse)))
+			victim = node;
+	}
+
+	cache->misses++;
+
+	btcacheDropFoldedKeys(victim);
+	victim->valid = FALSE;
+	if(!READ(cache->backing, (off_t)num * cache->nodeSize, cache->nodeSize, victim->data))
+		return NULL;
+
+	victim->num = num;
+	victim->lastUse = ++cache->clock;
+	victim->valid = TRUE;
+	btcacheParseDescriptor(victim);
+
+	return victim;
+}
+
+static void btcacheDropNode(BTNodeCache* cache, uint32_t num) {
+	int i;
+	for(i = 0; i < BTREE_CACHE_NODES; i++) {
+		if(cache->nodes[i].valid && cache->nodes[i].num == num) {
+			btcacheDropFoldedKeys(&cache->nodes[i]);
+			cache->nodes[i].valid = FALSE;
+		}
+	}
+}
+
+static int btcacheRead(io_func* io, off_t location, size_t size, void *buffer) {
+	BTNodeCache* cache = btcache_get(io);
+	unsigned char* out = (unsigned char*) buffer;
+
+	while(size > 0) {
+		uint32_t num = location / cache->nodeSize;
+		size_t nodeOffset = location - ((off_t)num * cache->nodeSize);
+		size_t toRead = cache->nodeSize - nodeOffset;
+		if(toRead > size)
+			toRead = size;
+
+		BTCachedNode* node = btcacheGetNode(cache, num);
+		if(node != NULL) {
+			memcpy(out, node->data + nodeOffset, toRead);
+		} else if(!READ(cache->backing, location, toRead, out)) {
+			return FALSE;
+		}
+
+		location += toRead;
+		out += toRead;
+		size -= toRead;
+	}
+
+	return TRUE;
+}
+
+static int btcacheWrite(io_func* io, off_t location, size_t size, void *buffer) {
+	BTNodeCache* cache = btcache_get(io);
+	int i;
+
+	if(!WRITE(cache->backing, location, size, buffer))
+		return FALSE;
+
+	for(i = 0; i < BTREE_CACHE_NODES; i++) {
+		BTCachedNode* node = &cache->nodes[i];
+		if(!node->valid)
+			continue;
+
+		off_t nodeStart = (off_t)node->num * cache->nodeSize;
+		off_t start = (location > nodeStart) ? location : nodeStart;
+		off_t end = ((location + size) < (nodeStart + cache->nodeSize)) ? (location + size) : (nodeStart + cache->nodeSize);
+		if(start >= end)
+			continue;
+
+		memcpy(node->data + (start - nodeStart), ((unsigned char*) buffer) + (start - location), end - start);
+		btcacheParseDescriptor(node);
+		btcacheDropFoldedKeys(node);
+	}
+
+	return TRUE;
+}
+
+static void btcacheClose(io_func* io) {
+	BTNodeCache* cache = btcache_get(io);
+	int i;
+
+	CLOSE(cache->backing);
+
+	for(i = 0; i < BTREE_CACHE_NODES; i++) {
+		btcacheDropFoldedKeys(&cache->nodes[i]);
+		free(cache->nodes[i].data);
+	}
+
+	free(cache);
+}
+
+static BTNodeCache* btcacheOpen(io_func* backing, size_t nodeSize) {
+	BTNodeCache* cache;
+	int i;
+
+	cache = (BTNodeCache*) malloc(sizeof(BTNodeCache));
+	if(cache == NULL)
+		return NULL;
+
+	memset(cache, 0, sizeof(BTNodeCache));
+	for(i = 0; i < BTREE_CACHE_NODES; i++) {
+		cache->nodes[i].data = (unsigned char*) malloc(nodeSize);
+		if(cache->nodes[i].data == NULL) {
+			while(--i >= 0)
+				free(cache->nodes[i].data);
+
+			free(cache);
+			return NULL;
+		}
+	}
+
+	cache->backing = backing;
+	cache->nodeSize = nodeSize;
+	cache->io.data = backing->data;
+	cache->io.read = btcacheRead;
+	cache->io.write = btcacheWrite;
+	cache->io.close = btcacheClose;
+
+	return cache;
+}
+
+void getBTreeCacheStats(BTree* tree, uint32_t* hits, uint32_t* misses) {
+	if(tree->nodeCache == NULL) {
+		*hits = 0;
+		*misses = 0;
+		return;
+	}
+
+	*hits = tree->nodeCache->hits;
+	*misses = tree->nodeCache->misses;
+}
+
 BTNodeDescriptor* readBTNodeDescriptor(uint32_t num, BTree* tree) {
 	BTNodeDescriptor* descriptor;
 
 	descriptor = (BTNodeDescriptor*) malloc(sizeof(BTNodeDescriptor));
 
+	if(tree->nodeCache != NULL) {
+		BTCachedNode* node = btcacheGetNode(tree->nodeCache, num);
+		if(node != NULL) {
+			*descriptor = node->descriptor;
+			return descriptor;
+		}
+	}
+
 	if(!READ(tree->io, num * tree->headerRec->nodeSize, sizeof(BTNodeDescriptor), descriptor))
 		return NULL;
 
@@ -15,6 +226,14 @@ BTNodeDescriptor* readBTNodeDescriptor(uint32_t num, BTree* tree) {
 	return descriptor;
 }
 
+// Read whole nodes straight from the tree's file, for callers that walk many
+// nodes once and would only push hot index nodes out of the cache. The cache
+// writes through, so the file is never behind it.
+int readBTNodes(BTree* tree, uint32_t num, uint32_t count, void* buffer) {
+	io_func* io = (tree->nodeCache != NULL) ? tree->nodeCache->backing : tree->io;
+	return READ(io, (off_t)num * tree->headerRec->nodeSize, (size_t)count * tree->headerRec->nodeSize, buffer);
+}
+
 static int writeBTNodeDescriptor(BTNodeDescriptor* descriptor, uint32_t num, BTree* tree) {
 	BTNodeDescriptor myDescriptor;
 
@@ -108,6 +327,16 @@ BTree* openBTree(io_func* io, compareFunc compare, dataReadFunc keyRead, keyWrit
 	tree->keyWrite = keyWrite;
 	tree->keyPrint = keyPrint;
 	tree->dataRead = dataRead;
+	tree->foldKey = NULL;
+	tree->foldedCompare = NULL;
+
+	tree->generation = 0;
+	tree->nodeCache = NULL;
+	if(BTreeNodeCacheEnabled) {
+		tree->nodeCache = btcacheOpen(io, tree->headerRec->nodeSize);
+		if(tree->nodeCache != NULL)
+			tree->io = &tree->nodeCache->io;
+	}
 
 	return tree;
 }
@@ -124,6 +353,15 @@ off_t getRecordOffset(int num, uint32_t nodeNum, BTree* tree) {
 
 	nodeOffset = nodeNum * tree->headerRec->nodeSize;
 
+	if(tree->nodeCache != NULL) {
+		BTCachedNode* node = btcacheGetNode(tree->nodeCache, nodeNum);
+		if(node != NULL) {
+			memcpy(&offset, node->data + tree->headerRec->nodeSize - (sizeof(uint16_t) * (num + 1)), sizeof(uint16_t));
+			FLIPENDIAN(offset);
+			return (nodeOffset + offset);
+		}
+	}
+
 	if(!READ(tree->io, nodeOffset + tree->headerRec->nodeSize - (sizeof(uint16_t) * (num + 1)), sizeof(uint16_t), &offset)) {
 		hfs_panic("cannot get record offset!");
 	}
@@ -170,10 +408,66 @@ off_t getNodeNumberFromPointerRecord(off_t offset, io_func* io) {
 	return nodeNum;
 }
 
-static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact, uint32_t *nodeNumber, int *recordNumber) {
-	BTNodeDescriptor* descriptor;
+// Returns the folded key of a record, folding it on first use and keeping it
+// with the cached node until the node is written or evicted.
+static BTKey* getFoldedKey(BTree* tree, uint32_t nodeNum, int num, off_t recordOffset) {
+	BTCachedNode* node;
 	BTKey* key;
+
+	node = btcacheGetNode(tree->nodeCache, nodeNum);
+	if(node == NULL || num >= node->descriptor.numRecords)
+		return NULL;
+
+	if(node->foldedKeys == NULL) {
+		node->foldedKeys = (BTKey**) malloc(sizeof(BTKey*) * node->descriptor.numRecords);
+		if(node->foldedKeys == NULL)
+			return NULL;
+
+		memset(node->foldedKeys, 0, sizeof(BTKey*) * node->descriptor.numRecords);
+		node->numFoldedKeys = node->descriptor.numRecords;
+	}
+
+	if(node->foldedKeys[num] == NULL) {
+		key = READ_KEY(tree, recordOffset, tree->io);
+		if(key == NULL)
+			return NULL;
+
+		node->foldedKeys[num] = (*tree->foldKey)(key);
+		free(key);
+	}
+
+	return node->foldedKeys[num];
+}
+
+// Compares record num of a node against the search key, setting the offset of
+// the record's data. With a folded search key the comparison runs on folded
+// keys, which keep the on-disk keyLength so the data offset still works out.
+static int compareRecord(BTree* tree, uint32_t nodeNum, int num, BTKey* searchKey, BTKey* foldedSearchKey, off_t* recordDataOffset) {
 	off_t recordOffset;
+	BTKey* key;
+	int res;
+
+	recordOffset = getRecordOffset(num, nodeNum, tree);
+	BTreeKeyCompares++;
+
+	if(foldedSearchKey != NULL) {
+		key = getFoldedKey(tree, nodeNum, num, recordOffset);
+		if(key != NULL) {
+			*recordDataOffset = recordOffset + key->keyLength + sizeof(key->keyLength);
+			return (*tree->foldedCompare)(key, foldedSearchKey);
+		}
+	}
+
+	key = READ_KEY(tree, recordOffset, tree->io);
+	*recordDataOffset = recordOffset + key->keyLength + sizeof(key->keyLength);
+	res = COMPARE(tree, key, searchKey);
+	free(key);
+
+	return res;
+}
+
+static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, BTKey* foldedSearchKey, int *exact, uint32_t *nodeNumber, int *recordNumber) {
+	BTNodeDescriptor* descriptor;
 	off_t recordDataOffset;
 	off_t lastRecordDataOffset;
 
@@ -188,12 +482,7 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
 	lastRecordDataOffset = 0;
 
 	for(i = 0; i < descriptor->numRecords; i++) {
-		recordOffset = getRecordOffset(i, root, tree);
-		key = READ_KEY(tree, recordOffset, tree->io);
-		recordDataOffset = recordOffset + key->keyLength + sizeof(key->keyLength);
-
-		res = COMPARE(tree, key, searchKey);
-		free(key);
+		res = compareRecord(tree, root, i, searchKey, foldedSearchKey, &recordDataOffset);
 		if(res == 0) {
 			if(descriptor->kind == kBTLeafNode) {
 				if(nodeNumber != NULL)
@@ -211,7 +500,7 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
 			} else {
 
 				free(descriptor);
-				return searchNode(tree, getNodeNumberFromPointerRecord(recordDataOffset, tree->io), searchKey, exact, nodeNumber, recordNumber);
+				return searchNode(tree, getNodeNumberFromPointerRecord(recordDataOffset, tree->io), searchKey, foldedSearchKey, exact, nodeNumber, recordNumber);
 			}
 		} else if(res > 0) {
 			break;
@@ -240,12 +529,103 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
 	} else {
 
 		free(descriptor);
-		return searchNode(tree, getNodeNumberFromPointerRecord(lastRecordDataOffset, tree->io), searchKey, exact, nodeNumber, recordNumber);
+		return searchNode(tree, getNodeNumberFromPointerRecord(lastRecordDataOffset, tree->io), searchKey, foldedSearchKey, exact, nodeNumber, recordNumber);
 	}      
 }
 
+// Finds the last record in the node whose key is not greater than searchKey,
+// probing the sorted records by bisection. Returns -1 if every key is greater.
+static int findRecordInNode(BTree* tree, uint32_t node, int numRecords, BTKey* searchKey, BTKey* foldedSearchKey, int* exact, off_t* recordDataOffset) {
+	off_t dataOffset;
+	int lo;
+	int hi;
+	int mid;
+	int res;
+	int found;
+
+	found = -1;
+	*exact = FALSE;
+
+	lo = 0;
+	hi = numRecords - 1;
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+
+		res = compareRecord(tree, node, mid, searchKey, foldedSearchKey, &dataOffset);
+
+		if(res <= 0) {
+			found = mid;
+			*recordDataOffset = dataOffset;
+		}
+
+		if(res == 0) {
+			*exact = TRUE;
+			break;
+		} else if(res < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+static void* searchNodeBisect(BTree* tree, uint32_t root, BTKey* searchKey, BTKey* foldedSearchKey, int *exact, uint32_t *nodeNumber, int *recordNumber) {
+	BTNodeDescriptor* descriptor;
+	off_t recordDataOffset;
+	int found;
+	int i;
+
+	descriptor = readBTNodeDescriptor(root, tree);
+
+	if(descriptor == NULL)
+		return NULL;
+
+	i = findRecordInNode(tree, root, descriptor->numRecords, searchKey, foldedSearchKey, &found, &recordDataOffset);
+
+	if(i < 0) {
+		free(descriptor);
+		hfs_panic("BTree inconsistent!");
+		return NULL;
+	}
+
+	if(descriptor->kind == kBTLeafNode) {
+		if(nodeNumber != NULL)
+			*nodeNumber = root;
+
+		// like the linear scan, an inexact match reports the first record past the search key
+		if(recordNumber != NULL)
+			*recordNumber = found ? i : (i + 1);
+
+		if(exact != NULL)
+			*exact = found;
+
+		free(descriptor);
+		return READ_DATA(tree, recordDataOffset, tree->io);
+	} else {
+		free(descriptor);
+		return searchNodeBisect(tree, getNodeNumberFromPointerRecord(recordDataOffset, tree->io), searchKey, foldedSearchKey, exact, nodeNumber, recordNumber);
+	}
+}
+
 void* search(BTree* tree, BTKey* searchKey, int *exact, uint32_t *nodeNumber, int *recordNumber) {
-	return searchNode(tree, tree->headerRec->rootNode, searchKey, exact, nodeNumber, recordNumber);
+	BTKey* foldedSearchKey = NULL;
+	void* ret;
+
+	// the search key is folded once here, node keys as they are first compared
+	if(BTreeKeyFoldingEnabled && tree->foldKey != NULL && tree->nodeCache != NULL)
+		foldedSearchKey = (*tree->foldKey)(searchKey);
+
+	if(BTreeBinarySearchEnabled)
+		ret = searchNodeBisect(tree, tree->headerRec->rootNode, searchKey, foldedSearchKey, exact, nodeNumber, recordNumber);
+	else
+		ret = searchNode(tree, tree->headerRec->rootNode, searchKey, foldedSearchKey, exact, nodeNumber, recordNumber);
+
+	if(foldedSearchKey != NULL)
+		free(foldedSearchKey);
+
+	return ret;
 }
 
 static uint32_t findFree(BTree* tree) {
@@ -419,6 +799,7 @@ static uint32_t getNewNode(BTree* tree) {
 }
 
 static uint32_t removeNode(BTree* tree, uint32_t node) {
+	uint32_t removed = node;
 	unsigned char byte;
 	off_t mapRecordStart;
 	uint32_t mapNode;
@@ -484,6 +865,9 @@ static uint32_t removeNode(BTree* tree, uint32_t node) {
 	ASSERT(WRITE(tree->io, mapRecordStart + (node / 8), 1, &byte), "WRITE");
 	ASSERT(writeBTHeaderRec(tree), "writeBTHeaderRec");
 
+	if(tree->nodeCache != NULL)
+		btcacheDropNode(tree->nodeCache, removed);
+
 	return TRUE;
 }
 
@@ -898,6 +1282,8 @@ int addToBTree(BTree* tree, BTKey* searchKey, size_t length, unsigned char* cont
 	uint16_t freeOffset;
 	uint32_t newNode;
 
+	tree->generation++;
+
 	if(tree->headerRec->rootNode != 0) {
 		do {
 			callAgain = FALSE;
@@ -1116,6 +1502,8 @@ int removeFromBTree(BTree* tree, BTKey* searchKey) {
 	int gone;
 	uint32_t newNode;
 
+	tree->generation++;
+
 	do {
 		callAgain = FALSE;
 		newNode = removeRecord(tree, tree->headerRec->rootNode, searchKey, &callAgain, &gone);
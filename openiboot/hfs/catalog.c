@@ -194,6 +194,42 @@ static int catalogCompareCS(BTKey* vLeft, BTKey* vRight) {
 	}
 }
 
+// Folded keys carry the name as FastUnicodeCompare would see it, so searches
+// on case folding volumes can order them with a plain comparison. keyLength
+// is left as read from disk since the tree uses it to find the record data.
+static BTKey* catalogFoldKey(BTKey* vKey) {
+	HFSPlusCatalogKey* key;
+	HFSPlusCatalogKey* folded;
+
+	key = (HFSPlusCatalogKey*) vKey;
+
+	folded = (HFSPlusCatalogKey*) malloc(UNICODE_START + (key->nodeName.length * sizeof(uint16_t)));
+	if(folded == NULL)
+		return NULL;
+
+	folded->keyLength = key->keyLength;
+	folded->parentID = key->parentID;
+	folded->nodeName.length = FoldUnicodeString(folded->nodeName.unicode, key->nodeName.unicode, key->nodeName.length);
+
+	return (BTKey*)folded;
+}
+
+static int catalogFoldedCompare(BTKey* vLeft, BTKey* vRight) {
+	HFSPlusCatalogKey* left;
+	HFSPlusCatalogKey* right;
+
+	left = (HFSPlusCatalogKey*) vLeft;
+	right =(HFSPlusCatalogKey*) vRight;
+
+	if(left->parentID < right->parentID) {
+		return -1;
+	} else if(left->parentID > right->parentID) {
+		return 1;
+	} else {
+		return FoldedUnicodeCompare(left->nodeName.unicode, left->nodeName.length, right->nodeName.unicode, right->nodeName.length);
+	}
+}
+
 static BTKey* catalogKeyRead(off_t offset, io_func* io) {
 	HFSPlusCatalogKey* key;
 	uint16_t i;
@@ -340,76 +376,262 @@ HFSPlusCatalogRecord* getRecordByCNID(HFSCatalogNodeID CNID, Volume* volume) {
 		return record;
 }
 
-CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume) {
-	BTree* tree;
-	HFSPlusCatalogThread* record; 
-	HFSPlusCatalogKey key;
+// Folder enumeration reads each leaf node once and decodes records out of
+// that copy. When a leaf's fLink sibling is the next node in the file, both
+// are read together, so a long folder streams in two nodes per read. The
+// entry handed back lives in the iterator and is reused on every call.
+struct CatalogFolderIterator {
+	Volume* volume;
+	HFSCatalogNodeID folderID;
+	const char* filter;
+	size_t nodeSize;
 	uint32_t nodeNumber;
 	int recordNumber;
+	int numRecords;
+	uint32_t fLink;
+	int havePrefetch;
+	int done;
+	unsigned char* nodes;	// room for a leaf and its prefetched sibling
+	unsigned char* node;	// the leaf being walked, inside nodes
+	HFSUniStr255 name;
+	union {
+		HFSPlusCatalogFolder folder;
+		HFSPlusCatalogFile file;
+	} entry;
+};
+
+static uint16_t nodeUInt16(const unsigned char* data) {
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+	FLIPENDIAN(value);
+	return value;
+}
 
-	BTNodeDescriptor* descriptor;
-	off_t recordOffset;
-	off_t recordDataOffset;
-	HFSPlusCatalogKey* currentKey;
+static uint32_t nodeUInt32(const unsigned char* data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	FLIPENDIAN(value);
+	return value;
+}
 
-	CatalogRecordList* list;
-	CatalogRecordList* lastItem = NULL;
-	CatalogRecordList* item;
+static int loadFolderLeaf(CatalogFolderIterator* iterator, uint32_t num) {
+	BTree* tree = iterator->volume->catalogTree;
+	BTNodeDescriptor descriptor;
 
-	tree = volume->catalogTree;
+	if(iterator->havePrefetch && num == (iterator->nodeNumber + 1)) {
+		iterator->node = iterator->nodes + iterator->nodeSize;
+		iterator->havePrefetch = FALSE;
+	} else {
+		iterator->node = iterator->nodes;
+		iterator->havePrefetch = FALSE;
+		if((num + 1) < tree->headerRec->totalNodes && readBTNodes(tree, num, 2, iterator->nodes))
+			iterator->havePrefetch = TRUE;
+		else if(!readBTNodes(tree, num, 1, iterator->nodes))
+			return FALSE;
+	}
+
+	memcpy(&descriptor, iterator->node, sizeof(BTNodeDescriptor));
+	FLIPENDIAN(descriptor.fLink);
+	FLIPENDIAN(descriptor.numRecords);
+
+	if(descriptor.kind != kBTLeafNode)
+		return FALSE;
+
+	if(descriptor.fLink != (num + 1))
+		iterator->havePrefetch = FALSE;
+
+	iterator->nodeNumber = num;
+	iterator->recordNumber = 0;
+	iterator->numRecords = descriptor.numRecords;
+	iterator->fLink = descriptor.fLink;
+
+	return TRUE;
+}
+
+static uint16_t foldASCII(uint16_t c) {
+	if(c >= 'A' && c <= 'Z')
+		return c + ('a' - 'A');
+
+	return c;
+}
+
+// Case insensitive glob, '*' matches any run of characters and '?' any one.
+static int matchFolderFilter(HFSUniStr255* name, const char* filter) {
+	const char* f = filter;
+	const char* starFilter = NULL;
+	int starName = 0;
+	int n = 0;
+
+	while(n < name->length) {
+		if(*f == '*') {
+			starFilter = ++f;
+			starName = n;
+		} else if(*f != '\0' && (*f == '?' || foldASCII(name->unicode[n]) == foldASCII((unsigned char)*f))) {
+			f++;
+			n++;
+		} else if(starFilter != NULL) {
+			f = starFilter;
+			n = ++starName;
+		} else {
+			return FALSE;
+		}
+	}
+
+	while(*f == '*')
+		f++;
+
+	return (*f == '\0');
+}
+
+CatalogFolderIterator* openFolderIterator(HFSCatalogNodeID CNID, Volume* volume, const char* filter) {
+	CatalogFolderIterator* iterator;
+	HFSPlusCatalogThread* record;
+	HFSPlusCatalogKey key;
+	uint32_t nodeNumber;
+	int recordNumber;
 
 	key.keyLength = sizeof(key.parentID) + sizeof(key.nodeName.length);
 	key.parentID = CNID;
 	key.nodeName.length = 0;
 
-	list = NULL;
-
-	record = (HFSPlusCatalogThread*) search(tree, (BTKey*)(&key), NULL, &nodeNumber, &recordNumber);
-
+	record = (HFSPlusCatalogThread*) search(volume->catalogTree, (BTKey*)(&key), NULL, &nodeNumber, &recordNumber);
 	if(record == NULL)
 		return NULL;
 
 	free(record);
 
-	++recordNumber;
+	iterator = (CatalogFolderIterator*) malloc(sizeof(CatalogFolderIterator));
+	if(iterator == NULL)
+		return NULL;
 
-	while(nodeNumber != 0) {    
-		descriptor = readBTNodeDescriptor(nodeNumber, tree);
+	memset(iterator, 0, sizeof(CatalogFolderIterator));
+	iterator->volume = volume;
+	iterator->folderID = CNID;
+	iterator->filter = (filter != NULL && *filter != '\0') ? filter : NULL;
+	iterator->nodeSize = volume->catalogTree->headerRec->nodeSize;
+	iterator->nodes = (unsigned char*) malloc(iterator->nodeSize * 2);
 
-		while(recordNumber < descriptor->numRecords) {
-			recordOffset = getRecordOffset(recordNumber, nodeNumber, tree);
-			currentKey = (HFSPlusCatalogKey*) READ_KEY(tree, recordOffset, tree->io);
-			recordDataOffset = recordOffset + currentKey->keyLength + sizeof(currentKey->keyLength);
+	if(iterator->nodes == NULL || !loadFolderLeaf(iterator, nodeNumber)) {
+		closeFolderIterator(iterator);
+		return NULL;
+	}
 
-			if(currentKey->parentID == CNID) {
-				item = (CatalogRecordList*) malloc(sizeof(CatalogRecordList));
-				item->name = currentKey->nodeName;
-				item->record = (HFSPlusCatalogRecord*) READ_DATA(tree, recordDataOffset, tree->io);
-				item->next = NULL;
+	iterator->recordNumber = recordNumber + 1;
 
-				if(list == NULL) {
-					list = item;
-				} else {
-					lastItem->next = item;
-				}
+	return iterator;
+}
 
-				lastItem = item;
-				free(currentKey);
-			} else {
-				free(currentKey);
-				free(descriptor);
-				return list;
-			}
+int nextFolderEntry(CatalogFolderIterator* iterator, HFSUniStr255** name, HFSPlusCatalogRecord** record) {
+	while(!iterator->done) {
+		unsigned char* node = iterator->node;
+		size_t nodeSize = iterator->nodeSize;
+		size_t recordSize;
+		uint16_t offset;
+		uint16_t keyLength;
+		uint16_t nameLength;
+		int16_t recordType;
+		uint16_t i;
+
+		if(iterator->recordNumber >= iterator->numRecords) {
+			if(iterator->fLink == 0 || !loadFolderLeaf(iterator, iterator->fLink))
+				iterator->done = TRUE;
 
-			recordNumber++;
+			continue;
+		}
+
+		offset = nodeUInt16(node + nodeSize - (sizeof(uint16_t) * (iterator->recordNumber + 1)));
+		iterator->recordNumber++;
+
+		if((offset + UNICODE_START) > nodeSize || nodeUInt32(node + offset + sizeof(uint16_t)) != iterator->folderID) {
+			iterator->done = TRUE;
+			continue;
 		}
 
-		nodeNumber = descriptor->fLink;
-		recordNumber = 0;
+		keyLength = nodeUInt16(node + offset);
+		nameLength = nodeUInt16(node + offset + sizeof(uint16_t) + sizeof(HFSCatalogNodeID));
+		if(nameLength > 255 || (offset + UNICODE_START + (nameLength * sizeof(uint16_t))) > nodeSize) {
+			iterator->done = TRUE;
+			continue;
+		}
+
+		iterator->name.length = nameLength;
+		for(i = 0; i < nameLength; i++) {
+			iterator->name.unicode[i] = nodeUInt16(node + offset + UNICODE_START + (i * sizeof(uint16_t)));
+			if(iterator->name.unicode[i] == '/') /* ugly hack that iPhone seems to do */
+				iterator->name.unicode[i] = ':';
+		}
+
+		if(iterator->filter != NULL && !matchFolderFilter(&iterator->name, iterator->filter))
+			continue;
+
+		offset += sizeof(uint16_t) + keyLength;
+		if((offset + sizeof(int16_t)) > nodeSize)
+			continue;
+
+		recordType = nodeUInt16(node + offset);
+		if(recordType == kHFSPlusFolderRecord)
+			recordSize = sizeof(HFSPlusCatalogFolder);
+		else if(recordType == kHFSPlusFileRecord)
+			recordSize = sizeof(HFSPlusCatalogFile);
+		else
+			continue;
+
+		if((offset + recordSize) > nodeSize)
+			continue;
+
+		memcpy(&iterator->entry, node + offset, recordSize);
+		if(recordType == kHFSPlusFolderRecord)
+			flipCatalogFolder(&iterator->entry.folder);
+		else
+			flipCatalogFile(&iterator->entry.file);
+
+		*name = &iterator->name;
+		*record = (HFSPlusCatalogRecord*) &iterator->entry;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+void closeFolderIterator(CatalogFolderIterator* iterator) {
+	free(iterator->nodes);
+	free(iterator);
+}
+
+CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume) {
+	CatalogFolderIterator* iterator;
+	HFSUniStr255* name;
+	HFSPlusCatalogRecord* record;
+	size_t recordSize;
+
+	CatalogRecordList* list = NULL;
+	CatalogRecordList* lastItem = NULL;
+	CatalogRecordList* item;
+
+	iterator = openFolderIterator(CNID, volume, NULL);
+	if(iterator == NULL)
+		return NULL;
+
+	while(nextFolderEntry(iterator, &name, &record)) {
+		recordSize = (record->recordType == kHFSPlusFolderRecord) ? sizeof(HFSPlusCatalogFolder) : sizeof(HFSPlusCatalogFile);
+
+		item = (CatalogRecordList*) malloc(sizeof(CatalogRecordList));
+		item->name = *name;
+		item->record = (HFSPlusCatalogRecord*) malloc(recordSize);
+		memcpy(item->record, record, recordSize);
+		item->next = NULL;
+
+		if(list == NULL) {
+			list = item;
+		} else {
+			lastItem->next = item;
+		}
 
-		free(descriptor);
+		lastItem = item;
 	}
 
+	closeFolderIterator(iterator);
+
 	return list;
 }
 
@@ -441,6 +663,155 @@ HFSPlusCatalogRecord* getLinkTarget(HFSPlusCatalogRecord* record, HFSCatalogNode
 	}
 }
 
+// Remembers what searching the catalog for (parentID, name) returned, including
+// misses, so repeated path lookups skip the B-tree walk for every component.
+// Any insert into or removal from the catalog tree bumps its generation, which
+// empties the cache before the next lookup.
+#define DENTRY_CACHE_SIZE 128
+#define DENTRY_NAME_MAX 64
+
+typedef struct CatalogDentry {
+	int valid;
+	HFSCatalogNodeID parentID;
+	char name[DENTRY_NAME_MAX];
+	HFSPlusCatalogRecord* record;	// NULL for a name that does not exist
+	size_t recordSize;
+} CatalogDentry;
+
+struct CatalogDentryCache {
+	uint32_t generation;
+	uint32_t hits;
+	uint32_t misses;
+	CatalogDentry entries[DENTRY_CACHE_SIZE];
+};
+
+int CatalogDentryCacheEnabled = TRUE;
+
+static void flushDentryCache(CatalogDentryCache* cache) {
+	int i;
+	for(i = 0; i < DENTRY_CACHE_SIZE; i++) {
+		if(cache->entries[i].valid)
+			free(cache->entries[i].record);
+
+		cache->entries[i].valid = FALSE;
+	}
+}
+
+void closeDentryCache(Volume* volume) {
+	if(volume->dentryCache == NULL)
+		return;
+
+	flushDentryCache(volume->dentryCache);
+	free(volume->dentryCache);
+	volume->dentryCache = NULL;
+}
+
+void getDentryCacheStats(Volume* volume, uint32_t* hits, uint32_t* misses) {
+	if(volume->dentryCache == NULL) {
+		*hits = 0;
+		*misses = 0;
+		return;
+	}
+
+	*hits = volume->dentryCache->hits;
+	*misses = volume->dentryCache->misses;
+}
+
+static CatalogDentry* findDentry(Volume* volume, HFSCatalogNodeID parentID, const char* name) {
+	CatalogDentryCache* cache;
+	uint32_t hash;
+	const char* c;
+
+	if(!CatalogDentryCacheEnabled || strlen(name) >= DENTRY_NAME_MAX)
+		return NULL;
+
+	if(volume->dentryCache == NULL) {
+		volume->dentryCache = (CatalogDentryCache*) malloc(sizeof(CatalogDentryCache));
+		if(volume->dentryCache == NULL)
+			return NULL;
+
+		memset(volume->dentryCache, 0, sizeof(CatalogDentryCache));
+		volume->dentryCache->generation = volume->catalogTree->generation;
+	}
+
+	cache = volume->dentryCache;
+	if(cache->generation != volume->catalogTree->generation) {
+		flushDentryCache(cache);
+		cache->generation = volume->catalogTree->generation;
+	}
+
+	hash = parentID * 31;
+	for(c = name; *c != '\0'; c++)
+		hash = (hash * 31) + *c;
+
+	return &cache->entries[hash % DENTRY_CACHE_SIZE];
+}
+
+static size_t catalogRecordSize(HFSPlusCatalogRecord* record) {
+	switch(record->recordType) {
+		case kHFSPlusFolderRecord:
+			return sizeof(HFSPlusCatalogFolder);
+		case kHFSPlusFileRecord:
+			return sizeof(HFSPlusCatalogFile);
+		default:
+			return 0;
+	}
+}
+
+// Looks up key->parentID/name in the catalog, with the semantics of an exact search:
+// returns a freshly allocated record, or NULL if there is no such entry.
+static HFSPlusCatalogRecord* lookupCatalogEntry(HFSPlusCatalogKey* key, const char* name, Volume* volume) {
+	HFSPlusCatalogRecord* record;
+	CatalogDentry* dentry;
+	int exact;
+
+	dentry = findDentry(volume, key->parentID, name);
+	if(dentry != NULL && dentry->valid && dentry->parentID == key->parentID && strcmp(dentry->name, name) == 0) {
+		volume->dentryCache->hits++;
+
+		if(dentry->record == NULL)
+			return NULL;
+
+		record = (HFSPlusCatalogRecord*) malloc(dentry->recordSize);
+		memcpy(record, dentry->record, dentry->recordSize);
+		return record;
+	}
+
+	record = (HFSPlusCatalogRecord*) search(volume->catalogTree, (BTKey*)key, &exact, NULL, NULL);
+	if(record != NULL && exact == FALSE) {
+		free(record);
+		record = NULL;
+	}
+
+	if(dentry == NULL)
+		return record;
+
+	volume->dentryCache->misses++;
+
+	size_t recordSize = (record != NULL) ? catalogRecordSize(record) : 0;
+	if(record != NULL && recordSize == 0)
+		return record;
+
+	if(dentry->valid)
+		free(dentry->record);
+
+	dentry->valid = TRUE;
+	dentry->parentID = key->parentID;
+	strcpy(dentry->name, name);
+	dentry->recordSize = recordSize;
+	dentry->record = NULL;
+
+	if(record != NULL) {
+		dentry->record = (HFSPlusCatalogRecord*) malloc(recordSize);
+		if(dentry->record == NULL)
+			dentry->valid = FALSE;
+		else
+			memcpy(dentry->record, record, recordSize);
+	}
+
+	return record;
+}
+
 HFSPlusCatalogRecord* getRecordFromPath(const char* path, Volume* volume, char **name, HFSPlusCatalogKey* retKey) {
 	return getRecordFromPath2(path, volume, name, retKey, TRUE);
 }
@@ -453,10 +824,12 @@ HFSPlusCatalogRecord* getRecordFromPath3(const char* path, Volume* volume, char
 	HFSPlusCatalogKey key;
 	HFSPlusCatalogRecord* record;
 
-	char* origPath;
-	char* myPath;
-	char* word;
-	char* pathLimit;
+	char component[256];
+	const char* word;
+	const char* wordEnd;
+	const char* nextWord;
+	const char* pathLimit;
+	size_t wordLength;
 
 	uint32_t realParent = 0;
 
@@ -480,9 +853,6 @@ HFSPlusCatalogRecord* getRecordFromPath3(const char* path, Volume* volume, char
 		return record;
 	}
 
-	myPath = strdup(path);
-	origPath = myPath;
-
 	record = NULL;
 
 	if(path[0] == '/') {
@@ -491,69 +861,64 @@ HFSPlusCatalogRecord* getRecordFromPath3(const char* path, Volume* volume, char
 		key.parentID = parentID;
 	}
 
-	pathLimit = myPath + strlen(myPath);
-	word = myPath;
-	char* nextWord = word;
+	pathLimit = path + strlen(path);
+	nextWord = path;
 
 	while(TRUE) {
 		word = nextWord;
 		if(*word == '\0')
 			break;
 
-		while(*nextWord != '/' && *nextWord != '\0')
-			nextWord++;
+		wordEnd = word;
+		while(*wordEnd != '/' && *wordEnd != '\0')
+			wordEnd++;
 
-		if(*nextWord != '\0') {
-			*nextWord = '\0';
-			nextWord++;
-		}
+		wordLength = wordEnd - word;
+		nextWord = (*wordEnd != '\0') ? (wordEnd + 1) : wordEnd;
 
 		if(name != NULL)
-			*name = (char*)(path + (word - origPath));
+			*name = (char*)word;
 
 		if(record != NULL) {
 			free(record);
 			record = NULL;
 		}
 
-		if(word[0] == '\0') {
+		if(wordLength == 0) {
 			continue;
 		}
 
-		ASCIIToUnicode(word, &key.nodeName);
+		// HFS+ names are at most 255 characters long
+		if(wordLength >= sizeof(component))
+			return NULL;
+
+		memcpy(component, word, wordLength);
+		component[wordLength] = '\0';
+
+		ASCIIToUnicode(component, &key.nodeName);
 
 		key.keyLength = sizeof(key.parentID) + sizeof(key.nodeName.length) + (sizeof(uint16_t) * key.nodeName.length);
-		record = (HFSPlusCatalogRecord*) search(volume->catalogTree, (BTKey*)(&key), &exact, NULL, NULL);
+		record = lookupCatalogEntry(&key, component, volume);
 
-		if(record == NULL || exact == FALSE) {
-			free(origPath);
-			if(record != NULL) {
-				free(record);
-			}
+		if(record == NULL)
 			return NULL;
-		}
 
 		if(traverse) {
-			if(((word + strlen(word) + 1) < pathLimit) || returnLink) {
+			if(((word + wordLength + 1) < pathLimit) || returnLink) {
 				record = getLinkTarget(record, key.parentID, &key, volume);
-				if(record == NULL || exact == FALSE) {
-					free(origPath);
+				if(record == NULL)
 					return NULL;
-				}
 			}
 		}
 
 		if(record->recordType == kHFSPlusFileRecord) {	
-			if((word + strlen(word) + 1) >= pathLimit) {
-				free(origPath);
-
+			if((word + wordLength + 1) >= pathLimit) {
 				if(retKey != NULL) {
 					memcpy(retKey, &key, sizeof(HFSPlusCatalogKey));
 				}
 
 				return record;
 			} else {
-				free(origPath);
 				free(record);
 				return NULL;
 			}
@@ -571,7 +936,6 @@ HFSPlusCatalogRecord* getRecordFromPath3(const char* path, Volume* volume, char
 		retKey->parentID = realParent;
 	}
 
-	free(origPath);
 	return record;
 }
 
@@ -1093,6 +1457,8 @@ BTree* openCatalogTree(io_func* file) {
 
 	if(btree->headerRec->keyCompareType == kHFSCaseFolding) {
 		btree->compare = &catalogCompareCS;
+		btree->foldKey = &catalogFoldKey;
+		btree->foldedCompare = &catalogFoldedCompare;
 	}
 
 	return btree;
@@ -375,15 +375,62 @@ uint16_t gLowerCaseTable[] = {
             0xFFF8, 0xFFF9, 0xFFFA, 0xFFFB, 0xFFFC, 0xFFFD, 0xFFFE, 0xFFFF,
 };
 
+/*  Names are nearly always plain ASCII, which has no ignorable characters and
+    only A-Z to fold. While both strings are ASCII they stay in step, so four
+    code units can be checked at once and only the differing ones folded.
+ */
+
+#define ASCII_CHUNK_MASK 0xFF80FF80FF80FF80ULL
+
+static inline int asciiChunk(const uint16_t* str, uint64_t* chunk)
+{
+    uint64_t value;
+
+    memcpy(&value, str, sizeof(value));
+    *chunk = value;
+
+    /* NUL folds to 0xFFFF, so leave it to the table */
+    return (value & ASCII_CHUNK_MASK) == 0
+        && (value & 0x000000000000FFFFULL) && (value & 0x00000000FFFF0000ULL)
+        && (value & 0x0000FFFF00000000ULL) && (value & 0xFFFF000000000000ULL);
+}
+
+static inline uint16_t foldASCII(uint16_t c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+    if (c == ':')
+        return '/';
+    return c;
+}
+
 int32_t FastUnicodeCompare ( register uint16_t str1[], register uint16_t length1,
                             register uint16_t str2[], register uint16_t length2)
 {
     register uint16_t     c1,c2;
     register uint16_t     temp;
     register uint16_t*    lowerCaseTable;
+    uint64_t              chunk1, chunk2;
+    int                   i;
 
     lowerCaseTable = gLowerCaseTable;
 
+    while (length1 >= 4 && length2 >= 4 && asciiChunk(str1, &chunk1) && asciiChunk(str2, &chunk2)) {
+        if (chunk1 != chunk2) {
+            for (i = 0; i < 4; i++) {
+                c1 = foldASCII(str1[i]);
+                c2 = foldASCII(str2[i]);
+                if (c1 != c2)
+                    return (c1 < c2) ? -1 : 1;
+            }
+        }
+
+        str1 += 4;
+        str2 += 4;
+        length1 -= 4;
+        length2 -= 4;
+    }
+
     while (1) {
         c1 = 0;
         c2 = 0;
@@ -415,3 +462,58 @@ int32_t FastUnicodeCompare ( register uint16_t str1[], register uint16_t length1
     else
         return 1;
 }
+
+/*  Folds a name the way FastUnicodeCompare sees it: ignorable characters are
+    dropped, the rest are lower cased and ':' becomes '/'. Two folded names
+    order the same as the originals under a plain code unit comparison.
+    Returns the folded length; dest needs room for length units.
+ */
+uint16_t FoldUnicodeString(uint16_t dest[], const uint16_t src[], uint16_t length)
+{
+    uint16_t    c;
+    uint16_t    temp;
+    uint16_t    folded = 0;
+
+    while (length--) {
+        c = *(src++);
+        if (c < 0x80) {
+            c = foldASCII(c);
+            if (c == 0)
+                c = 0xFFFF;
+        } else if ((temp = gLowerCaseTable[c>>8]) != 0) {
+            c = gLowerCaseTable[temp + (c & 0x00FF)];
+            if (c == 0)
+                continue;
+        }
+
+        dest[folded++] = c;
+    }
+
+    return folded;
+}
+
+int32_t FoldedUnicodeCompare ( const uint16_t str1[], uint16_t length1,
+                              const uint16_t str2[], uint16_t length2)
+{
+    uint64_t    chunk1, chunk2;
+    uint16_t    length = (length1 < length2) ? length1 : length2;
+    uint16_t    i = 0;
+
+    while ((i + 4) <= length) {
+        memcpy(&chunk1, str1 + i, sizeof(chunk1));
+        memcpy(&chunk2, str2 + i, sizeof(chunk2));
+        if (chunk1 != chunk2)
+            break;
+        i += 4;
+    }
+
+    for (; i < length; i++) {
+        if (str1[i] != str2[i])
+            return (str1[i] < str2[i]) ? -1 : 1;
+    }
+
+    if (length1 == length2)
+        return 0;
+
+    return (length1 < length2) ? -1 : 1;
+}
@@ -4,6 +4,7 @@
 #include "hfs/bdev.h"
 #include "hfs/fs.h"
 #include "hfs/hfsplus.h"
+#include "timer.h"
 #include "util.h"
 
 int HasFSInit = FALSE;
@@ -55,23 +56,26 @@ int add_hfs(Volume* volume, uint8_t* buffer, size_t size, const char* outFileNam
 	return ret;
 }
 
-void displayFolder(HFSCatalogNodeID folderID, Volume* volume) {
-	CatalogRecordList* list;
-	CatalogRecordList* theList;
+void displayFolder(HFSCatalogNodeID folderID, Volume* volume, const char* filter) {
+	CatalogFolderIterator* iterator;
+	HFSUniStr255* name;
+	HFSPlusCatalogRecord* record;
 	HFSPlusCatalogFolder* folder;
 	HFSPlusCatalogFile* file;
 	
-	theList = list = getFolderContents(folderID, volume);
+	iterator = openFolderIterator(folderID, volume, filter);
+	if(iterator == NULL)
+		return;
 	
-	while(list != NULL) {
-		if(list->record->recordType == kHFSPlusFolderRecord) {
-			folder = (HFSPlusCatalogFolder*)list->record;
+	while(nextFolderEntry(iterator, &name, &record)) {
+		if(record->recordType == kHFSPlusFolderRecord) {
+			folder = (HFSPlusCatalogFolder*)record;
 			bufferPrintf("%06o ", folder->permissions.fileMode);
 			bufferPrintf("%3d ", folder->permissions.ownerID);
 			bufferPrintf("%3d ", folder->permissions.groupID);
 			bufferPrintf("%12d ", folder->valence);
-		} else if(list->record->recordType == kHFSPlusFileRecord) {
-			file = (HFSPlusCatalogFile*)list->record;
+		} else if(record->recordType == kHFSPlusFileRecord) {
+			file = (HFSPlusCatalogFile*)record;
 			bufferPrintf("%06o ", file->permissions.fileMode);
 			bufferPrintf("%3d ", file->permissions.ownerID);
 			bufferPrintf("%3d ", file->permissions.groupID);
@@ -80,13 +84,11 @@ void displayFolder(HFSCatalogNodeID folderID, Volume* volume) {
 		
 		bufferPrintf("                 ");
 
-		printUnicode(&list->name);
+		printUnicode(name);
 		bufferPrintf("\r\n");
-		
-		list = list->next;
 	}
 	
-	releaseCatalogRecordList(theList);
+	closeFolderIterator(iterator);
 }
 
 void displayFileLSLine(HFSPlusCatalogFile* file, const char* name) {
@@ -125,7 +127,72 @@ uint32_t readHFSFile(HFSPlusCatalogFile* file, uint8_t** buffer, Volume* volume)
 	return file->dataFork.logicalSize;
 }
 
-void hfs_ls(Volume* volume, const char* path) {
+// Streams a file's data fork into caller-supplied memory. Each read goes
+// straight from the volume into the destination, one device read per
+// extent it spans, without staging the file in a buffer of its own.
+HFSStream* openHFSStream(const char* path, Volume* volume) {
+	HFSPlusCatalogRecord* record;
+	HFSPlusCatalogFile* file;
+	HFSStream* stream;
+
+	record = getRecordFromPath(path, volume, NULL, NULL);
+	if(record == NULL)
+		return NULL;
+
+	if(record->recordType != kHFSPlusFileRecord) {
+		free(record);
+		return NULL;
+	}
+
+	stream = (HFSStream*) malloc(sizeof(HFSStream));
+	if(stream == NULL) {
+		free(record);
+		return NULL;
+	}
+
+	file = (HFSPlusCatalogFile*) record;
+	stream->record = record;
+	stream->size = file->dataFork.logicalSize;
+	stream->position = 0;
+	stream->io = openRawFile(file->fileID, &file->dataFork, record, volume);
+	if(stream->io == NULL) {
+		free(record);
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+int readHFSStream(HFSStream* stream, void* buffer, uint32_t size) {
+	if(stream->position >= stream->size)
+		return 0;
+
+	if(size > (stream->size - stream->position))
+		size = stream->size - stream->position;
+
+	if(!READ(stream->io, stream->position, size, buffer))
+		return -1;
+
+	stream->position += size;
+	return size;
+}
+
+int seekHFSStream(HFSStream* stream, uint64_t position) {
+	if(position > stream->size)
+		return -1;
+
+	stream->position = position;
+	return 0;
+}
+
+void closeHFSStream(HFSStream* stream) {
+	CLOSE(stream->io);
+	free(stream->record);
+	free(stream);
+}
+
+void hfs_ls(Volume* volume, const char* path, const char* filter) {
 	HFSPlusCatalogRecord* record;
 	char* name;
 
@@ -134,7 +201,7 @@ void hfs_ls(Volume* volume, const char* path) {
 	bufferPrintf("%s: \r\n", name);
 	if(record != NULL) {
 		if(record->recordType == kHFSPlusFolderRecord)
-			displayFolder(((HFSPlusCatalogFolder*)record)->folderID, volume);  
+			displayFolder(((HFSPlusCatalogFolder*)record)->folderID, volume, filter);
 		else
 			displayFileLSLine((HFSPlusCatalogFile*)record, name);
 	} else {
@@ -147,8 +214,8 @@ void hfs_ls(Volume* volume, const char* path) {
 }
 
 void fs_cmd_ls(int argc, char** argv) {
-	if(argc < 2) {
-		bufferPrintf("usage: %s <device> <partition> <directory>\r\n", argv[0]);
+	if(argc < 3) {
+		bufferPrintf("usage: %s <device> <partition> [directory] [filter]\r\n", argv[0]);
 		return;
 	}
 
@@ -159,10 +226,7 @@ void fs_cmd_ls(int argc, char** argv) {
 		return;
 	}
 
-	if(argc > 2)
-		hfs_ls(dev->volume, argv[3]);
-	else
-		hfs_ls(dev->volume, "/");
+	hfs_ls(dev->volume, (argc > 3) ? argv[3] : "/", (argc > 4) ? argv[4] : NULL);
 
 	bdevfs_close(dev);
 }
@@ -205,38 +269,190 @@ void fs_cmd_cat(int argc, char** argv) {
 }
 COMMAND("fs_cat", "display a file", fs_cmd_cat);
 
-int fs_extract(int device, int partition, const char* file, void* location) {
+// Largest single read issued by the extent loader.
+#define FS_LOAD_MAX_READ 0x1000000
+
+typedef struct FSLoadRun {
+	uint64_t diskOffset;
+	uint64_t fileOffset;
+	uint64_t length;
+} FSLoadRun;
+
+static uint32_t LastLoadExtents = 0;
+static uint32_t LastLoadReads = 0;
+static uint32_t LastLoadMemory = 0;
+
+// Map a file's data fork to runs of contiguous bytes on the partition, sorted
+// by disk offset, with runs that are adjacent both on disk and in the file merged.
+static FSLoadRun* mapFileRuns(HFSPlusCatalogRecord* record, Volume* volume, int* numRuns) {
+	HFSPlusCatalogFile* file = (HFSPlusCatalogFile*) record;
+	uint64_t blockSize = volume->volumeHeader->blockSize;
+	uint64_t size = file->dataFork.logicalSize;
+	uint64_t fileOffset = 0;
+	io_func* fileIO;
+	Extent* extent;
+	FSLoadRun* runs;
+	int count = 0;
+	int i, j;
+
+	fileIO = openRawFile(file->fileID, &file->dataFork, record, volume);
+	if(!fileIO)
+		return NULL;
+
+	for(extent = ((RawFile*)fileIO->data)->extents; extent != NULL; extent = extent->next)
+		count++;
+
+	runs = (FSLoadRun*) malloc(sizeof(FSLoadRun) * (count ? count : 1));
+	if(!runs) {
+		CLOSE(fileIO);
+		return NULL;
+	}
+
+	LastLoadMemory = sizeof(FSLoadRun) * (count ? count : 1);
+
+	count = 0;
+	for(extent = ((RawFile*)fileIO->data)->extents; extent != NULL && fileOffset < size; extent = extent->next) {
+		uint64_t length = extent->blockCount * blockSize;
+		if(length > (size - fileOffset))
+			length = size - fileOffset;
+
+		runs[count].diskOffset = extent->startBlock * blockSize;
+		runs[count].fileOffset = fileOffset;
+		runs[count].length = length;
+		fileOffset += length;
+		count++;
+	}
+
+	CLOSE(fileIO);
+
+	if(fileOffset < size) {
+		free(runs);
+		return NULL;
+	}
+
+	LastLoadExtents = count;
+
+	for(i = 1; i < count; i++) {
+		FSLoadRun run = runs[i];
+		for(j = i; j > 0 && runs[j - 1].diskOffset > run.diskOffset; j--)
+			runs[j] = runs[j - 1];
+		runs[j] = run;
+	}
+
+	j = 0;
+	for(i = 1; i < count; i++) {
+		if((runs[j].diskOffset + runs[j].length) == runs[i].diskOffset
+				&& (runs[j].fileOffset + runs[j].length) == runs[i].fileOffset)
+			runs[j].length += runs[i].length;
+		else
+			runs[++j] = runs[i];
+	}
+
+	*numRuns = count ? (j + 1) : 0;
+	return runs;
+}
+
+// Reads every run with a single vectored request, splitting only runs that
+// are too large for one transfer.
+static int readFileRuns(block_device_handle_t handle, FSLoadRun* runs, int numRuns, uint8_t* location) {
+	block_device_iovec_t* vec;
+	int numVec = 0;
 	int ret;
+	int i;
+
+	for(i = 0; i < numRuns; i++)
+		numVec += (runs[i].length + FS_LOAD_MAX_READ - 1) / FS_LOAD_MAX_READ;
+
+	vec = (block_device_iovec_t*) malloc(sizeof(block_device_iovec_t) * (numVec ? numVec : 1));
+	if(vec == NULL)
+		return -1;
+
+	LastLoadMemory += sizeof(block_device_iovec_t) * (numVec ? numVec : 1);
+
+	numVec = 0;
+	for(i = 0; i < numRuns; i++) {
+		uint64_t done = 0;
+
+		while(done < runs[i].length) {
+			int toRead = ((runs[i].length - done) > FS_LOAD_MAX_READ) ? FS_LOAD_MAX_READ : (int)(runs[i].length - done);
+			vec[numVec].offset = runs[i].diskOffset + done;
+			vec[numVec].buffer = location + runs[i].fileOffset + done;
+			vec[numVec].size = toRead;
+			numVec++;
+			done += toRead;
+		}
+	}
+
+	LastLoadReads = numVec;
+	ret = block_device_readv_at(handle, vec, numVec);
+	free(vec);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+void* fs_load(int device, int partition, const char* file, void* location, fs_alloc_t alloc, uint32_t* size) {
+	HFSPlusCatalogRecord* record;
+	FSLoadRun* runs;
+	int numRuns;
+	uint32_t fileSize;
+	int allocated = FALSE;
 
 	bdevfs_device_t *dev = bdevfs_open(device, partition);
 	if(!dev)
 	{
-		bufferPrintf("fs: Cannot open partition hd%d,%d.\n", device, partition);
-		return -1;
+		bufferPrintf("fs: Cannot open partition hd%d,%d.\r\n", device, partition);
+		return NULL;
 	}
 
-	HFSPlusCatalogRecord* record = getRecordFromPath(file, dev->volume, NULL, NULL);
+	record = getRecordFromPath(file, dev->volume, NULL, NULL);
+	if(record == NULL || record->recordType != kHFSPlusFileRecord)
+		goto out_free;
 
-	if(record != NULL)
-	{
-		if(record->recordType == kHFSPlusFileRecord)
-		{
-			uint8_t* buffer;
-			uint32_t size = readHFSFile((HFSPlusCatalogFile*)record, &buffer, dev->volume);
-			memcpy(location, buffer, size);
-			free(buffer);
-			ret = size;
+	runs = mapFileRuns(record, dev->volume, &numRuns);
+	if(runs == NULL)
+		goto out_free;
+
+	fileSize = ((HFSPlusCatalogFile*) record)->dataFork.logicalSize;
+	if(location == NULL) {
+		// an empty file still gets a (one byte) buffer, so NULL always means failure
+		uint32_t allocSize = fileSize ? fileSize : 1;
+		location = alloc ? alloc(allocSize) : malloc(allocSize);
+		allocated = (alloc == NULL);
+	}
+
+	if(location != NULL) {
+		if(fileSize == 0)
+			*size = 0;
+		else if(readFileRuns(dev->handle, runs, numRuns, location) == 0)
+			*size = fileSize;
+		else {
+			bufferPrintf("fs: Failed to read %s.\r\n", file);
+			if(allocated)
+				free(location);
+			location = NULL;
 		}
-		else
-			ret = -1;
 	}
-	else
-		ret = -1;
 
+	free(runs);
 	free(record);
 	bdevfs_close(dev);
+	return location;
 
-	return ret;
+out_free:
+	if(record != NULL)
+		free(record);
+
+	bdevfs_close(dev);
+	return NULL;
+}
+
+int fs_extract(int device, int partition, const char* file, void* location) {
+	uint32_t size;
+
+	if(fs_load(device, partition, file, location, NULL, &size) == NULL)
+		return -1;
+
+	return size;
 }
 
 void fs_cmd_extract(int argc, char** argv)
@@ -247,7 +463,16 @@ void fs_cmd_extract(int argc, char** argv)
 		return;
 	}
 
-	fs_extract(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], (void*)parseNumber(argv[4]));
+	uint64_t start = timer_get_system_microtime();
+	int ret = fs_extract(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], (void*)parseNumber(argv[4]));
+	uint32_t us = (uint32_t)(timer_get_system_microtime() - start);
+
+	if(ret < 0)
+		bufferPrintf("fs: Failed to extract %s.\r\n", argv[3]);
+	else
+		bufferPrintf("%d bytes extracted in %d ms (%d KB/s), %d extents in %d pieces, %d bytes of working memory\r\n",
+				ret, us / 1000, us ? (uint32_t)(((uint64_t)ret * 1000000 / us) / 1024) : 0,
+				LastLoadExtents, LastLoadReads, LastLoadMemory);
 }
 COMMAND("fs_extract", "extract a file into memory", fs_cmd_extract);
 
@@ -260,12 +485,19 @@ void fs_cmd_add(int argc, char** argv)
 	}
 
 	bdevfs_device_t *dev = bdevfs_open(parseNumber(argv[1]), parseNumber(argv[2]));
+	if(!dev)
+	{
+		bufferPrintf("fs: Failed to open partition.\r\n");
+		return;
+	}
+
 	uint32_t address = parseNumber(argv[4]);
 	uint32_t size = parseNumber(argv[5]);
 
+	uint64_t start = timer_get_system_microtime();
 	if(add_hfs(dev->volume, (uint8_t*) address, size, argv[3]))
 	{
-		bufferPrintf("%d bytes of 0x%x stored in %s\r\n", size, address, argv[3]);
+		bufferPrintf("%d bytes of 0x%x stored in %s (%d us)\r\n", size, address, argv[3], (uint32_t)(timer_get_system_microtime() - start));
 	}
 	else
 	{
@@ -279,6 +511,256 @@ void fs_cmd_add(int argc, char** argv)
 }
 COMMAND("fs_add", "store a file from memory", fs_cmd_add);
 
+void fs_cmd_mounts(int argc, char** argv)
+{
+	bdevfs_print_mounts();
+}
+COMMAND("fs_mounts", "list mounted volumes", fs_cmd_mounts);
+
+void fs_cmd_unmount(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		bdevfs_unmount_all();
+		return;
+	}
+
+	if(bdevfs_unmount(parseNumber(argv[1]), parseNumber(argv[2])) != 0)
+		bufferPrintf("fs: hd%s,%s is busy.\r\n", argv[1], argv[2]);
+}
+COMMAND("fs_unmount", "flush and unmount a volume, or all idle volumes", fs_cmd_unmount);
+
+static void fs_bench_lookups(int device, int partition, const char* path, int iterations) {
+	// remount so the B-trees are opened with the current settings
+	if(bdevfs_unmount(device, partition) != 0)
+	{
+		bufferPrintf("fs: hd%d,%d is busy.\r\n", device, partition);
+		return;
+	}
+
+	bdevfs_device_t *dev = bdevfs_open(device, partition);
+	if(!dev)
+	{
+		bufferPrintf("fs: Failed to open partition.\r\n");
+		return;
+	}
+
+	HFSPlusCatalogRecord* record = getRecordFromPath(path, dev->volume, NULL, NULL);
+	if(record == NULL)
+	{
+		bufferPrintf("No such file or directory\r\n");
+		bdevfs_close(dev);
+		return;
+	}
+
+	HFSCatalogNodeID folder = 0;
+	if(record->recordType == kHFSPlusFolderRecord)
+		folder = ((HFSPlusCatalogFolder*)record)->folderID;
+
+	free(record);
+
+	uint32_t compares = BTreeKeyCompares;
+	uint64_t start = timer_get_system_microtime();
+	int i;
+	for(i = 0; i < iterations; i++)
+		free(getRecordFromPath(path, dev->volume, NULL, NULL));
+
+	uint32_t lookupUs = (uint32_t)(timer_get_system_microtime() - start);
+	compares = BTreeKeyCompares - compares;
+
+	uint32_t listUs = 0;
+	if(folder != 0)
+	{
+		start = timer_get_system_microtime();
+		for(i = 0; i < iterations; i++)
+			releaseCatalogRecordList(getFolderContents(folder, dev->volume));
+
+		listUs = (uint32_t)(timer_get_system_microtime() - start);
+	}
+
+	uint32_t hits;
+	uint32_t misses;
+	getBTreeCacheStats(dev->volume->catalogTree, &hits, &misses);
+
+	bufferPrintf("node cache %s, %s search, key folding %s, dentry cache %s: lookup %d us, %d key compares", BTreeNodeCacheEnabled ? "on" : "off",
+			BTreeBinarySearchEnabled ? "binary" : "linear", BTreeKeyFoldingEnabled ? "on" : "off", CatalogDentryCacheEnabled ? "on" : "off",
+			lookupUs / iterations, compares / iterations);
+	if(folder != 0)
+		bufferPrintf(", listing %d us", listUs / iterations);
+	bufferPrintf("\r\n\tcatalog node hits %d, misses %d", hits, misses);
+
+	getDentryCacheStats(dev->volume, &hits, &misses);
+	bufferPrintf(", dentry hits %d, misses %d\r\n", hits, misses);
+
+	bdevfs_close(dev);
+}
+
+void fs_cmd_bench(int argc, char** argv)
+{
+	if(argc < 4)
+	{
+		bufferPrintf("usage: %s <device> <partition> <path> [iterations]\r\n", argv[0]);
+		return;
+	}
+
+	int iterations = 16;
+	if(argc > 4)
+		iterations = parseNumber(argv[4]);
+
+	if(iterations <= 0)
+		iterations = 1;
+
+	int cacheEnabled = BTreeNodeCacheEnabled;
+	int binaryEnabled = BTreeBinarySearchEnabled;
+	int foldingEnabled = BTreeKeyFoldingEnabled;
+	int dentryEnabled = CatalogDentryCacheEnabled;
+
+	BTreeNodeCacheEnabled = FALSE;
+	BTreeBinarySearchEnabled = FALSE;
+	BTreeKeyFoldingEnabled = FALSE;
+	CatalogDentryCacheEnabled = FALSE;
+	fs_bench_lookups(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], iterations);
+
+	BTreeNodeCacheEnabled = TRUE;
+	fs_bench_lookups(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], iterations);
+
+	BTreeBinarySearchEnabled = TRUE;
+	fs_bench_lookups(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], iterations);
+
+	BTreeKeyFoldingEnabled = TRUE;
+	fs_bench_lookups(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], iterations);
+
+	CatalogDentryCacheEnabled = TRUE;
+	fs_bench_lookups(parseNumber(argv[1]), parseNumber(argv[2]), argv[3], iterations);
+
+	BTreeNodeCacheEnabled = cacheEnabled;
+	BTreeBinarySearchEnabled = binaryEnabled;
+	BTreeKeyFoldingEnabled = foldingEnabled;
+	CatalogDentryCacheEnabled = dentryEnabled;
+}
+COMMAND("fs_bench", "time path lookups and directory listings", fs_cmd_bench);
+
+void fs_cmd_compare_bench(int argc, char** argv)
+{
+	static const char* names[] = { "System", "Library", "LaunchDaemons", "com.apple.SpringBoard.plist",
+		"usr", "libexec", "Applications", "MobileSafari.app", "mobile", "Preferences" };
+	static HFSUniStr255 unicode[ARRAY_SIZE(names)];
+	static HFSUniStr255 folded[ARRAY_SIZE(names)];
+	uint32_t foldUs;
+	uint32_t tableUs;
+	uint32_t foldedUs;
+	uint64_t start;
+	int iterations = 100000;
+	int sum = 0;
+	int i, j, k;
+
+	if(argc > 1)
+		iterations = parseNumber(argv[1]);
+
+	if(iterations <= 0)
+		iterations = 1;
+
+	for(i = 0; i < ARRAY_SIZE(names); i++)
+		ASCIIToUnicode(names[i], &unicode[i]);
+
+	start = timer_get_system_microtime();
+	for(i = 0; i < iterations; i++)
+		for(j = 0; j < ARRAY_SIZE(names); j++)
+			folded[j].length = FoldUnicodeString(folded[j].unicode, unicode[j].unicode, unicode[j].length);
+	foldUs = (uint32_t)(timer_get_system_microtime() - start);
+
+	start = timer_get_system_microtime();
+	for(i = 0; i < iterations; i++)
+		for(j = 0; j < ARRAY_SIZE(names); j++)
+			for(k = 0; k < ARRAY_SIZE(names); k++)
+				sum += FastUnicodeCompare(unicode[j].unicode, unicode[j].length, unicode[k].unicode, unicode[k].length);
+	tableUs = (uint32_t)(timer_get_system_microtime() - start);
+
+	start = timer_get_system_microtime();
+	for(i = 0; i < iterations; i++)
+		for(j = 0; j < ARRAY_SIZE(names); j++)
+			for(k = 0; k < ARRAY_SIZE(names); k++)
+				sum += FoldedUnicodeCompare(folded[j].unicode, folded[j].length, folded[k].unicode, folded[k].length);
+	foldedUs = (uint32_t)(timer_get_system_microtime() - start);
+
+	bufferPrintf("%d compares: case folding %d ms, prefolded %d ms (folding %d names took %d ms) [%d]\r\n",
+			iterations * ARRAY_SIZE(names) * ARRAY_SIZE(names), tableUs / 1000, foldedUs / 1000,
+			iterations * ARRAY_SIZE(names), foldUs / 1000, sum);
+}
+COMMAND("fs_compare_bench", "time catalog name comparisons", fs_cmd_compare_bench);
+
+void fs_cmd_read_bench(int argc, char** argv)
+{
+	if(argc < 4)
+	{
+		bufferPrintf("usage: %s <device> <partition> <file> [chunk size]\r\n", argv[0]);
+		return;
+	}
+
+	uint32_t chunk = 4096;
+	if(argc > 4)
+		chunk = parseNumber(argv[4]);
+
+	if(chunk == 0)
+		chunk = 4096;
+
+	bdevfs_device_t *dev = bdevfs_open(parseNumber(argv[1]), parseNumber(argv[2]));
+	if(!dev)
+	{
+		bufferPrintf("fs: Failed to open partition.\r\n");
+		return;
+	}
+
+	HFSPlusCatalogRecord* record = getRecordFromPath(argv[3], dev->volume, NULL, NULL);
+	if(record == NULL || record->recordType != kHFSPlusFileRecord)
+	{
+		bufferPrintf("Not a file\r\n");
+		free(record);
+		bdevfs_close(dev);
+		return;
+	}
+
+	HFSPlusCatalogFile* file = (HFSPlusCatalogFile*) record;
+	io_func* io = openRawFile(file->fileID, &file->dataFork, record, dev->volume);
+	uint8_t* buffer = malloc(chunk);
+	if(!io || !buffer)
+	{
+		bufferPrintf("fs: Failed to open file.\r\n");
+		if(io)
+			CLOSE(io);
+		free(buffer);
+		free(record);
+		bdevfs_close(dev);
+		return;
+	}
+
+	int numExtents = 0;
+	Extent* extent;
+	for(extent = ((RawFile*)io->data)->extents; extent != NULL; extent = extent->next)
+		numExtents++;
+
+	uint64_t size = file->dataFork.logicalSize;
+	uint64_t offset = 0;
+	uint64_t start = timer_get_system_microtime();
+	while(offset < size)
+	{
+		uint32_t toRead = (size - offset) < chunk ? (uint32_t)(size - offset) : chunk;
+		if(!READ(io, offset, toRead, buffer))
+			break;
+
+		offset += toRead;
+	}
+	uint32_t us = (uint32_t)(timer_get_system_microtime() - start);
+
+	bufferPrintf("read %d of %d bytes in %d extents, %d byte chunks: %d us\r\n", (uint32_t)offset, (uint32_t)size, numExtents, chunk, us);
+
+	free(buffer);
+	CLOSE(io);
+	free(record);
+	bdevfs_close(dev);
+}
+COMMAND("fs_read_bench", "time reading a file in small chunks", fs_cmd_read_bench);
+
 ExtentList* fs_get_extents(int device, int partition, const char* fileName) {
 	unsigned int partitionStart;
 	unsigned int physBlockSize;
@@ -313,13 +795,20 @@ ExtentList* fs_get_extents(int device, int partition, const char* fileName) {
 				extent = extent->next;
 			}
 
+			if(numExtents > ARRAY_SIZE(list->extents))
+			{
+				bufferPrintf("fs: %s has too many extents (%d).\r\n", fileName, numExtents);
+				CLOSE(fileIO);
+				goto out_free;
+			}
+
 			list = (ExtentList*) malloc(sizeof(ExtentList));
 			list->numExtents = numExtents;
 
 			extent = ((RawFile*)fileIO->data)->extents;
 			for(i = 0; i < list->numExtents; i++)
 			{
-				list->extents[i].startBlock = partitionStart + (extent->startBlock * (allocationBlockSize / physBlockSize));
+				list->extents[i].startBlock = (partitionStart / physBlockSize) + (extent->startBlock * (allocationBlockSize / physBlockSize));
 				list->extents[i].blockCount = extent->blockCount * (allocationBlockSize / physBlockSize);
 				extent = extent->next;
 			}
@@ -340,4 +829,3 @@ out_close:
 
 	return list;
 }
-
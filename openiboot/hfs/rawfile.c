@@ -2,17 +2,124 @@
 
 int writeExtents(RawFile* rawFile);
 
+// The allocation file is kept in memory while a volume is being written to.
+// Bits follow the on-disk order (block 0 is the high bit of byte 0) and the
+// buffer is padded to whole words so free-run scans can test 32 blocks at a
+// time. Changes are collected into one dirty byte range and written back by
+// flushAllocationBitmap.
+#define ALLOCATION_ZERO_BLOCKS 16
+
+static int loadAllocationBitmap(Volume* volume) {
+	uint32_t totalBlocks;
+	uint32_t bytes;
+
+	if(volume->allocationBitmap != NULL)
+		return TRUE;
+
+	totalBlocks = volume->volumeHeader->totalBlocks;
+	bytes = (totalBlocks + 7) / 8;
+
+	volume->allocationBitmapSize = (bytes + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+	volume->allocationBitmap = (uint8_t*) malloc(volume->allocationBitmapSize);
+	if(volume->allocationBitmap == NULL)
+		return FALSE;
+
+	if(!READ(volume->allocationFile, 0, bytes, volume->allocationBitmap)) {
+		free(volume->allocationBitmap);
+		volume->allocationBitmap = NULL;
+		return FALSE;
+	}
+
+	memset(volume->allocationBitmap + bytes, 0xFF, volume->allocationBitmapSize - bytes);
+
+	volume->bitmapDirtyStart = volume->allocationBitmapSize;
+	volume->bitmapDirtyEnd = 0;
+
+	return TRUE;
+}
+
+static void markBitmapDirty(Volume* volume, uint32_t startByte, uint32_t endByte) {
+	if(startByte < volume->bitmapDirtyStart)
+		volume->bitmapDirtyStart = startByte;
+
+	if(endByte > volume->bitmapDirtyEnd)
+		volume->bitmapDirtyEnd = endByte;
+}
+
+int flushAllocationBitmap(Volume* volume) {
+	uint32_t bytes;
+	uint32_t end;
+
+	if(volume->allocationBitmap == NULL || volume->bitmapDirtyStart >= volume->bitmapDirtyEnd)
+		return TRUE;
+
+	bytes = (volume->volumeHeader->totalBlocks + 7) / 8;
+	end = (volume->bitmapDirtyEnd > bytes) ? bytes : volume->bitmapDirtyEnd;
+
+	if(volume->bitmapDirtyStart < end) {
+		if(!WRITE(volume->allocationFile, volume->bitmapDirtyStart, end - volume->bitmapDirtyStart, volume->allocationBitmap + volume->bitmapDirtyStart))
+			return FALSE;
+	}
+
+	volume->bitmapDirtyStart = volume->allocationBitmapSize;
+	volume->bitmapDirtyEnd = 0;
+
+	return TRUE;
+}
+
+void closeAllocationBitmap(Volume* volume) {
+	if(volume->allocationBitmap == NULL)
+		return;
+
+	ASSERT(flushAllocationBitmap(volume), "flushAllocationBitmap");
+	free(volume->allocationBitmap);
+	volume->allocationBitmap = NULL;
+}
+
 int isBlockUsed(Volume* volume, uint32_t block)
 {
 	unsigned char byte;
 
+	if(loadAllocationBitmap(volume))
+		return (volume->allocationBitmap[block / 8] & (1 << (7 - (block % 8)))) != 0;
+
 	READ(volume->allocationFile, block / 8, 1, &byte);
 	return (byte & (1 << (7 - (block % 8)))) != 0;
 }
 
+static void setBlockRangeUsed(Volume* volume, uint32_t start, uint32_t count, int used) {
+	uint8_t* bitmap = volume->allocationBitmap;
+	uint32_t block = start;
+	uint32_t end = start + count;
+
+	while(block < end) {
+		if((block % 8) == 0 && (end - block) >= 8) {
+			// whole bytes at a time
+			uint32_t bytes = (end - block) / 8;
+			memset(bitmap + (block / 8), used ? 0xFF : 0x00, bytes);
+			block += bytes * 8;
+			continue;
+		}
+
+		if(used)
+			bitmap[block / 8] |= (1 << (7 - (block % 8)));
+		else
+			bitmap[block / 8] &= ~(1 << (7 - (block % 8)));
+
+		block++;
+	}
+
+	markBitmapDirty(volume, start / 8, (end + 7) / 8);
+}
+
 int setBlockUsed(Volume* volume, uint32_t block, int used) {
 	unsigned char byte;
 
+	if(loadAllocationBitmap(volume)) {
+		setBlockRangeUsed(volume, block, 1, used);
+		return TRUE;
+	}
+
 	READ(volume->allocationFile, block / 8, 1, &byte);
 	if(used) {
 		byte |= (1 << (7 - (block % 8)));
@@ -24,6 +131,90 @@ int setBlockUsed(Volume* volume, uint32_t block, int used) {
 	return TRUE;
 }
 
+// Returns the length of the free run starting at block, up to limit.
+static uint32_t freeRunLength(Volume* volume, uint32_t block, uint32_t limit) {
+	uint8_t* bitmap = volume->allocationBitmap;
+	uint32_t totalBits = volume->volumeHeader->totalBlocks;
+	uint32_t length = 0;
+
+	if(block >= totalBits)
+		return 0;
+
+	if(limit > (totalBits - block))
+		limit = totalBits - block;
+
+	while(length < limit && (block + length) < totalBits) {
+		uint32_t cur = block + length;
+
+		if((cur % 32) == 0 && ((uint32_t*)bitmap)[cur / 32] == 0) {
+			length += 32;
+			continue;
+		}
+
+		if(bitmap[cur / 8] & (1 << (7 - (cur % 8))))
+			break;
+
+		length++;
+	}
+
+	return (length > limit) ? limit : length;
+}
+
+// Finds a free run for an allocation of wanted blocks: the smallest run that
+// fits it whole, or the largest run there is if none does.
+static uint32_t findFreeRun(Volume* volume, uint32_t wanted, uint32_t* runStart) {
+	uint32_t* words = (uint32_t*) volume->allocationBitmap;
+	uint32_t totalBits = volume->volumeHeader->totalBlocks;
+	uint32_t bestStart = 0;
+	uint32_t bestLength = 0;
+	int bestFits = FALSE;
+	uint32_t block = 0;
+
+	while(block < totalBits) {
+		if((block % 32) == 0 && words[block / 32] == 0xFFFFFFFF) {
+			block += 32;
+			continue;
+		}
+
+		if(volume->allocationBitmap[block / 8] & (1 << (7 - (block % 8)))) {
+			block++;
+			continue;
+		}
+
+		uint32_t length = freeRunLength(volume, block, totalBits - block);
+		int fits = length >= wanted;
+
+		if((fits && (!bestFits || length < bestLength)) || (!fits && !bestFits && length > bestLength)) {
+			bestStart = block;
+			bestLength = length;
+			bestFits = fits;
+
+			if(length == wanted)
+				break;
+		}
+
+		block += length;
+	}
+
+	*runStart = bestStart;
+	return bestLength;
+}
+
+static int zeroBlocks(Volume* volume, uint32_t start, uint32_t count, unsigned char* zeros) {
+	uint32_t blockSize = volume->volumeHeader->blockSize;
+
+	while(count > 0) {
+		uint32_t toWrite = (count > ALLOCATION_ZERO_BLOCKS) ? ALLOCATION_ZERO_BLOCKS : count;
+		if(!WRITE(volume->image, ((uint64_t)start) * blockSize, toWrite * blockSize, zeros))
+			return FALSE;
+
+		start += toWrite;
+		count -= toWrite;
+	}
+
+	return TRUE;
+}
+
 int allocate(RawFile* rawFile, off_t size) {
 	unsigned char* zeros;
 	Volume* volume;
@@ -42,62 +233,73 @@ int allocate(RawFile* rawFile, off_t size) {
 	blocksNeeded = ((uint64_t)size / (uint64_t)volume->volumeHeader->blockSize) + (((size % volume->volumeHeader->blockSize) == 0) ? 0 : 1);
 
 	if(blocksNeeded > forkData->totalBlocks) {
-		zeros = (unsigned char*) malloc(volume->volumeHeader->blockSize);
-		memset(zeros, 0, volume->volumeHeader->blockSize);
-
 		blocksToAllocate = blocksNeeded - forkData->totalBlocks;
 
 		if(blocksToAllocate > volume->volumeHeader->freeBlocks) {
 			return FALSE;
 		}
 
+		if(!loadAllocationBitmap(volume)) {
+			return FALSE;
+		}
+
+		zeros = (unsigned char*) malloc(volume->volumeHeader->blockSize * ALLOCATION_ZERO_BLOCKS);
+		memset(zeros, 0, volume->volumeHeader->blockSize * ALLOCATION_ZERO_BLOCKS);
+
 		lastExtent = NULL;
 		while(extent != NULL) {
 			lastExtent = extent;
 			extent = extent->next;
 		}
 
-		if(lastExtent == NULL) {
-			rawFile->extents = (Extent*) malloc(sizeof(Extent));
-			lastExtent = rawFile->extents;
-			lastExtent->blockCount = 0;
-			lastExtent->next = NULL;
-			curBlock = volume->volumeHeader->nextAllocation;
-		} else {
-			curBlock = lastExtent->startBlock + lastExtent->blockCount;
-		}
-
 		while(blocksToAllocate > 0) {
-			if(isBlockUsed(volume, curBlock)) {
-				if(lastExtent->blockCount > 0) {
-					lastExtent->next = (Extent*) malloc(sizeof(Extent));
-					lastExtent = lastExtent->next;
-					lastExtent->blockCount = 0;
-					lastExtent->next = NULL;
-				}
-				curBlock = volume->volumeHeader->nextAllocation;
-				volume->volumeHeader->nextAllocation++;
-				if(volume->volumeHeader->nextAllocation >= volume->volumeHeader->totalBlocks) {
-					volume->volumeHeader->nextAllocation = 0;
-				}
-			} else {
-				if(lastExtent->blockCount == 0) {
-					lastExtent->startBlock = curBlock;
+			uint32_t runStart = 0;
+			uint32_t runLength = 0;
+
+			// grow the last extent in place if the blocks after it are free
+			if(lastExtent != NULL && lastExtent->blockCount > 0) {
+				runStart = lastExtent->startBlock + lastExtent->blockCount;
+				runLength = freeRunLength(volume, runStart, blocksToAllocate);
+			}
+
+			if(runLength == 0) {
+				runLength = findFreeRun(volume, blocksToAllocate, &runStart);
+				if(runLength == 0) {
+					free(zeros);
+					return FALSE;
 				}
+			}
 
-				/* zero out allocated block */
-				ASSERT(WRITE(volume->image, ((uint64_t)curBlock) * volume->volumeHeader->blockSize, volume->volumeHeader->blockSize, zeros), "WRITE");
+			if(runLength > blocksToAllocate)
+				runLength = blocksToAllocate;
 
-				setBlockUsed(volume, curBlock, TRUE);
-				volume->volumeHeader->freeBlocks--;
-				blocksToAllocate--;
-				curBlock++;
-				lastExtent->blockCount++;
+			/* zero out allocated blocks */
+			ASSERT(zeroBlocks(volume, runStart, runLength, zeros), "zeroBlocks");
 
-				if(curBlock >= volume->volumeHeader->totalBlocks) {
-					curBlock = volume->volumeHeader->nextAllocation;
-				}
+			setBlockRangeUsed(volume, runStart, runLength, TRUE);
+			volume->volumeHeader->freeBlocks -= runLength;
+			blocksToAllocate -= runLength;
+
+			if(lastExtent != NULL && (lastExtent->blockCount == 0 || (lastExtent->startBlock + lastExtent->blockCount) == runStart)) {
+				if(lastExtent->blockCount == 0)
+					lastExtent->startBlock = runStart;
+				lastExtent->blockCount += runLength;
+			} else {
+				extent = (Extent*) malloc(sizeof(Extent));
+				extent->startBlock = runStart;
+				extent->blockCount = runLength;
+				extent->next = NULL;
+
+				if(lastExtent == NULL)
+					rawFile->extents = extent;
+				else
+					lastExtent->next = extent;
+
+				lastExtent = extent;
 			}
+
+			curBlock = runStart + runLength;
+			volume->volumeHeader->nextAllocation = (curBlock >= volume->volumeHeader->totalBlocks) ? 0 : curBlock;
 		}
 
 		free(zeros);
@@ -144,6 +346,10 @@ int allocate(RawFile* rawFile, off_t size) {
 		} while(extent != NULL);
 	}
 
+	rawFile->extentIndexValid = FALSE;
+
+	ASSERT(flushAllocationBitmap(volume), "flushAllocationBitmap");
+
 	writeExtents(rawFile);
 
 	forkData->logicalSize = size;
@@ -158,35 +364,114 @@ int allocate(RawFile* rawFile, off_t size) {
 	return TRUE;
 }
 
+static int buildExtentIndex(RawFile* rawFile) {
+	Extent* extent;
+	uint32_t startBlock;
+	int i;
+
+	free(rawFile->extentIndex);
+	free(rawFile->extentStartBlocks);
+	rawFile->extentIndex = NULL;
+	rawFile->extentStartBlocks = NULL;
+
+	rawFile->numExtents = 0;
+	for(extent = rawFile->extents; extent != NULL; extent = extent->next)
+		rawFile->numExtents++;
+
+	if(rawFile->numExtents > 0) {
+		rawFile->extentIndex = (Extent**) malloc(sizeof(Extent*) * rawFile->numExtents);
+		rawFile->extentStartBlocks = (uint32_t*) malloc(sizeof(uint32_t) * rawFile->numExtents);
+		if(rawFile->extentIndex == NULL || rawFile->extentStartBlocks == NULL) {
+			rawFile->numExtents = 0;
+			return FALSE;
+		}
+	}
+
+	startBlock = 0;
+	extent = rawFile->extents;
+	for(i = 0; i < rawFile->numExtents; i++) {
+		rawFile->extentIndex[i] = extent;
+		rawFile->extentStartBlocks[i] = startBlock;
+		startBlock += extent->blockCount;
+		extent = extent->next;
+	}
+
+	rawFile->extentCursor = 0;
+	rawFile->extentIndexValid = TRUE;
+
+	return TRUE;
+}
+
+static int extentContains(RawFile* rawFile, int i, uint32_t block) {
+	return i < rawFile->numExtents && rawFile->extentStartBlocks[i] <= block
+		&& block < (rawFile->extentStartBlocks[i] + rawFile->extentIndex[i]->blockCount);
+}
+
+// Finds the extent containing location, returning its index or -1 if location
+// is past the end of the file. Sequential access usually hits the extent used
+// last or the one after it; anything else is a binary search over the
+// extents' starting blocks.
+static int findExtent(RawFile* rawFile, off_t location, off_t* locationInExtent) {
+	uint32_t blockSize;
+	uint32_t block;
+	int lo;
+	int hi;
+	int mid;
+	int i;
+
+	if(!rawFile->extentIndexValid && !buildExtentIndex(rawFile))
+		return -1;
+
+	if(rawFile->numExtents == 0)
+		return -1;
+
+	blockSize = rawFile->volume->volumeHeader->blockSize;
+	block = location / blockSize;
+
+	i = rawFile->extentCursor;
+	if(!extentContains(rawFile, i, block) && extentContains(rawFile, i + 1, block))
+		i++;
+
+	if(!extentContains(rawFile, i, block)) {
+		lo = 0;
+		hi = rawFile->numExtents - 1;
+		i = 0;
+		while(lo <= hi) {
+			mid = (lo + hi) / 2;
+			if(rawFile->extentStartBlocks[mid] <= block) {
+				i = mid;
+				lo = mid + 1;
+			} else {
+				hi = mid - 1;
+			}
+		}
+
+		if((rawFile->extentStartBlocks[i] + rawFile->extentIndex[i]->blockCount) <= block)
+			return -1;
+	}
+
+	rawFile->extentCursor = i;
+	*locationInExtent = location - ((off_t)rawFile->extentStartBlocks[i] * blockSize);
+
+	return i;
+}
+
 static int rawFileRead(io_func* io,off_t location, size_t size, void *buffer) {
 	RawFile* rawFile;
 	Volume* volume;
 	Extent* extent;
 
 	size_t blockSize;
-	off_t fileLoc;
 	off_t locationInBlock;
 	size_t possible;
+	int extentIdx;
 
 	rawFile = (RawFile*) io->data;
 	volume = rawFile->volume;
 	blockSize = volume->volumeHeader->blockSize;
 
-	extent = rawFile->extents;
-	fileLoc = 0;
-
-	locationInBlock = location;
-	while(TRUE) {
-		fileLoc += extent->blockCount * blockSize;
-		if(fileLoc <= location) {
-			locationInBlock -= extent->blockCount * blockSize;
-			extent = extent->next;
-			if(extent == NULL)
-				break;
-		} else {
-			break;
-		}
-	}
+	extentIdx = findExtent(rawFile, location, &locationInBlock);
+	extent = (extentIdx >= 0) ? rawFile->extentIndex[extentIdx] : NULL;
 
 	while(size > 0) {
 		if(extent == NULL)
@@ -199,6 +484,7 @@ static int rawFileRead(io_func* io,off_t location, size_t size, void *buffer) {
 			size -= possible;
 			buffer = (void*)(((size_t)buffer) + possible);
 			extent = extent->next;
+			rawFile->extentCursor = ++extentIdx;
 		} else {
 			ASSERT(READ(volume->image, ((uint64_t)extent->startBlock) * blockSize + locationInBlock, size, buffer), "READ");
 			break;
@@ -216,9 +502,9 @@ static int rawFileWrite(io_func* io,off_t location, size_t size, void *buffer) {
 	Extent* extent;
 
 	size_t blockSize;
-	off_t fileLoc;
 	off_t locationInBlock;
 	size_t possible;
+	int extentIdx;
 
 	rawFile = (RawFile*) io->data;
 	volume = rawFile->volume;
@@ -228,21 +514,8 @@ static int rawFileWrite(io_func* io,off_t location, size_t size, void *buffer) {
 		ASSERT(allocate(rawFile, location + size), "allocate");
 	}
 
-	extent = rawFile->extents;
-	fileLoc = 0;
-
-	locationInBlock = location;
-	while(TRUE) {
-		fileLoc += extent->blockCount * blockSize;
-		if(fileLoc <= location) {
-			locationInBlock -= extent->blockCount * blockSize;
-			extent = extent->next;
-			if(extent == NULL)
-				break;
-		} else {
-			break;
-		}
-	}
+	extentIdx = findExtent(rawFile, location, &locationInBlock);
+	extent = (extentIdx >= 0) ? rawFile->extentIndex[extentIdx] : NULL;
 
 	while(size > 0) {
 		if(extent == NULL)
@@ -255,6 +528,7 @@ static int rawFileWrite(io_func* io,off_t location, size_t size, void *buffer) {
 			size -= possible;
 			buffer = (void*)(((size_t)buffer) + possible);
 			extent = extent->next;
+			rawFile->extentCursor = ++extentIdx;
 		} else {
 			ASSERT(WRITE(volume->image, ((uint64_t)extent->startBlock) * blockSize + locationInBlock, size, buffer), "WRITE");
 			break;
@@ -280,6 +554,8 @@ static void closeRawFile(io_func* io) {
 		free(toRemove);
 	}
 
+	free(rawFile->extentIndex);
+	free(rawFile->extentStartBlocks);
 	free(rawFile);
 	free(io);
 }
@@ -483,6 +759,11 @@ io_func* openRawFile(HFSCatalogNodeID id, HFSPlusForkData* forkData, HFSPlusCata
 	rawFile->forkData = forkData;
 	rawFile->catalogRecord = catalogRecord;
 	rawFile->extents = NULL;
+	rawFile->extentIndex = NULL;
+	rawFile->extentStartBlocks = NULL;
+	rawFile->numExtents = 0;
+	rawFile->extentIndexValid = FALSE;
+	rawFile->extentCursor = 0;
 
 	io->data = rawFile;
 	io->read = &rawFileRead;
@@ -104,6 +104,8 @@ Volume* openVolume(io_func* io) {
 	volume = (Volume*) malloc(sizeof(Volume));
 	volume->image = io;
 	volume->extentsTree = NULL;
+	volume->dentryCache = NULL;
+	volume->allocationBitmap = NULL;
 
 	volume->volumeHeader = readVolumeHeader(io, 1024);
 	if(volume->volumeHeader == NULL) {
@@ -154,6 +156,8 @@ Volume* openVolume(io_func* io) {
 }
 
 void closeVolume(Volume *volume) {
+	closeDentryCache(volume);
+	closeAllocationBitmap(volume);
 	CLOSE(volume->allocationFile);
 	closeBTree(volume->catalogTree);
 	closeBTree(volume->extentsTree);
@@ -65,6 +65,15 @@ typedef enum _seek_mode
 	seek_offset,
 } seek_mode_t;
 
+// One piece of a scatter-gather transfer. Offsets are in bytes, from the start
+// of the device for drivers and from the start of the partition for clients.
+typedef struct _block_device_iovec
+{
+	int64_t offset;
+	void *buffer;
+	int size;
+} block_device_iovec_t;
+
 struct _block_device;
 typedef int (*block_device_prepare_t)(struct _block_device *);
 typedef void (*block_device_finish_t)(struct _block_device *);
@@ -74,6 +83,11 @@ typedef int (*block_device_write_t)(struct _block_device *, void *_src, int _sz)
 typedef int (*block_device_seek_t)(struct _block_device *, seek_mode_t _mode, int64_t _amt);
 typedef int (*block_device_sync_t)(struct _block_device *);
 
+typedef int (*block_device_read_at_t)(struct _block_device *, int64_t _off, void *_dest, int _sz);
+typedef int (*block_device_write_at_t)(struct _block_device *, int64_t _off, void *_src, int _sz);
+typedef int (*block_device_readv_at_t)(struct _block_device *, const block_device_iovec_t *_vec, int _count);
+typedef int (*block_device_writev_at_t)(struct _block_device *, const block_device_iovec_t *_vec, int _count);
+
 typedef int (*block_device_get_attribute_t)(struct _block_device *);
 
 typedef struct _block_device
@@ -86,10 +100,19 @@ typedef struct _block_device
 	block_device_seek_t seek;
 	block_device_sync_t sync;
 
+	// Optional positional entry points, these don't touch the seek position
+	// and return the bytes transferred or a negative error. Drivers without
+	// them get seek+read/write and one call per piece.
+	block_device_read_at_t read_at;
+	block_device_write_at_t write_at;
+	block_device_readv_at_t readv_at;
+	block_device_writev_at_t writev_at;
+
 	block_device_get_attribute_t size;
 	block_device_get_attribute_t block_size;
 
 	int setup_done;
+	int open_count;
 	LinkedList list_ptr;
 
 	partitioning_mode_t part_mode;
@@ -109,6 +132,10 @@ typedef struct _block_device_handle_struct
 		MBRPartitionRecord *mbr_record;
 		GPTPartitionRecord *gpt_record;
 	};
+
+	// read-ahead state, see block_device_read_at
+	int64_t ra_next;
+	int ra_window;
 	
 } block_device_handle_struct_t, *block_device_handle_t;
 typedef block_device_handle_t bdev_handle_t;
@@ -118,6 +145,11 @@ int block_device_init(block_device_t *_bdev);
 int block_device_register(block_device_t *_bdev);
 void block_device_unregister(block_device_t *_bdev);
 
+// Call before writing to a device behind the block layer's back, e.g.
+// through mtd_write. Fails if cached data for the range couldn't be written
+// back first.
+int block_device_invalidate(block_device_t *_bdev, int64_t _off, int64_t _sz);
+
 // For clients
 block_device_t *block_device_find(block_device_t *_last);
 
@@ -135,4 +167,19 @@ int block_device_write(block_device_handle_t, void *_src, int _sz);
 int block_device_seek(block_device_handle_t, seek_mode_t _mode, int64_t _amt);
 int block_device_sync(block_device_handle_t);
 
+int block_device_read_at(block_device_handle_t, int64_t _off, void *_dest, int _sz);
+int block_device_write_at(block_device_handle_t, int64_t _off, void *_src, int _sz);
+int block_device_readv_at(block_device_handle_t, const block_device_iovec_t *_vec, int _count);
+int block_device_writev_at(block_device_handle_t, const block_device_iovec_t *_vec, int _count);
+
+typedef enum _bdev_cache_mode
+{
+	bdev_cache_off,
+	bdev_cache_write_through,
+	bdev_cache_write_back,
+} bdev_cache_mode_t;
+
+extern int BdevReadAheadMax;
+extern bdev_cache_mode_t BdevCacheMode;
+
 #endif //BDEV_H
@@ -18,5 +18,8 @@ io_func *bdevio_open(block_device_handle_t _handle);
 
 bdevfs_device_t *bdevfs_open(int _devIdx, int _pIdx);
 void bdevfs_close(bdevfs_device_t *bdev);
+int bdevfs_unmount(int _devIdx, int _pIdx);
+void bdevfs_unmount_all();
+void bdevfs_print_mounts();
 
 #endif //HFS_BDEV_H
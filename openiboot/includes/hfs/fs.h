@@ -14,13 +14,28 @@ typedef struct ExtentList {
 	ExtentListItem extents[16];
 } ExtentList;
 
+typedef struct HFSStream {
+	HFSPlusCatalogRecord* record;
+	io_func* io;
+	uint64_t size;
+	uint64_t position;
+} HFSStream;
+
+typedef void* (*fs_alloc_t)(uint32_t size);
+
 extern int HasFSInit;
 
 uint32_t readHFSFile(HFSPlusCatalogFile* file, uint8_t** buffer, Volume* volume);
 
+HFSStream* openHFSStream(const char* path, Volume* volume);
+int readHFSStream(HFSStream* stream, void* buffer, uint32_t size);
+int seekHFSStream(HFSStream* stream, uint64_t position);
+void closeHFSStream(HFSStream* stream);
+
 int fs_setup();
 int add_hfs(Volume* volume, uint8_t* buffer, size_t size, const char* outFileName);
 ExtentList* fs_get_extents(int device, int partition, const char* fileName);
+void* fs_load(int device, int partition, const char* file, void* location, fs_alloc_t alloc, uint32_t* size);
 int fs_extract(int device, int partition, const char* file, void* location);
 
 #endif
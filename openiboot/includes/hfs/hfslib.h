@@ -17,7 +17,7 @@ extern "C" {
 	int copyAcrossVolumes(Volume* volume1, Volume* volume2, char* path1, char* path2);
 
 	void hfs_untar(Volume* volume, AbstractFile* tarFile);
-	void hfs_ls(Volume* volume, const char* path);
+	void hfs_ls(Volume* volume, const char* path, const char* filter);
 #ifdef __cplusplus
 }
 #endif
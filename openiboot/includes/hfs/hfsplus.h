@@ -22,6 +22,7 @@ typedef BTKey* (*dataReadFunc)(off_t offset, struct io_func_struct* io);
 typedef void (*keyPrintFunc)(BTKey* toPrint);
 typedef int (*keyWriteFunc)(off_t offset, BTKey* toWrite, struct io_func_struct* io);
 typedef int (*compareFunc)(BTKey* left, BTKey* right);
+typedef BTKey* (*keyFoldFunc)(BTKey* key);
 
 typedef uint32_t HFSCatalogNodeID;
 
@@ -397,6 +398,8 @@ struct Extent {
 
 typedef struct Extent Extent;
 
+typedef struct BTNodeCache BTNodeCache;
+
 typedef struct {
   io_func* io;
   BTHeaderRec *headerRec;
@@ -405,8 +408,15 @@ typedef struct {
   keyWriteFunc keyWrite;
   keyPrintFunc keyPrint;
   dataReadFunc dataRead;
+  keyFoldFunc foldKey;
+  compareFunc foldedCompare;
+  BTNodeCache* nodeCache;
+  uint32_t generation;
 } BTree;
 
+typedef struct CatalogDentryCache CatalogDentryCache;
+typedef struct CatalogFolderIterator CatalogFolderIterator;
+
 typedef struct {
   io_func* image;
   HFSPlusVolumeHeader* volumeHeader;
@@ -414,6 +424,13 @@ typedef struct {
   BTree* extentsTree;
   BTree* catalogTree;
   io_func* allocationFile;
+  CatalogDentryCache* dentryCache;
+
+  // in-memory copy of the allocation file, loaded on first use
+  uint8_t* allocationBitmap;
+  uint32_t allocationBitmapSize;
+  uint32_t bitmapDirtyStart;
+  uint32_t bitmapDirtyEnd;
 } Volume;
 
 
@@ -423,6 +440,13 @@ typedef struct {
   Volume* volume;
   HFSPlusForkData* forkData;
   Extent* extents;
+
+  // array view of the extents list, rebuilt when the list changes
+  Extent** extentIndex;
+  uint32_t* extentStartBlocks;
+  int numExtents;
+  int extentIndexValid;
+  int extentCursor;
 } RawFile;
 
 #ifdef __cplusplus
@@ -434,6 +458,7 @@ extern "C" {
 	char* unicodeToAscii(HFSUniStr255* str);
 
 	BTNodeDescriptor* readBTNodeDescriptor(uint32_t num, BTree* tree);
+	int readBTNodes(BTree* tree, uint32_t num, uint32_t count, void* buffer);
 
 	BTHeaderRec* readBTHeaderRec(io_func* io);
 
@@ -441,6 +466,12 @@ extern "C" {
 
 	void closeBTree(BTree* tree);
 
+	extern int BTreeNodeCacheEnabled;
+	extern int BTreeBinarySearchEnabled;
+	extern int BTreeKeyFoldingEnabled;
+	extern uint32_t BTreeKeyCompares;
+	void getBTreeCacheStats(BTree* tree, uint32_t* hits, uint32_t* misses);
+
 	off_t getRecordOffset(int num, uint32_t nodeNum, BTree* tree);
 
 	off_t getNodeNumberFromPointerRecord(off_t offset, io_func* io);
@@ -463,6 +494,9 @@ extern "C" {
 	void flipCatalogThread(HFSPlusCatalogThread* record, int out);
 
 	BTree* openCatalogTree(io_func* file);
+	void closeDentryCache(Volume* volume);
+	void getDentryCacheStats(Volume* volume, uint32_t* hits, uint32_t* misses);
+	extern int CatalogDentryCacheEnabled;
 	int updateCatalog(Volume* volume, HFSPlusCatalogRecord* catalogRecord);
 	int move(const char* source, const char* dest, Volume* volume);
 	int removeFile(const char* fileName, Volume* volume);
@@ -475,6 +509,9 @@ extern "C" {
 	HFSPlusCatalogRecord* getRecordByCNID(HFSCatalogNodeID CNID, Volume* volume);
 	HFSPlusCatalogRecord* getLinkTarget(HFSPlusCatalogRecord* record, HFSCatalogNodeID parentID, HFSPlusCatalogKey *key, Volume* volume);
 	CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume);
+	CatalogFolderIterator* openFolderIterator(HFSCatalogNodeID CNID, Volume* volume, const char* filter);
+	int nextFolderEntry(CatalogFolderIterator* iterator, HFSUniStr255** name, HFSPlusCatalogRecord** record);
+	void closeFolderIterator(CatalogFolderIterator* iterator);
 	HFSPlusCatalogRecord* getRecordFromPath(const char* path, Volume* volume, char **name, HFSPlusCatalogKey* retKey);
 	HFSPlusCatalogRecord* getRecordFromPath2(const char* path, Volume* volume, char **name, HFSPlusCatalogKey* retKey, char traverse);
 	HFSPlusCatalogRecord* getRecordFromPath3(const char* path, Volume* volume, char **name, HFSPlusCatalogKey* retKey, char traverse, char returnLink, HFSCatalogNodeID parentID);
@@ -482,6 +519,8 @@ extern "C" {
 
 	int isBlockUsed(Volume* volume, uint32_t block);
 	int setBlockUsed(Volume* volume, uint32_t block, int used);
+	int flushAllocationBitmap(Volume* volume);
+	void closeAllocationBitmap(Volume* volume);
 	int allocate(RawFile* rawFile, off_t size);
 
 	void flipForkData(HFSPlusForkData* forkData);
@@ -498,6 +537,8 @@ extern "C" {
 
 	int32_t FastUnicodeCompare ( register uint16_t str1[], register uint16_t length1,
 		                    register uint16_t str2[], register uint16_t length2);
+	uint16_t FoldUnicodeString(uint16_t dest[], const uint16_t src[], uint16_t length);
+	int32_t FoldedUnicodeCompare(const uint16_t str1[], uint16_t length1, const uint16_t str2[], uint16_t length2);
 #ifdef __cplusplus
 }
 #endif
@@ -9,9 +9,15 @@ typedef int (*mtd_prepare_t)(struct _mtd *);
 typedef void (*mtd_finish_t)(struct _mtd *);
 typedef int (*mtd_read_t)(struct _mtd *, void *_dest, uint32_t _off, int _sz);
 typedef int (*mtd_write_t)(struct _mtd *, void *_src, uint32_t _off, int _sz);
+typedef int (*mtd_readv_t)(struct _mtd *, const block_device_iovec_t *_vec, int _count);
+typedef int (*mtd_writev_t)(struct _mtd *, const block_device_iovec_t *_vec, int _count);
+typedef int (*mtd_sync_t)(struct _mtd *);
 
 typedef int (*mtd_get_attribute_t)(struct _mtd *);
 
+typedef int (*mtd_erase_t)(struct _mtd *, uint32_t _off);
+typedef int (*mtd_program_t)(struct _mtd *, uint32_t _off, const void *_src, int _sz);
+
 typedef enum _mtd_use
 {
 	mtd_boot_images,
@@ -32,6 +38,9 @@ typedef struct _mtd
 	mtd_finish_t finish;
 	mtd_read_t read;
 	mtd_write_t write;
+	mtd_readv_t readv;
+	mtd_writev_t writev;
+	mtd_sync_t sync;
 
 	mtd_get_attribute_t size;
 	mtd_get_attribute_t block_size;
@@ -56,7 +65,24 @@ int mtd_block_size(mtd_t *_mtd);
 
 int mtd_read(mtd_t *_mtd, void *_dest, uint32_t _off, int _sz);
 int mtd_write(mtd_t *_mtd, void *_src, uint32_t _off, int _sz);
+int mtd_readv(mtd_t *_mtd, const block_device_iovec_t *_vec, int _count);
+int mtd_writev(mtd_t *_mtd, const block_device_iovec_t *_vec, int _count);
+int mtd_sync(mtd_t *_mtd);
 
 void mtd_list_devices();
 
+// Erase-before-write flash, as used by the NOR drivers. Runs handed to
+// program never cross a page and start and end on an align boundary.
+typedef struct _mtd_nor
+{
+	int sector_size;
+	int page_size;
+	int align;
+
+	mtd_erase_t erase;
+	mtd_program_t program;
+} mtd_nor_t;
+
+int mtd_nor_write(mtd_t *_mtd, const mtd_nor_t *_nor, void *_src, uint32_t _off, int _sz);
+
 #endif //MTD_H
@@ -1,8 +1,12 @@
 #ifndef SCRIPTING_H
 #define SCRIPTING_H
 
+// Allocates the destination for a file once its size is known.
+typedef void *(*script_alloc_t)(uint32_t size);
+
 uint8_t *script_load_hfs_file(int disk, int part, char *path, uint32_t *size);
 uint8_t *script_load_file(char *id, uint32_t *size);
+uint8_t *script_load_file_alloc(char *id, uint32_t *size, script_alloc_t alloc);
 char **script_split_file(char *_data, uint32_t _sz, uint32_t *_count);
 int script_run_command(char* command);
 int script_run_commands(char** cmds, uint32_t count);
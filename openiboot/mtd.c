@@ -2,12 +2,42 @@
 #include "arm/arm.h"
 #include "commands.h"
 #include "util.h"
+#include "timer.h"
 
 LinkedList mtd_list = {&mtd_list, &mtd_list};
 
 #define mtd_get(ptr)		(CONTAINER_OF(mtd_t, list_ptr, (ptr)))
 #define mtd_get_bdev(ptr) 	(CONTAINER_OF(mtd_t, bdev, (ptr)))
 
+// The block device layer caches what goes through it, so its own writes go
+// straight to the driver while everybody else's invalidate the cache first.
+static int mtd_write_raw(mtd_t *_mtd, void *_src, uint32_t _off, int _sz)
+{
+	if(_mtd->write == NULL)
+		return -1;
+
+	return _mtd->write(_mtd, _src, _off, _sz);
+}
+
+static int mtd_writev_raw(mtd_t *_mtd, const block_device_iovec_t *_vec, int _count)
+{
+	if(_mtd->writev)
+		return _mtd->writev(_mtd, _vec, _count);
+
+	int total = 0;
+	int i;
+	for(i = 0; i < _count; i++)
+	{
+		int ret = mtd_write_raw(_mtd, _vec[i].buffer, (uint32_t)_vec[i].offset, _vec[i].size);
+		if(ret < 0)
+			return ret;
+
+		total += _vec[i].size;
+	}
+
+	return total;
+}
+
 static int mtd_bdev_prepare(block_device_t *_dev)
 {
 	mtd_t *dev = mtd_get_bdev(_dev);
@@ -60,13 +90,43 @@ static int mtd_bdev_read(block_device_t *_dev, void *_dest, int _sz)
 static int mtd_bdev_write(block_device_t *_dev, void *_src, int _sz)
 {
 	mtd_t *dev = mtd_get_bdev(_dev);
-	int ret = mtd_write(dev, _src, dev->bdev_addr, _sz);
+	int ret = mtd_write_raw(dev, _src, dev->bdev_addr, _sz);
 	if(ret >= 0)
 		dev->bdev_addr += _sz;
 
 	return ret;
 }
 
+static int mtd_bdev_read_at(block_device_t *_dev, int64_t _off, void *_dest, int _sz)
+{
+	mtd_t *dev = mtd_get_bdev(_dev);
+	return mtd_read(dev, _dest, (uint32_t)_off, _sz);
+}
+
+static int mtd_bdev_write_at(block_device_t *_dev, int64_t _off, void *_src, int _sz)
+{
+	mtd_t *dev = mtd_get_bdev(_dev);
+	return mtd_write_raw(dev, _src, (uint32_t)_off, _sz);
+}
+
+static int mtd_bdev_readv_at(block_device_t *_dev, const block_device_iovec_t *_vec, int _count)
+{
+	mtd_t *dev = mtd_get_bdev(_dev);
+	return mtd_readv(dev, _vec, _count);
+}
+
+static int mtd_bdev_writev_at(block_device_t *_dev, const block_device_iovec_t *_vec, int _count)
+{
+	mtd_t *dev = mtd_get_bdev(_dev);
+	return mtd_writev_raw(dev, _vec, _count);
+}
+
+static int mtd_bdev_sync(block_device_t *_dev)
+{
+	mtd_t *dev = mtd_get_bdev(_dev);
+	return mtd_sync(dev);
+}
+
 static int mtd_bdev_size(block_device_t *_dev)
 {
 	mtd_t *dev = mtd_get_bdev(_dev);
@@ -95,6 +155,11 @@ int mtd_init(mtd_t *_mtd)
 	_mtd->bdev.read = mtd_bdev_read;
 	_mtd->bdev.write = mtd_bdev_write;
 	_mtd->bdev.seek = mtd_bdev_seek;
+	_mtd->bdev.read_at = mtd_bdev_read_at;
+	_mtd->bdev.write_at = mtd_bdev_write_at;
+	_mtd->bdev.readv_at = mtd_bdev_readv_at;
+	_mtd->bdev.writev_at = mtd_bdev_writev_at;
+	_mtd->bdev.sync = mtd_bdev_sync;
 
 	_mtd->bdev.size = mtd_bdev_size;
 	_mtd->bdev.block_size = mtd_bdev_block_size;
@@ -212,10 +277,172 @@ int mtd_read(mtd_t *_mtd, void *_dest, uint32_t _off, int _sz)
 
 int mtd_write(mtd_t *_mtd, void *_src, uint32_t _off, int _sz)
 {
-	if(_mtd->write == NULL)
+	if(block_device_invalidate(&_mtd->bdev, _off, _sz) < 0)
 		return -1;
 
-	return _mtd->write(_mtd, _src, _off, _sz);
+	return mtd_write_raw(_mtd, _src, _off, _sz);
+}
+
+int mtd_readv(mtd_t *_mtd, const block_device_iovec_t *_vec, int _count)
+{
+	if(_mtd->readv)
+		return _mtd->readv(_mtd, _vec, _count);
+
+	int total = 0;
+	int i;
+	for(i = 0; i < _count; i++)
+	{
+		int ret = mtd_read(_mtd, _vec[i].buffer, (uint32_t)_vec[i].offset, _vec[i].size);
+		if(ret < 0)
+			return ret;
+
+		total += _vec[i].size;
+	}
+
+	return total;
+}
+
+int mtd_writev(mtd_t *_mtd, const block_device_iovec_t *_vec, int _count)
+{
+	int i;
+	for(i = 0; i < _count; i++)
+	{
+		if(block_device_invalidate(&_mtd->bdev, _vec[i].offset, _vec[i].size) < 0)
+			return -1;
+	}
+
+	return mtd_writev_raw(_mtd, _vec, _count);
+}
+
+// Devices without a sync hook have nothing buffered to write back.
+int mtd_sync(mtd_t *_mtd)
+{
+	if(_mtd->sync)
+		return _mtd->sync(_mtd);
+
+	return 0;
+}
+
+typedef enum _mtd_nor_sector_state
+{
+	mtd_nor_sector_clean,
+	mtd_nor_sector_program,
+	mtd_nor_sector_erase,
+} mtd_nor_sector_state_t;
+
+static uint32_t mtd_nor_stat_erases = 0;
+static uint32_t mtd_nor_stat_skipped = 0;
+static uint32_t mtd_nor_stat_programs = 0;
+static uint32_t mtd_nor_stat_programmed = 0;
+static uint64_t mtd_nor_stat_time = 0;
+
+// Programming can only clear bits, so a sector only needs erasing if some
+// bit has to go from 0 back to 1.
+static mtd_nor_sector_state_t mtd_nor_sector_diff(const uint8_t *_old, const uint8_t *_new, int _sz)
+{
+	const uint32_t *old = (const uint32_t*)_old;
+	const uint32_t *new = (const uint32_t*)_new;
+	mtd_nor_sector_state_t ret = mtd_nor_sector_clean;
+	int i;
+
+	for(i = 0; i < _sz / sizeof(uint32_t); i++)
+	{
+		if(old[i] == new[i])
+			continue;
+
+		if((old[i] & new[i]) != new[i])
+			return mtd_nor_sector_erase;
+
+		ret = mtd_nor_sector_program;
+	}
+
+	return ret;
+}
+
+int mtd_nor_write(mtd_t *_mtd, const mtd_nor_t *_nor, void *_src, uint32_t _off, int _sz)
+{
+	if(_sz <= 0)
+		return 0;
+
+	int startSector = _off / _nor->sector_size;
+	int endSector = (_off + _sz - 1) / _nor->sector_size;
+	uint32_t base = startSector * _nor->sector_size;
+	int len = (endSector - startSector + 1) * _nor->sector_size;
+
+	uint8_t *current = malloc(len * 2);
+	if(!current)
+		return -1;
+
+	uint8_t *wanted = current + len;
+	int ret = mtd_read(_mtd, current, base, len);
+	if(ret < 0)
+	{
+		free(current);
+		return ret;
+	}
+
+	memcpy(wanted, current, len);
+	memcpy(wanted + (_off - base), _src, _sz);
+
+	uint64_t startTime = timer_get_system_microtime();
+
+	// Erase everything that needs it up front, so the program pass below
+	// only has to look at what still differs.
+	int i;
+	for(i = 0; i < len; i += _nor->sector_size)
+	{
+		switch(mtd_nor_sector_diff(current + i, wanted + i, _nor->sector_size))
+		{
+		case mtd_nor_sector_clean:
+			mtd_nor_stat_skipped++;
+			break;
+
+		case mtd_nor_sector_erase:
+			ret = _nor->erase(_mtd, base + i);
+			if(ret < 0)
+				goto out;
+
+			memset(current + i, 0xFF, _nor->sector_size);
+			mtd_nor_stat_erases++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	// Program each page from its first to its last changed unit.
+	for(i = 0; i < len; i += _nor->page_size)
+	{
+		int first = 0;
+		int last = _nor->page_size - 1;
+
+		while(first < _nor->page_size && current[i + first] == wanted[i + first])
+			first++;
+
+		if(first == _nor->page_size)
+			continue;
+
+		while(current[i + last] == wanted[i + last])
+			last--;
+
+		first -= first % _nor->align;
+		last += _nor->align - 1 - (last % _nor->align);
+
+		ret = _nor->program(_mtd, base + i + first, wanted + i + first, last - first + 1);
+		if(ret < 0)
+			goto out;
+
+		mtd_nor_stat_programs++;
+		mtd_nor_stat_programmed += last - first + 1;
+	}
+
+	ret = _sz;
+
+out:
+	mtd_nor_stat_time += timer_get_system_microtime() - startTime;
+	free(current);
+	return ret;
 }
 
 void mtd_list_devices()
@@ -294,3 +521,20 @@ void cmd_mtd_write(int argc, char **argv)
 	mtd_finish(dev);
 }
 COMMAND("mtd_write", "Write to a MTD device.", cmd_mtd_write);
+
+void cmd_nor_stats(int argc, char **argv)
+{
+	bufferPrintf("nor: %d sectors erased, %d sectors unchanged, %d bytes programmed in %d runs, %d ms\r\n",
+			mtd_nor_stat_erases, mtd_nor_stat_skipped, mtd_nor_stat_programmed, mtd_nor_stat_programs,
+			(uint32_t)(mtd_nor_stat_time / 1000));
+
+	if(argc > 1 && strcmp(argv[1], "reset") == 0)
+	{
+		mtd_nor_stat_erases = 0;
+		mtd_nor_stat_skipped = 0;
+		mtd_nor_stat_programs = 0;
+		mtd_nor_stat_programmed = 0;
+		mtd_nor_stat_time = 0;
+	}
+}
+COMMAND("nor_stats", "show NOR write statistics, \"reset\" clears them", cmd_nor_stats);
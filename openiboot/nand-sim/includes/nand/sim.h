@@ -0,0 +1,62 @@
+#ifndef  NAND_SIM_H
+#define  NAND_SIM_H
+
+#include "../../includes/nand.h"
+
+typedef struct _nand_sim_geometry
+{
+	uint32_t num_ce;
+	uint32_t blocks_per_ce;
+	uint32_t pages_per_block;
+	uint32_t bytes_per_page;
+	uint32_t bytes_per_spare;
+	uint32_t meta_per_logical_page;
+	uint32_t ecc_bits;
+	uint32_t num_ecc_bytes;
+} nand_sim_geometry_t;
+
+typedef struct _nand_sim_latency
+{
+	uint32_t read_us;		// array busy time per page read
+	uint32_t write_us;		// program time per page
+	uint32_t xfer_ns_per_byte;	// bus transfer cost, main + spare
+} nand_sim_latency_t;
+
+typedef struct _nand_sim_stats
+{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t erases;
+	uint64_t empty_reads;
+	uint64_t ecc_failures;
+	uint64_t busy_us;
+} nand_sim_stats_t;
+
+// NAND-Sim Device Struct
+typedef struct _nand_sim_device
+{
+	nand_device_t nand;
+
+	nand_sim_geometry_t geometry;
+	nand_sim_latency_t latency;
+	nand_sim_stats_t stats;
+
+	// Every Nth read reports an uncorrectable ECC error (0 = never).
+	uint32_t ecc_fail_interval;
+	uint32_t ecc_fail_counter;
+
+	uint8_t *data;
+	uint8_t *spare;
+	uint8_t *written;	// one bit per page
+} nand_sim_device_t;
+
+// NAND-Sim Functions
+error_t nand_sim_device_init(nand_sim_device_t *_sim, nand_sim_geometry_t *_geometry);
+void nand_sim_device_cleanup(nand_sim_device_t *_sim);
+
+nand_sim_device_t *nand_sim_device_allocate(nand_sim_geometry_t *_geometry);
+
+error_t nand_sim_erase_block(nand_sim_device_t *_sim, uint32_t _ce, uint32_t _block);
+void nand_sim_reset_stats(nand_sim_device_t *_sim);
+
+#endif //NAND_SIM_H
@@ -0,0 +1,503 @@
+#include "nand/sim.h"
+#include "util.h"
+#include "timer.h"
+#include "commands.h"
+
+// RAM-backed NAND device. It implements nand_device_t with a configurable
+// geometry, so code layered on nand_device_t can be exercised and timed
+// without touching the real flash. Note that a fresh device is blank: none
+// of the VFLs in the tree can format one, so vfl_open will fail on it. The
+// VFL and FTL cannot be profiled on it yet; nand_sim_bench only measures
+// the simulated nand_device_t layer itself.
+
+#define nand_sim_get(ptr) (CONTAINER_OF(nand_sim_device_t, nand, (ptr)))
+
+static inline uint32_t nand_sim_page_index(nand_sim_device_t *_sim, uint32_t _ce, uint32_t _block, uint32_t _page)
+{
+	return ((_ce * _sim->geometry.blocks_per_ce) + _block) * _sim->geometry.pages_per_block + _page;
+}
+
+static inline int nand_sim_is_written(nand_sim_device_t *_sim, uint32_t _idx)
+{
+	return (_sim->written[_idx / 8] >> (_idx % 8)) & 1;
+}
+
+static inline int nand_sim_check_address(nand_sim_device_t *_sim, uint32_t _ce, uint32_t _block, uint32_t _page)
+{
+	return _ce < _sim->geometry.num_ce
+		&& _block < _sim->geometry.blocks_per_ce
+		&& _page < _sim->geometry.pages_per_block;
+}
+
+static void nand_sim_delay(nand_sim_device_t *_sim, uint32_t _array_us, int _with_spare)
+{
+	uint32_t bytes = _sim->geometry.bytes_per_page;
+	if(_with_spare)
+		bytes += _sim->geometry.bytes_per_spare;
+
+	uint32_t us = _array_us + ((bytes * _sim->latency.xfer_ns_per_byte) / 1000);
+	if(us == 0)
+		return;
+
+	udelay(us);
+	_sim->stats.busy_us += us;
+}
+
+static error_t nand_sim_read_single_page(nand_device_t *_dev, uint32_t _ce, uint32_t _block,
+		uint32_t _page, uint8_t *_buffer, uint8_t *_spareBuffer)
+{
+	nand_sim_device_t *sim = nand_sim_get(_dev);
+
+	if(!nand_sim_check_address(sim, _ce, _block, _page))
+		return EINVAL;
+
+	uint32_t idx = nand_sim_page_index(sim, _ce, _block, _page);
+
+	sim->stats.reads++;
+	nand_sim_delay(sim, sim->latency.read_us, _spareBuffer != NULL);
+
+	if(!nand_sim_is_written(sim, idx))
+	{
+		sim->stats.empty_reads++;
+
+		if(_buffer)
+			memset(_buffer, 0xFF, sim->geometry.bytes_per_page);
+
+		if(_spareBuffer)
+			memset(_spareBuffer, 0xFF, sim->geometry.meta_per_logical_page);
+
+		return ENOENT;
+	}
+
+	if(sim->ecc_fail_interval)
+	{
+		sim->ecc_fail_counter++;
+		if(sim->ecc_fail_counter >= sim->ecc_fail_interval)
+		{
+			sim->ecc_fail_counter = 0;
+			sim->stats.ecc_failures++;
+			return EIO;
+		}
+	}
+
+	if(_buffer)
+		memcpy(_buffer, sim->data + (idx * sim->geometry.bytes_per_page), sim->geometry.bytes_per_page);
+
+	if(_spareBuffer)
+		memcpy(_spareBuffer, sim->spare + (idx * sim->geometry.bytes_per_spare), sim->geometry.meta_per_logical_page);
+
+	return SUCCESS;
+}
+
+static error_t nand_sim_write_single_page(nand_device_t *_dev, uint32_t _ce, uint32_t _block,
+		uint32_t _page, uint8_t *_buffer, uint8_t *_spareBuffer)
+{
+	nand_sim_device_t *sim = nand_sim_get(_dev);
+
+	if(!nand_sim_check_address(sim, _ce, _block, _page))
+		return EINVAL;
+
+	uint32_t idx = nand_sim_page_index(sim, _ce, _block, _page);
+	uint8_t *data = sim->data + (idx * sim->geometry.bytes_per_page);
+	uint8_t *spare = sim->spare + (idx * sim->geometry.bytes_per_spare);
+
+	sim->stats.writes++;
+	nand_sim_delay(sim, sim->latency.write_us, _spareBuffer != NULL);
+
+	// Programming can only clear bits, just like the real thing.
+	uint32_t i;
+	if(_buffer)
+	{
+		for(i = 0; i < sim->geometry.bytes_per_page; i++)
+			data[i] &= _buffer[i];
+	}
+
+	if(_spareBuffer)
+	{
+		for(i = 0; i < sim->geometry.meta_per_logical_page; i++)
+			spare[i] &= _spareBuffer[i];
+	}
+
+	sim->written[idx / 8] |= 1 << (idx % 8);
+	return SUCCESS;
+}
+
+static uint32_t nand_sim_get_info(nand_device_t *_dev, nand_device_info_t _info)
+{
+	nand_sim_device_t *sim = nand_sim_get(_dev);
+
+	switch(_info)
+	{
+	case diReturnOne:
+		return 1;
+
+	case diNumCE:
+		return sim->geometry.num_ce;
+
+	case diBlocksPerCE:
+		return sim->geometry.blocks_per_ce;
+
+	case diPagesPerBlock:
+	case diPagesPerBlock2:
+		return sim->geometry.pages_per_block;
+
+	case diBytesPerPage:
+		return sim->geometry.bytes_per_page;
+
+	case diBytesPerSpare:
+		return sim->geometry.bytes_per_spare;
+
+	case diECCBits:
+	case diECCBits2:
+		return sim->geometry.ecc_bits;
+
+	case diNumECCBytes:
+		return sim->geometry.num_ecc_bytes;
+
+	case diMetaPerLogicalPage:
+		return sim->geometry.meta_per_logical_page;
+
+	case diPagesPerCE:
+		return sim->geometry.blocks_per_ce * sim->geometry.pages_per_block;
+
+	case diNumBusses:
+	case diNumCEPerBus:
+	case diBanksPerCE:
+	case diBanksPerCE_VFL:
+		return 1;
+
+	case diTotalBanks_VFL:
+		return sim->geometry.num_ce;
+
+	default:
+		return 0;
+	}
+}
+
+static void nand_sim_set_info(nand_device_t *_dev, nand_device_info_t _info, uint32_t _val)
+{
+	// The VFLs poke their settings in here, nothing for us to do.
+}
+
+error_t nand_sim_device_init(nand_sim_device_t *_sim, nand_sim_geometry_t *_geometry)
+{
+	memset(_sim, 0, sizeof(*_sim));
+
+	if(!_geometry->num_ce || !_geometry->blocks_per_ce || !_geometry->pages_per_block
+			|| !_geometry->bytes_per_page)
+		return EINVAL;
+
+	nand_device_init(&_sim->nand);
+	_sim->nand.read_single_page = nand_sim_read_single_page;
+	_sim->nand.write_single_page = nand_sim_write_single_page;
+	_sim->nand.get_info = nand_sim_get_info;
+	_sim->nand.set_info = nand_sim_set_info;
+
+	_sim->geometry = *_geometry;
+	if(!_sim->geometry.meta_per_logical_page
+			|| _sim->geometry.meta_per_logical_page > _sim->geometry.bytes_per_spare)
+		_sim->geometry.meta_per_logical_page = _sim->geometry.bytes_per_spare;
+
+	uint64_t pages = (uint64_t)_geometry->num_ce * _geometry->blocks_per_ce * _geometry->pages_per_block;
+	uint64_t dataSize = pages * _geometry->bytes_per_page;
+	uint64_t spareSize = pages * _geometry->bytes_per_spare;
+	if(pages > 0xFFFFFFFF || dataSize > 0xFFFFFFFF || spareSize > 0xFFFFFFFF)
+	{
+		nand_sim_device_cleanup(_sim);
+		return EINVAL;
+	}
+
+	_sim->data = malloc((uint32_t)dataSize);
+	_sim->spare = malloc((uint32_t)spareSize);
+	_sim->written = malloc((uint32_t)((pages + 7) / 8));
+	if(!_sim->data || !_sim->spare || !_sim->written)
+	{
+		nand_sim_device_cleanup(_sim);
+		return EIO;
+	}
+
+	memset(_sim->data, 0xFF, (uint32_t)dataSize);
+	memset(_sim->spare, 0xFF, (uint32_t)spareSize);
+	memset(_sim->written, 0, (uint32_t)((pages + 7) / 8));
+
+	return SUCCESS;
+}
+
+void nand_sim_device_cleanup(nand_sim_device_t *_sim)
+{
+	if(_sim->data)
+		free(_sim->data);
+
+	if(_sim->spare)
+		free(_sim->spare);
+
+	if(_sim->written)
+		free(_sim->written);
+
+	nand_device_cleanup(&_sim->nand);
+	memset(_sim, 0, sizeof(*_sim));
+}
+
+nand_sim_device_t *nand_sim_device_allocate(nand_sim_geometry_t *_geometry)
+{
+	nand_sim_device_t *ret = malloc(sizeof(*ret));
+	if(!ret)
+		return NULL;
+
+	if(FAILED(nand_sim_device_init(ret, _geometry)))
+	{
+		free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+error_t nand_sim_erase_block(nand_sim_device_t *_sim, uint32_t _ce, uint32_t _block)
+{
+	if(!nand_sim_check_address(_sim, _ce, _block, 0))
+		return EINVAL;
+
+	uint32_t first = nand_sim_page_index(_sim, _ce, _block, 0);
+	uint32_t i;
+	for(i = first; i < first + _sim->geometry.pages_per_block; i++)
+		_sim->written[i / 8] &= ~(1 << (i % 8));
+
+	memset(_sim->data + (first * _sim->geometry.bytes_per_page), 0xFF,
+			_sim->geometry.pages_per_block * _sim->geometry.bytes_per_page);
+	memset(_sim->spare + (first * _sim->geometry.bytes_per_spare), 0xFF,
+			_sim->geometry.pages_per_block * _sim->geometry.bytes_per_spare);
+
+	_sim->stats.erases++;
+	return SUCCESS;
+}
+
+void nand_sim_reset_stats(nand_sim_device_t *_sim)
+{
+	memset(&_sim->stats, 0, sizeof(_sim->stats));
+	_sim->ecc_fail_counter = 0;
+}
+
+static nand_sim_device_t *nand_sim = NULL;
+
+static void cmd_nand_sim_create(int argc, char** argv)
+{
+	if(argc < 5)
+	{
+		bufferPrintf("Usage: %s [ce] [blocks per ce] [pages per block] [bytes per page] [bytes per spare] [meta per page]\r\n", argv[0]);
+		return;
+	}
+
+	nand_sim_geometry_t geometry;
+	memset(&geometry, 0, sizeof(geometry));
+	geometry.num_ce = parseNumber(argv[1]);
+	geometry.blocks_per_ce = parseNumber(argv[2]);
+	geometry.pages_per_block = parseNumber(argv[3]);
+	geometry.bytes_per_page = parseNumber(argv[4]);
+	geometry.bytes_per_spare = (argc > 5)? parseNumber(argv[5]): 64;
+	geometry.meta_per_logical_page = (argc > 6)? parseNumber(argv[6]): 12;
+	geometry.ecc_bits = 8;
+
+	if(geometry.meta_per_logical_page > geometry.bytes_per_spare)
+	{
+		bufferPrintf("nand-sim: Metadata (%d bytes) doesn't fit in the spare area (%d bytes).\r\n",
+				geometry.meta_per_logical_page, geometry.bytes_per_spare);
+		return;
+	}
+
+	geometry.num_ecc_bytes = geometry.bytes_per_spare - geometry.meta_per_logical_page;
+
+	if(nand_sim)
+	{
+		nand_sim_device_cleanup(nand_sim);
+		free(nand_sim);
+	}
+
+	nand_sim = nand_sim_device_allocate(&geometry);
+	if(!nand_sim)
+	{
+		bufferPrintf("nand-sim: Failed to allocate simulated device.\r\n");
+		return;
+	}
+
+	bufferPrintf("nand-sim: Created %d CE x %d blocks x %d pages x %d+%d bytes at %p.\r\n",
+			geometry.num_ce, geometry.blocks_per_ce, geometry.pages_per_block,
+			geometry.bytes_per_page, geometry.bytes_per_spare, &nand_sim->nand);
+}
+COMMAND("nand_sim_create", "create a RAM-backed simulated NAND device", cmd_nand_sim_create);
+
+static void cmd_nand_sim_config(int argc, char** argv)
+{
+	if(!nand_sim)
+	{
+		bufferPrintf("nand-sim: No simulated device, use nand_sim_create first.\r\n");
+		return;
+	}
+
+	if(argc < 4)
+	{
+		bufferPrintf("Usage: %s [read us] [write us] [transfer ns/byte] [ecc fail interval]\r\n", argv[0]);
+		return;
+	}
+
+	nand_sim->latency.read_us = parseNumber(argv[1]);
+	nand_sim->latency.write_us = parseNumber(argv[2]);
+	nand_sim->latency.xfer_ns_per_byte = parseNumber(argv[3]);
+	nand_sim->ecc_fail_interval = (argc > 4)? parseNumber(argv[4]): 0;
+	nand_sim->ecc_fail_counter = 0;
+}
+COMMAND("nand_sim_config", "set simulated NAND latency and ECC failure injection", cmd_nand_sim_config);
+
+static void cmd_nand_sim_stats(int argc, char** argv)
+{
+	if(!nand_sim)
+	{
+		bufferPrintf("nand-sim: No simulated device.\r\n");
+		return;
+	}
+
+	bufferPrintf("nand-sim: reads: %u, writes: %u, erases: %u\r\n",
+			(uint32_t)nand_sim->stats.reads, (uint32_t)nand_sim->stats.writes, (uint32_t)nand_sim->stats.erases);
+	bufferPrintf("nand-sim: empty reads: %u, ecc failures: %u, busy: %u us\r\n",
+			(uint32_t)nand_sim->stats.empty_reads, (uint32_t)nand_sim->stats.ecc_failures, (uint32_t)nand_sim->stats.busy_us);
+
+	if(argc > 1 && !strcmp(argv[1], "reset"))
+		nand_sim_reset_stats(nand_sim);
+}
+COMMAND("nand_sim_stats", "print (and optionally reset) simulated NAND counters", cmd_nand_sim_stats);
+
+static void nand_sim_sort(uint32_t *_vals, int _count)
+{
+	int gap, i, j;
+	for(gap = _count / 2; gap > 0; gap /= 2)
+	{
+		for(i = gap; i < _count; i++)
+		{
+			uint32_t v = _vals[i];
+			for(j = i; j >= gap && _vals[j - gap] > v; j -= gap)
+				_vals[j] = _vals[j - gap];
+
+			_vals[j] = v;
+		}
+	}
+}
+
+static void cmd_nand_sim_bench(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		bufferPrintf("Usage: %s [seq|rand|mixed] [ops]\r\n", argv[0]);
+		return;
+	}
+
+	// Only ever run against the simulator: mixed mode programs pages
+	// without erasing them, which would corrupt a real NAND.
+	if(!nand_sim)
+	{
+		bufferPrintf("nand-sim: No simulated device, use nand_sim_create first.\r\n");
+		return;
+	}
+
+	nand_device_t *dev = &nand_sim->nand;
+
+	int mode;
+	if(!strcmp(argv[1], "seq"))
+		mode = 0;
+	else if(!strcmp(argv[1], "rand"))
+		mode = 1;
+	else if(!strcmp(argv[1], "mixed"))
+		mode = 2;
+	else
+	{
+		bufferPrintf("nand-sim: Unknown workload '%s'.\r\n", argv[1]);
+		return;
+	}
+
+	uint32_t ops = parseNumber(argv[2]);
+	uint32_t ces = nand_device_get_info(dev, diNumCE);
+	uint32_t blocks = nand_device_get_info(dev, diBlocksPerCE);
+	uint32_t pagesPerBlock = nand_device_get_info(dev, diPagesPerBlock);
+	uint32_t bytesPerPage = nand_device_get_info(dev, diBytesPerPage);
+	uint32_t total = ces * blocks * pagesPerBlock;
+	if(!ops || !total)
+		return;
+
+	uint8_t *buffer = malloc(bytesPerPage);
+	uint8_t *spare = malloc(nand_device_get_info(dev, diBytesPerSpare));
+	uint32_t *lat = malloc(ops * sizeof(uint32_t));
+	if(!buffer || !spare || !lat)
+	{
+		bufferPrintf("nand-sim: Out of memory.\r\n");
+		goto release;
+	}
+
+	memset(buffer, 0x5A, bytesPerPage);
+	memset(spare, 0xFF, nand_device_get_info(dev, diBytesPerSpare));
+
+	uint32_t seed = 0x12345678;
+	uint32_t errors = 0;
+	uint32_t writes = 0;
+	uint64_t start = timer_get_system_microtime();
+	uint32_t i;
+	for(i = 0; i < ops; i++)
+	{
+		uint32_t page;
+		int write = FALSE;
+
+		seed = (seed * 1103515245) + 12345;
+		if(mode == 0)
+			page = i % total;
+		else
+			page = (seed >> 8) % total;
+
+		// 70/30 read/write split
+		if(mode == 2)
+			write = ((seed >> 4) % 10) < 3;
+
+		// Interleave consecutive pages across CEs like the VFLs do.
+		uint32_t ce = page % ces;
+		uint32_t block = (page / ces) / pagesPerBlock;
+		uint32_t pg = (page / ces) % pagesPerBlock;
+
+		uint64_t opStart = timer_get_system_microtime();
+		error_t ret;
+		if(write)
+		{
+			ret = nand_device_write_single_page(dev, ce, block, pg, buffer, spare);
+			writes++;
+		}
+		else
+			ret = nand_device_read_single_page(dev, ce, block, pg, buffer, spare);
+
+		lat[i] = (uint32_t)(timer_get_system_microtime() - opStart);
+
+		if(FAILED(ret) && ret != ENOENT)
+			errors++;
+	}
+
+	uint64_t elapsed = timer_get_system_microtime() - start;
+	if(elapsed == 0)
+		elapsed = 1;
+
+	nand_sim_sort(lat, ops);
+
+	uint64_t bytes = (uint64_t)ops * bytesPerPage;
+	bufferPrintf("nand-sim: %s: %u ops (%u writes, %u errors) in %u us.\r\n",
+			argv[1], ops, writes, errors, (uint32_t)elapsed);
+	bufferPrintf("nand-sim: %u pages/s, %u KB/s.\r\n",
+			(uint32_t)(((uint64_t)ops * uSecPerSec) / elapsed),
+			(uint32_t)((bytes * uSecPerSec) / (elapsed * 1024)));
+	bufferPrintf("nand-sim: latency us: p50 %u, p90 %u, p99 %u, max %u.\r\n",
+			lat[ops / 2], lat[(ops * 9) / 10], lat[(ops * 99) / 100], lat[ops - 1]);
+
+release:
+	if(buffer)
+		free(buffer);
+
+	if(spare)
+		free(spare);
+
+	if(lat)
+		free(lat);
+}
+COMMAND("nand_sim_bench", "run a sequential/random/mixed workload against the simulated NAND", cmd_nand_sim_bench);
@@ -136,39 +136,40 @@ static int nor_read(mtd_t *_dev, void *_dest, uint32_t _off, int _amt)
 	return _amt;
 }
 
-static int nor_write(mtd_t *_dev, void *_src, uint32_t _off, int _amt)
+static int nor_erase(mtd_t *_dev, uint32_t _off)
 {
-	nor_device_t *dev = nor_device_get(_dev);
-	int startSector = _off / NOR_BLOCK_SIZE;
-	int endSector = (_off + _amt) / NOR_BLOCK_SIZE;
-
-	int numSectors = endSector - startSector + 1;
-	uint8_t* sectorsToChange = (uint8_t*) malloc(NOR_BLOCK_SIZE * numSectors);
-	nor_read(_dev, sectorsToChange, startSector * NOR_BLOCK_SIZE, NOR_BLOCK_SIZE * numSectors);
-
-	int offsetFromStart = _off - (startSector * NOR_BLOCK_SIZE);
-
-	memcpy(sectorsToChange + offsetFromStart, _src, _amt);
+	return nor_erase_sector(nor_device_get(_dev), _off);
+}
 
+static int nor_program(mtd_t *_dev, uint32_t _off, const void *_src, int _sz)
+{
+	nor_device_t *dev = nor_device_get(_dev);
+	const uint16_t *data = _src;
 	int i;
-	for(i = 0; i < numSectors; i++) {
-		if(nor_erase_sector(dev, (i + startSector) * NOR_BLOCK_SIZE) != 0)
-			return -1;
 
-		int j;
-		uint16_t* curSector = (uint16_t*)(sectorsToChange + (i * NOR_BLOCK_SIZE));
-		for(j = 0; j < NOR_BLOCK_SIZE; j += 2)
-		{
-			if(nor_write_short(dev, ((i + startSector) * NOR_BLOCK_SIZE) + j, curSector[j/2]) != 0)
-				return -1;
-		}
+	for(i = 0; i < _sz / 2; i++)
+	{
+		if(nor_write_short(dev, _off + (i * 2), data[i]) != 0)
+			return -1;
 	}
 
-	free(sectorsToChange);
-
 	return 0;
 }
 
+static const mtd_nor_t nor_geometry = {
+	.sector_size = NOR_BLOCK_SIZE,
+	.page_size = 2,
+	.align = 2,
+
+	.erase = nor_erase,
+	.program = nor_program,
+};
+
+static int nor_write(mtd_t *_dev, void *_src, uint32_t _off, int _amt)
+{
+	return mtd_nor_write(_dev, &nor_geometry, _src, _off, _amt);
+}
+
 static int nor_size(mtd_t *_dev)
 {
 	return 16 * 1024 * 1024;
@@ -12,6 +12,10 @@
 #include "syscfg.h"
 #include "nvram.h"
 
+// The S5L8900 spi_rx gives up on a blocking transfer after 1ms, which at
+// 12MHz is only about 1.5KB, so long reads are received in chunks of this.
+#define NOR_READ_CHUNK 1024
+
 typedef struct _nor_device
 {
 	mtd_t mtd;
@@ -29,8 +33,14 @@ static inline nor_device_t *nor_device_get(mtd_t *_dev)
 	return CONTAINER_OF(nor_device_t, mtd, _dev);
 }
 
+static uint32_t nor_stat_commands = 0;
+static uint32_t nor_stat_bytes = 0;
+
 static int nor_spi_tx(nor_device_t *_dev, void *_tx, int _tx_amt)
 {
+	nor_stat_commands++;
+	nor_stat_bytes += _tx_amt;
+
 	gpio_pin_output(_dev->gpio, 0);
 	int ret = spi_tx(_dev->spi, _tx, _tx_amt, TRUE, 0);
 	gpio_pin_output(_dev->gpio, 1);
@@ -39,6 +49,9 @@ static int nor_spi_tx(nor_device_t *_dev, void *_tx, int _tx_amt)
 
 static int nor_spi_txrx(nor_device_t *_dev, void *_tx, int _tx_amt, void *_rx, int _rx_amt)
 {
+	nor_stat_commands++;
+	nor_stat_bytes += _tx_amt + _rx_amt;
+
 	gpio_pin_output(_dev->gpio, 0);
 	int ret = spi_tx(_dev->spi, _tx, _tx_amt, TRUE, 0);
 	if(ret >= 0)
@@ -189,6 +202,37 @@ static int nor_write_byte(nor_device_t *_dev, uint32_t offset, uint8_t data)
 	return 0;
 }
 
+static int nor_program_page(nor_device_t *_dev, uint32_t _offset, const uint8_t *_data, int _amt)
+{
+	if(nor_wait_for_ready(_dev, 100) != 0)
+		return -1;
+
+	// The write enable latch is cleared after every program, so it has to
+	// be set again for each page regardless of write_enabled.
+	uint8_t command[4];
+	command[0] = NOR_SPI_WREN;
+	nor_spi_tx(_dev, command, 1);
+
+	command[0] = NOR_SPI_PRGM;
+	command[1] = (_offset >> 16) & 0xFF;
+	command[2] = (_offset >> 8) & 0xFF;
+	command[3] = _offset & 0xFF;
+
+	nor_stat_commands++;
+	nor_stat_bytes += sizeof(command) + _amt;
+
+	gpio_pin_output(_dev->gpio, 0);
+	int ret = spi_tx(_dev->spi, command, sizeof(command), TRUE, 0);
+	if(ret >= 0)
+		ret = spi_tx(_dev->spi, (void*)_data, _amt, TRUE, 0);
+	gpio_pin_output(_dev->gpio, 1);
+
+	if(ret < 0)
+		return ret;
+
+	return nor_wait_for_ready(_dev, 100);
+}
+
 static int nor_read(mtd_t *_dev, void *_dest, uint32_t _off, int _amt)
 {
 	uint8_t command[4];
@@ -196,64 +240,86 @@ static int nor_read(mtd_t *_dev, void *_dest, uint32_t _off, int _amt)
 	nor_device_t *dev = nor_device_get(_dev);
 	int len = _amt;
 
+	// A single READ keeps streaming data for as long as CS is held low, so
+	// the command is only reissued if a transfer fails part way through.
 	while(len > 0)
 	{
-		int toRead = MIN(len, NOR_MAX_READ);
-
 		command[0] = NOR_SPI_READ;
 		command[1] = (_off >> 16) & 0xFF;
 		command[2] = (_off >> 8) & 0xFF;
 		command[3] = _off & 0xFF;
 
-		if(nor_spi_txrx(dev, command, sizeof(command), data, toRead) < 0)
-			continue;
+		nor_stat_commands++;
+		nor_stat_bytes += sizeof(command);
+
+		gpio_pin_output(dev->gpio, 0);
+		int ret = spi_tx(dev->spi, command, sizeof(command), TRUE, 0);
+		while(ret >= 0 && len > 0)
+		{
+			int toRead = MIN(len, NOR_READ_CHUNK);
+
+			ret = spi_rx(dev->spi, data, toRead, TRUE, 0);
+			if(ret < 0)
+				break;
 
-		len -= toRead;
-		data += toRead;
-		_off += toRead;
+			nor_stat_bytes += toRead;
+			len -= toRead;
+			data += toRead;
+			_off += toRead;
+		}
+		gpio_pin_output(dev->gpio, 1);
 	}
 
 	return _amt;
 }
 
-static int nor_write(mtd_t *_dev, void *_src, uint32_t _off, int _amt)
+static int nor_erase(mtd_t *_dev, uint32_t _off)
 {
-	nor_device_t *dev = nor_device_get(_dev);
-	int startSector = _off / NOR_BLOCK_SIZE;
-	int endSector = (_off + _amt) / NOR_BLOCK_SIZE;
-
-	int numSectors = endSector - startSector + 1;
-	uint8_t* sectorsToChange = (uint8_t*) malloc(NOR_BLOCK_SIZE * numSectors);
-	nor_read(_dev, sectorsToChange, startSector * NOR_BLOCK_SIZE, NOR_BLOCK_SIZE * numSectors);
+	return nor_erase_sector(nor_device_get(_dev), _off);
+}
 
-	int offsetFromStart = _off - (startSector * NOR_BLOCK_SIZE);
+static int nor_program(mtd_t *_dev, uint32_t _off, const void *_src, int _sz)
+{
+	nor_device_t *dev = nor_device_get(_dev);
+	const uint8_t *data = _src;
 
-	memcpy(sectorsToChange + offsetFromStart, _src, _amt);
+	if(dev->vendor != 0xBF)
+		return nor_program_page(dev, _off, data, _sz);
 
 	int i;
-	for(i = 0; i < numSectors; i++) {
-		if(nor_erase_sector(dev, (i + startSector) * NOR_BLOCK_SIZE) != 0)
+	for(i = 0; i < _sz; i++)
+	{
+		if(nor_write_byte(dev, _off + i, data[i]) != 0)
 			return -1;
+	}
 
-		nor_write_enable(dev);
+	return 0;
+}
 
-		int j;
-		uint8_t* curSector = (uint8_t*)(sectorsToChange + (i * NOR_BLOCK_SIZE));
-		for(j = 0; j < NOR_BLOCK_SIZE; j++)
-		{
-			if(nor_write_byte(dev, ((i + startSector) * NOR_BLOCK_SIZE) + j, curSector[j]) != 0)
-			{
-				nor_write_disable(dev);
-				return -1;
-			}
-		}
+static const mtd_nor_t nor_geometry = {
+	.sector_size = NOR_BLOCK_SIZE,
+	.page_size = NOR_PAGE_SIZE,
+	.align = 1,
 
-		nor_write_disable(dev);
-	}
+	.erase = nor_erase,
+	.program = nor_program,
+};
 
-	free(sectorsToChange);
+// SST parts have no multi-byte page program, so every changed byte is
+// programmed on its own.
+static const mtd_nor_t nor_sst_geometry = {
+	.sector_size = NOR_BLOCK_SIZE,
+	.page_size = 1,
+	.align = 1,
 
-	return 0;
+	.erase = nor_erase,
+	.program = nor_program,
+};
+
+static int nor_write(mtd_t *_dev, void *_src, uint32_t _off, int _amt)
+{
+	nor_device_t *dev = nor_device_get(_dev);
+	return mtd_nor_write(_dev, (dev->vendor == 0xBF) ? &nor_sst_geometry : &nor_geometry, _src, _off, _amt);
 }
 
 static int nor_size(mtd_t *_dev)
@@ -303,3 +369,15 @@ static void nor_init()
 	}
 }
 MODULE_INIT_BOOT(nor_init);
+
+static void cmd_nor_spi_stats(int argc, char** argv)
+{
+	bufferPrintf("nor: %d SPI commands, %d bytes on the bus\r\n", nor_stat_commands, nor_stat_bytes);
+
+	if(argc > 1 && strcmp(argv[1], "reset") == 0)
+	{
+		nor_stat_commands = 0;
+		nor_stat_bytes = 0;
+	}
+}
+COMMAND("nor_spi_stats", "show NOR SPI bus statistics, \"reset\" clears them", cmd_nor_spi_stats);
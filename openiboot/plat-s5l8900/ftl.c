@@ -4,6 +4,8 @@
 #include "s5l8900/nand.h"
 #include "mtd.h"
 #include "util.h"
+#include "timer.h"
+#include "tasks.h"
 
 #define FTL_ID_V1 0x43303033
 #define FTL_ID_V2 0x43303034
@@ -23,6 +25,41 @@ static int ftl_get_free_vb(uint16_t* block);
 static int ftl_merge(FTLCxtLog* pLog);
 static int ftl_commit_cxt();
 static int ftl_open_read_counter_tables();
+static int ftl_alloc_committed_tables();
+static void ftl_snapshot_committed_tables();
+static int ftl_journal_erase(uint16_t block);
+
+typedef struct FTLMergeStats {
+	uint32_t inlineMerges;
+	uint32_t backgroundMerges;
+	uint32_t backgroundFailures;
+	uint32_t writes;
+	uint32_t maxWriteUs;
+	uint32_t writeLatency[5];	// < 1ms, < 10ms, < 100ms, < 1s, >= 1s
+} FTLMergeStats;
+
+static FTLMergeStats FTLMergeStat;
+
+// Write temperature of each logical block: bumped on every write that touches
+// the block and halved every FTL_HEAT_DECAY_PAGES written pages. Logs of cold
+// blocks are merged first, so frequently rewritten blocks keep their log
+// longer and absorb more rewrites per merge.
+#define FTL_HEAT_HOT		4
+#define FTL_HEAT_MAX		255
+#define FTL_HEAT_DECAY_PAGES	4096
+
+typedef struct FTLWriteStats {
+	uint32_t hostPages;
+	uint32_t dataPagesProgrammed;
+	uint32_t ctrlPagesProgrammed;
+	uint32_t coldMergeVictims;
+	uint32_t hotMergeVictims;
+} FTLWriteStats;
+
+static uint8_t* LbnHeat = NULL;
+static int HotColdEnabled = TRUE;
+static uint32_t PagesSinceDecay = 0;
+static FTLWriteStats FTLWriteStat;
 
 static int findDeviceInfoBBT(int bank, void* deviceInfoBBT) {
 	uint8_t* buffer = malloc(Geometry->bytesPerPage);
@@ -119,6 +156,14 @@ static uint32_t* ScatteredVirtualPageNumberBuffer;
 static uint8_t* StoreCxt;
 static int NumPagesToWriteInStoreCxt;
 
+// Maps each logical block to the pLog slot that currently holds its log, or
+// FTL_NO_LOG_SLOT. Entries can go stale when a log is merged away, so ftl_get_log
+// checks the slot it is pointed at, but every live log always has an entry.
+#define FTL_NO_LOG_SLOT 0xFF
+static uint8_t* LogSlotIndex = NULL;
+static uint32_t LogLookups = 0;
+static uint32_t LogLookupHits = 0;
+
 static int FTL_Init() {
 	NumPagesToWriteInStoreCxt = 0;
 
@@ -178,10 +223,18 @@ static int FTL_Init() {
 
 	StoreCxt = malloc(Geometry->bytesPerPage * NumPagesToWriteInStoreCxt);
 	ScatteredVirtualPageNumberBuffer = (uint32_t*) malloc(Geometry->pagesPerSuBlk * sizeof(uint32_t*));
+	LogSlotIndex = (uint8_t*) malloc(Geometry->userSuBlksTotal);
+	LbnHeat = (uint8_t*) malloc(Geometry->userSuBlksTotal);
+
+	if(!pstFTLCxt->pawMapTable || !pstFTLCxt->wPageOffsets || !pstFTLCxt->pawEraseCounterTable || !FTLCxtBuffer->pawReadCounterTable || ! FTLSpareBuffer || !StoreCxt || !ScatteredVirtualPageNumberBuffer || !LogSlotIndex || !LbnHeat)
+		return -1;
 
-	if(!pstFTLCxt->pawMapTable || !pstFTLCxt->wPageOffsets || !pstFTLCxt->pawEraseCounterTable || !FTLCxtBuffer->pawReadCounterTable || ! FTLSpareBuffer || !StoreCxt || !ScatteredVirtualPageNumberBuffer)
+	if(!ftl_alloc_committed_tables())
 		return -1;
 
+	memset(LogSlotIndex, FTL_NO_LOG_SLOT, Geometry->userSuBlksTotal);
+	memset(LbnHeat, 0, Geometry->userSuBlksTotal);
+
 	int i;
 	for(i = 0; i < 18; i++) {
 		pstFTLCxt->pLog[i].wPageOffsets = pstFTLCxt->wPageOffsets + (i * Geometry->pagesPerSuBlk);
@@ -605,8 +658,15 @@ int VFL_Write(uint32_t virtualPageNumber, uint8_t* buffer, uint8_t* spare)
 	int page = physicalBlock * Geometry->pagesPerBlock + virtualPage;
 
 	int ret = nand_write(virtualBank, page, buffer, spare, TRUE);
-	if(ret == 0)
+	if(ret == 0) {
+		uint8_t type = ((SpareData*) spare)->type1;
+		if(type == 0x40 || type == 0x41)
+			++FTLWriteStat.dataPagesProgrammed;
+		else
+			++FTLWriteStat.ctrlPagesProgrammed;
+
 		return 0;
+	}
 
 	++pstVFLCxt[virtualBank].field_16;
 	vfl_gen_checksum(virtualBank);
@@ -616,15 +676,42 @@ int VFL_Write(uint32_t virtualPageNumber, uint8_t* buffer, uint8_t* spare)
 }
 
 static int VFL_ReadMultiplePagesInVb(int logicalBlock, int logicalPage, int count, uint8_t* main, SpareData* spare, int* refresh_page) {
+	VFLData1.field_8 += count;
+	VFLData1.field_20++;
+
+	if(refresh_page) {
+		*refresh_page = FALSE;
+	}
+
 	int i;
-	int currentPage = logicalPage; 
 	for(i = 0; i < count; i++) {
-		int ret = VFL_Read((logicalBlock * Geometry->pagesPerSuBlk) + currentPage, main + (Geometry->bytesPerPage * i), (uint8_t*) &spare[i], TRUE, refresh_page);
-		currentPage++;
-		if(ret != 0)
+		uint32_t dwVpn = (logicalBlock * Geometry->pagesPerSuBlk) + logicalPage + i + (Geometry->pagesPerSuBlk * FTLData->field_4);
+		if(dwVpn >= Geometry->pagesTotal) {
+			bufferPrintf("ftl: dwVpn overflow: %d\r\n", dwVpn);
 			return FALSE;
+		}
+
+		uint16_t virtualBlock;
+		uint16_t virtualPage;
+		uint16_t physicalBlock;
+
+		virtual_page_number_to_virtual_address(dwVpn, &ScatteredBankNumberBuffer[i], &virtualBlock, &virtualPage);
+		physicalBlock = virtual_block_to_physical_block(ScatteredBankNumberBuffer[i], virtualBlock);
+		ScatteredPageNumberBuffer[i] = physicalBlock * Geometry->pagesPerBlock + virtualPage;
 	}
-	return TRUE;
+
+	// Pages of a virtual block are striped across the banks, so the reads can be
+	// overlapped. Empty pages and errors are left to the caller, which retries
+	// the rest of the run one page at a time through VFL_Read.
+	int ret = nand_read_batch(ScatteredBankNumberBuffer, ScatteredPageNumberBuffer, main, spare, count, FALSE);
+	if(Geometry->field_2F <= 0 && refresh_page != NULL && ret == 0) {
+		*refresh_page = TRUE;
+	}
+
+	if(ret != 0)
+		return FALSE;
+	else
+		return TRUE;
 }
 
 static int VFL_ReadScatteredPagesInVb(uint32_t* virtualPageNumber, int count, uint8_t* main, SpareData* spare, int* refresh_page) {
@@ -817,7 +904,7 @@ static int ftl_set_free_vb(uint16_t block)
 	++pstFTLCxt->pawEraseCounterTable[block];
 	pstFTLCxt->pawReadCounterTable[block] = 0;
 
-	if(VFL_Erase(block) != 0)
+	if(!ftl_journal_erase(block) || VFL_Erase(block) != 0)
 	{
 		bufferPrintf("ftl: failed to release a virtual block from the pool\r\n");
 		return FALSE;
@@ -995,6 +1082,319 @@ static int determine_block_type(uint16_t block, uint32_t* highest_usn)
 	return isSequential;
 }
 
+// Mount summary. Each context commit writes a summary page right before the
+// FTLCxt page. From then until the next commit, any block that was mapped at
+// the commit gets an entry appended to the control block before it is erased.
+// Every other block can only change if it was a log, a free block or a control
+// block at the time of the commit. A restore that finds a valid summary can
+// therefore take the map at the last commit as the scan result for every
+// mapped block that is not in the journal. It only has to scan the rest.
+#define FTL_SUMMARY_MAGIC	0x534C5446	// 'FTLS'
+#define FTL_SUMMARY_VERSION	1
+#define FTL_SUMMARY_TYPE	0x4A
+#define FTL_JOURNAL_MAGIC	0x4A4C5446	// 'FTLJ'
+#define FTL_JOURNAL_TYPE	0x4B
+#define FTL_JOURNAL_OVERFLOW	0xFFFFFFFF
+
+typedef struct FTLSummary {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numBlocks;
+	uint32_t nextblockusn;		// USN high-water mark at commit time
+	uint32_t mapChecksum;
+} FTLSummary;
+
+typedef struct FTLJournalEntry {
+	uint32_t magic;
+	uint32_t block;
+} FTLJournalEntry;
+
+typedef struct FTLRestoreStats {
+	uint32_t restores;
+	uint32_t fastRestores;
+	uint32_t lastTotalUs;
+	uint32_t lastScanUs;
+	uint32_t lastBlocksScanned;
+	uint32_t lastBlocksSkipped;
+	uint32_t lastJournalEntries;
+	uint32_t journalWrites;
+} FTLRestoreStats;
+
+// Off by default: the summary and journal pages live in the control block
+// iOS shares, and it is not yet known whether iOS tolerates those page types.
+static int SummaryEnabled = FALSE;
+static int JournalActive = FALSE;
+static uint8_t* JournalSkip = NULL;	// bitmap of blocks that need no journal entry
+static FTLRestoreStats FTLRestoreStat;
+
+static int ftl_num_vbs()
+{
+	return Geometry->userSuBlksTotal + 23;
+}
+
+static uint32_t ftl_map_checksum(uint16_t* map)
+{
+	uint32_t sum = 0;
+	int i;
+	for(i = 0; i < Geometry->userSuBlksTotal; i++)
+		sum = ((sum << 5) | (sum >> 27)) ^ map[i];
+
+	return sum;
+}
+
+// Called after a commit that wrote a summary: only blocks mapped right now have
+// to be journaled before they are erased.
+static void ftl_journal_start()
+{
+	// No room for a journal after the FTLCxt page, restore will scan everything anyway.
+	if(((pstFTLCxt->FTLCtrlPage + 1) % Geometry->pagesPerSuBlk) == 0)
+	{
+		JournalActive = FALSE;
+		return;
+	}
+
+	if(JournalSkip == NULL)
+	{
+		JournalSkip = (uint8_t*) malloc((ftl_num_vbs() + 7) / 8);
+		if(JournalSkip == NULL)
+		{
+			JournalActive = FALSE;
+			return;
+		}
+	}
+
+	memset(JournalSkip, 0xFF, (ftl_num_vbs() + 7) / 8);
+
+	int i;
+	for(i = 0; i < Geometry->userSuBlksTotal; i++)
+	{
+		uint16_t block = pstFTLCxt->pawMapTable[i];
+		if(block < ftl_num_vbs())
+			JournalSkip[block / 8] &= ~(1 << (block % 8));
+	}
+
+	JournalActive = TRUE;
+}
+
+static int ftl_journal_write(uint32_t block)
+{
+	uint8_t* pageBuffer = (uint8_t*) malloc(Geometry->bytesPerPage);
+	SpareData* spareData = (SpareData*) malloc(Geometry->bytesPerSpare);
+	if(!pageBuffer || !spareData)
+	{
+		if(pageBuffer)
+			free(pageBuffer);
+		if(spareData)
+			free(spareData);
+		return FALSE;
+	}
+
+	int ret = FALSE;
+	if(ftl_next_ctrl_page())
+	{
+		FTLJournalEntry* entry = (FTLJournalEntry*) pageBuffer;
+		memset(pageBuffer, 0xFF, Geometry->bytesPerPage);
+		entry->magic = FTL_JOURNAL_MAGIC;
+		entry->block = block;
+
+		memset(spareData, 0xFF, sizeof(SpareData));
+		spareData->meta.usnDec = pstFTLCxt->usnDec;
+		spareData->type1 = FTL_JOURNAL_TYPE;
+		spareData->meta.idx = 0;
+
+		ret = (VFL_Write(pstFTLCxt->FTLCtrlPage, pageBuffer, (uint8_t*) spareData) == 0);
+		++FTLRestoreStat.journalWrites;
+	}
+
+	free(pageBuffer);
+	free(spareData);
+	return ret;
+}
+
+// Must be called before a block that may have been mapped at the last commit is erased.
+// Returns FALSE if the erase could not be recorded, in which case the block must not
+// be erased.
+static int ftl_journal_erase(uint16_t block)
+{
+	if(!JournalActive || block >= ftl_num_vbs())
+		return TRUE;
+
+	if(JournalSkip[block / 8] & (1 << (block % 8)))
+		return TRUE;
+
+	// Never let the journal roll over into the next control block. Restore only
+	// trusts a journal that is followed by an empty page in the same block, so
+	// the last page is used for an overflow marker instead.
+	uint32_t blockEnd = ((pstFTLCxt->FTLCtrlPage / Geometry->pagesPerSuBlk) + 1) * Geometry->pagesPerSuBlk;
+	if((pstFTLCxt->FTLCtrlPage + 1) < (blockEnd - 1) && ftl_journal_write(block))
+	{
+		JournalSkip[block / 8] |= 1 << (block % 8);
+		return TRUE;
+	}
+
+	// Out of room, or the entry did not make it to flash (a failed page may
+	// still read back as empty). Either way restore must stop trusting the
+	// journal from here on, so end it with the overflow marker.
+	if((pstFTLCxt->FTLCtrlPage + 1) < blockEnd && ftl_journal_write(FTL_JOURNAL_OVERFLOW))
+	{
+		JournalActive = FALSE;
+		return TRUE;
+	}
+
+	bufferPrintf("ftl: cannot journal the erase of block %d\r\n", block);
+	return FALSE;
+}
+
+static int ftl_write_summary(uint8_t* pageBuffer, SpareData* spareData)
+{
+	if(!ftl_next_ctrl_page())
+	{
+		bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
+		return FALSE;
+	}
+
+	FTLSummary* summary = (FTLSummary*) pageBuffer;
+	memset(pageBuffer, 0, Geometry->bytesPerPage);
+	summary->magic = FTL_SUMMARY_MAGIC;
+	summary->version = FTL_SUMMARY_VERSION;
+	summary->numBlocks = ftl_num_vbs();
+	summary->nextblockusn = pstFTLCxt->nextblockusn;
+	summary->mapChecksum = ftl_map_checksum(pstFTLCxt->pawMapTable);
+
+	memset(spareData, 0xFF, sizeof(SpareData));
+	spareData->meta.usnDec = pstFTLCxt->usnDec;
+	spareData->type1 = FTL_SUMMARY_TYPE;
+	spareData->meta.idx = 0;
+
+	return VFL_Write(pstFTLCxt->FTLCtrlPage, pageBuffer, (uint8_t*) spareData) == 0;
+}
+
+// The summary has to be the page right before the FTLCxt page and carry the
+// next usnDec, otherwise it belongs to some other (older) commit.
+static int ftl_read_summary(uint32_t cxtPage, uint32_t cxtUsnDec, FTLSummary* summary, uint8_t* pageBuffer, SpareData* spareData)
+{
+	if((cxtPage % Geometry->pagesPerSuBlk) == 0)
+		return FALSE;
+
+	if(VFL_Read(cxtPage - 1, pageBuffer, (uint8_t*) spareData, TRUE, NULL) != 0)
+		return FALSE;
+
+	if(spareData->type1 != FTL_SUMMARY_TYPE || spareData->meta.usnDec != (cxtUsnDec + 1))
+		return FALSE;
+
+	memcpy(summary, pageBuffer, sizeof(FTLSummary));
+	if(summary->magic != FTL_SUMMARY_MAGIC || summary->version != FTL_SUMMARY_VERSION || summary->numBlocks != ftl_num_vbs())
+		return FALSE;
+
+	return TRUE;
+}
+
+// Step one of FTL_Restore for a single virtual block.
+static void ftl_restore_scan_block(int block, uint16_t* blockMap, uint8_t* isEmpty, uint8_t* nonSequential, uint8_t* pageBuffer, SpareData* spareData)
+{
+	blockMap[block] = 0xFFFF;
+	isEmpty[block] = 1;
+	nonSequential[block] = 0;
+
+	int page;
+	for(page = 0; page < Geometry->pagesPerSuBlk; ++page)
+	{
+		int ret = VFL_Read(block * Geometry->pagesPerSuBlk + page, pageBuffer, (uint8_t*) spareData, TRUE, NULL);
+
+		if(ret == ERROR_EMPTYBLOCK)
+			continue;
+		
+		isEmpty[block] = 0;
+		
+		if(ret != 0)
+			continue;
+		
+		if(spareData->type1 >= 0x43 && spareData->type1 <= 0x4F)
+			break;
+
+		// wtf is this? well, we'll just count it as empty
+		if(spareData->type1 != 0x40 && spareData->type1 != 0x41)
+			continue;
+
+		if((spareData->user.logicalPageNumber % Geometry->pagesPerSuBlk) != page)
+			nonSequential[block] = 1;
+
+		blockMap[block] = spareData->user.logicalPageNumber / Geometry->pagesPerSuBlk;
+		break;	
+	}
+}
+
+// Fills in the step one results from the summary, the map at the time of the
+// last commit and the journal after it. Returns FALSE if any of it cannot be
+// trusted, in which case everything has to be scanned.
+static int ftl_restore_from_summary(uint32_t cxtPage, uint32_t cxtUsnDec, FTLSummary* summary, uint8_t* rescan,
+		uint16_t* blockMap, uint8_t* isEmpty, uint8_t* nonSequential, uint8_t* pageBuffer, SpareData* spareData)
+{
+	if(!SummaryEnabled || !ftl_read_summary(cxtPage, cxtUsnDec, summary, pageBuffer, spareData))
+		return FALSE;
+
+	int mapSize = Geometry->userSuBlksTotal * sizeof(uint16_t);
+	int mapPages = (mapSize + Geometry->bytesPerPage - 1) / Geometry->bytesPerPage;
+	int i;
+	for(i = 0; i < mapPages; i++)
+	{
+		if(VFL_Read(pstFTLCxt->pages_for_pawMapTable[i], pageBuffer, (uint8_t*) spareData, TRUE, NULL) != 0)
+			return FALSE;
+
+		int toRead = Geometry->bytesPerPage;
+		if(toRead > (mapSize - (i * Geometry->bytesPerPage)))
+			toRead = mapSize - (i * Geometry->bytesPerPage);
+
+		memcpy(((uint8_t*) pstFTLCxt->pawMapTable) + (i * Geometry->bytesPerPage), pageBuffer, toRead);
+	}
+
+	if(ftl_map_checksum(pstFTLCxt->pawMapTable) != summary->mapChecksum)
+		return FALSE;
+
+	memset(rescan, 1, ftl_num_vbs());
+	for(i = 0; i < Geometry->userSuBlksTotal; i++)
+	{
+		uint16_t block = pstFTLCxt->pawMapTable[i];
+		if(block >= ftl_num_vbs() || !rescan[block])
+			return FALSE;
+
+		rescan[block] = 0;
+		blockMap[block] = i;
+		isEmpty[block] = 0;
+		nonSequential[block] = 0;
+	}
+
+	// The journal runs from right after the FTLCxt page up to the first empty page.
+	uint32_t blockEnd = ((cxtPage / Geometry->pagesPerSuBlk) + 1) * Geometry->pagesPerSuBlk;
+	uint32_t page;
+	FTLRestoreStat.lastJournalEntries = 0;
+	for(page = cxtPage + 1; page < blockEnd; page++)
+	{
+		int ret = VFL_Read(page, pageBuffer, (uint8_t*) spareData, TRUE, NULL);
+		if(ret == ERROR_EMPTYBLOCK)
+			return TRUE;
+
+		if(ret != 0)
+			return FALSE;
+
+		if(spareData->type1 == 0x4F)
+			continue;
+
+		if(spareData->type1 != FTL_JOURNAL_TYPE)
+			return FALSE;
+
+		FTLJournalEntry* entry = (FTLJournalEntry*) pageBuffer;
+		if(entry->magic != FTL_JOURNAL_MAGIC || entry->block >= ftl_num_vbs())
+			return FALSE;
+
+		rescan[entry->block] = 1;
+		++FTLRestoreStat.lastJournalEntries;
+	}
+
+	// used up the whole block, so the journal may have been cut short
+	return FALSE;
+}
+
 // Assumptions: same conditions that FTL_Open would have been called in.
 static int FTL_Restore() {
 	uint16_t* blockMap = (uint16_t*) malloc((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t));
@@ -1016,6 +1416,11 @@ static int FTL_Restore() {
 
 	int i;
 	int block;
+	uint32_t cxtPage = 0;
+	uint32_t cxtUsnDec = 0;
+	uint64_t startTime = timer_get_system_microtime();
+
+	++FTLRestoreStat.restores;
 
 	bufferPrintf("ftl: restore searching for latest FTL context...\r\n");
 
@@ -1061,6 +1466,8 @@ static int FTL_Restore() {
 				continue;
 			} else if(ret == 0 && spareData->type1 == 0x43) { // 43 is FTLCxtBlock
 				minUsnDec = blockUSNDec;
+				cxtPage = Geometry->pagesPerSuBlk * ftlCtrlBlock + page;
+				cxtUsnDec = spareData->meta.usnDec;
 				memcpy(pstFTLCxt, pageBuffer, sizeof(FTLCxt));
 
 				// we just overwrote our good FTLCtrlBlock info, fill it in again.
@@ -1124,47 +1531,43 @@ static int FTL_Restore() {
 
 	// Step one, create an overview of which virtual blocks have pages belonging to which logical blocks.
 	// Mark any blocks discovered to be empty. Also to save time in the next step, if a block is proven
-	// to be non-sequential, mark it as such.
+	// to be non-sequential, mark it as such. If the last commit left a usable summary, only the blocks
+	// that may have changed since then have to be looked at.
+
+	FTLSummary summary;
+	uint8_t* rescan = (uint8_t*) malloc(Geometry->userSuBlksTotal + 23);
+	int fast = rescan != NULL && ftl_restore_from_summary(cxtPage, cxtUsnDec, &summary, rescan,
+			blockMap, isEmpty, nonSequential, pageBuffer, spareData);
+
+	if(fast)
+		bufferPrintf("ftl: restore using summary, %d journal entries\r\n", FTLRestoreStat.lastJournalEntries);
+
+	uint64_t scanStartTime = timer_get_system_microtime();
+	FTLRestoreStat.lastBlocksScanned = 0;
+	FTLRestoreStat.lastBlocksSkipped = 0;
 	
 	for(block = 0; block < (Geometry->userSuBlksTotal + 23); ++block)
 	{
+		if(fast && !rescan[block])
+		{
+			++FTLRestoreStat.lastBlocksSkipped;
+			continue;
+		}
+
 		if((block % 1000) == 0)
 		{
 			bufferPrintf("ftl: restore scanning virtual blocks %d - %d\r\n", block,
 					block + ((((Geometry->userSuBlksTotal + 23) - block) > 1000) ? 999 : ((Geometry->userSuBlksTotal + 23) - block - 1)));
 		}
 
-		blockMap[block] = 0xFFFF;
-		isEmpty[block] = 1;
-		nonSequential[block] = 0;
-
-		int page;
-		for(page = 0; page < Geometry->pagesPerSuBlk; ++page)
-		{
-			int ret = VFL_Read(block * Geometry->pagesPerSuBlk + page, pageBuffer, (uint8_t*) spareData, TRUE, NULL);
-
-			if(ret == ERROR_EMPTYBLOCK)
-				continue;
-			
-			isEmpty[block] = 0;
-			
-			if(ret != 0)
-				continue;
-			
-			if(spareData->type1 >= 0x43 && spareData->type1 <= 0x4F)
-				break;
-
-			// wtf is this? well, we'll just count it as empty
-			if(spareData->type1 != 0x40 && spareData->type1 != 0x41)
-				continue;
+		ftl_restore_scan_block(block, blockMap, isEmpty, nonSequential, pageBuffer, spareData);
+		++FTLRestoreStat.lastBlocksScanned;
+	}
 
-			if((spareData->user.logicalPageNumber % Geometry->pagesPerSuBlk) != page)
-				nonSequential[block] = 1;
+	FTLRestoreStat.lastScanUs = (uint32_t)(timer_get_system_microtime() - scanStartTime);
 
-			blockMap[block] = spareData->user.logicalPageNumber / Geometry->pagesPerSuBlk;
-			break;	
-		}
-	}
+	if(rescan)
+		free(rescan);
 
 	// Step two, make sure each logical block has a mapping to virtual block. If more than one virtual
 	// block contain pages to a logical block, pick which one is a mapping block and which one is a
@@ -1484,11 +1887,34 @@ static int FTL_Restore() {
 
 	pstFTLCxt->nextblockusn = highest_usn + 1;
 
+	// USNs only ever go up, so don't go below what was already handed out at the last commit
+	if(fast && summary.nextblockusn > pstFTLCxt->nextblockusn)
+		pstFTLCxt->nextblockusn = summary.nextblockusn;
+
 	for(i = 0; i < numLogs; ++i)
 	{
 		pLog[i].usn = pstFTLCxt->nextblockusn - 1;
 	}
 
+	if(fast)
+		++FTLRestoreStat.fastRestores;
+
+	// Nothing done from here on would be journaled against the commit we
+	// restored from, so a second power loss could make the next restore
+	// trust blocks that have since been erased. Commit the restored state
+	// right away; this also writes a fresh summary and starts a new journal.
+	// Without the summary the next restore scans everything, so restore
+	// leaves the flash alone as it always has.
+	if(SummaryEnabled && !ftl_commit_cxt())
+	{
+		bufferPrintf("ftl: restore could not commit the restored FTLCxt!\r\n");
+		goto error_release;
+	}
+
+	FTLRestoreStat.lastTotalUs = (uint32_t)(timer_get_system_microtime() - startTime);
+	bufferPrintf("ftl: restore took %u ms, scanned %u blocks and skipped %u\r\n", FTLRestoreStat.lastTotalUs / 1000,
+			FTLRestoreStat.lastBlocksScanned, FTLRestoreStat.lastBlocksSkipped);
+
 	bufferPrintf("ftl: restore successful!\r\n");
 	globalFtlHasBeenRestored = 1;
 	free(pageBuffer);
@@ -1738,12 +2164,16 @@ static int FTL_Open(int* pagesAvailable, int* bytesPerPage) {
 	// The last readable page in this block ought to be a FTLCxt block! If it's any other ftl control page
 	// then the shut down was unclean. FTLCxt ought never be the very first page.
 	int ftlCxtFound = FALSE;
+	uint32_t cxtPage = 0;
+	uint32_t cxtUsnDec = 0;
 	for(i = Geometry->pagesPerSuBlk - 1; i > 0; i--) {
 		ret = VFL_Read(Geometry->pagesPerSuBlk * ftlCtrlBlock + i, pageBuffer, spareBuffer, TRUE, &refreshPage);
 		if(ret == 1) {
 			continue;
 		} else if(ret == 0 && ((SpareData*)spareBuffer)->type1 == 0x43) { // 43 is FTLCxtBlock
 			memcpy(FTLCxtBuffer, pageBuffer, sizeof(FTLCxt));
+			cxtPage = Geometry->pagesPerSuBlk * ftlCtrlBlock + i;
+			cxtUsnDec = ((SpareData*)spareBuffer)->meta.usnDec;
 			ftlCxtFound = TRUE;
 			break;
 		} else {
@@ -1826,6 +2256,14 @@ static int FTL_Open(int* pagesAvailable, int* bytesPerPage) {
 
 	if(success) {
 		CleanFreeVb = TRUE;
+		ftl_snapshot_committed_tables();
+
+		// keep journaling for the commit we just opened if it was written with a summary
+		FTLSummary summary;
+		if(SummaryEnabled && ftl_read_summary(cxtPage, cxtUsnDec, &summary, pageBuffer, (SpareData*) spareBuffer)
+				&& summary.mapChecksum == ftl_map_checksum(pstFTLCxt->pawMapTable))
+			ftl_journal_start();
+
 		bufferPrintf("ftl: FTL successfully opened!\r\n");
 		free(pageBuffer);
 		free(spareBuffer);
@@ -1859,7 +2297,7 @@ uint32_t FTL_map_page(FTLCxtLog* pLog, int lbn, int offset) {
 	return (pstFTLCxt->pawMapTable[lbn] * Geometry->pagesPerSuBlk) + offset;
 }
 
-static inline FTLCxtLog* ftl_get_log(uint16_t lbn)
+static FTLCxtLog* ftl_get_log_scan(uint16_t lbn)
 {
 	int i;
 	for(i = 0; i < 17; i++) {
@@ -1873,6 +2311,38 @@ static inline FTLCxtLog* ftl_get_log(uint16_t lbn)
 	return NULL;
 }
 
+// Has to be called whenever the whole log table is replaced.
+static void ftl_rebuild_log_index()
+{
+	int i;
+	memset(LogSlotIndex, FTL_NO_LOG_SLOT, Geometry->userSuBlksTotal);
+	for(i = 0; i < 17; i++) {
+		if(pstFTLCxt->pLog[i].wVbn == 0xFFFF || pstFTLCxt->pLog[i].wLbn >= Geometry->userSuBlksTotal)
+			continue;
+
+		LogSlotIndex[pstFTLCxt->pLog[i].wLbn] = i;
+	}
+}
+
+static inline FTLCxtLog* ftl_get_log(uint16_t lbn)
+{
+	++LogLookups;
+
+	if(lbn >= Geometry->userSuBlksTotal)
+		return NULL;
+
+	uint8_t slot = LogSlotIndex[lbn];
+	if(slot == FTL_NO_LOG_SLOT)
+		return NULL;
+
+	FTLCxtLog* pLog = &pstFTLCxt->pLog[slot];
+	if(pLog->wVbn == 0xFFFF || pLog->wLbn != lbn)
+		return NULL;
+
+	++LogLookupHits;
+	return pLog;
+}
+
 int FTL_Read(int logicalPageNumber, int totalPagesToRead, uint8_t* pBuf) {
 	int i;
 	int hasError = FALSE;
@@ -1933,8 +2403,7 @@ int FTL_Read(int logicalPageNumber, int totalPagesToRead, uint8_t* pBuf) {
 				bufferPrintf("ftl: _AddLbnToRefreshList (0x%x, 0x%x, 0x%x)\r\n", lbn, pstFTLCxt->pawMapTable[lbn], pLog->wVbn);
 			}
 		} else {
-			// VFL_ReadMultiplePagesInVb has a different calling convention and implementation than the equivalent iBoot function.
-			// Ours is a bit less optimized, and just calls VFL_Read for each page.
+			// VFL_ReadMultiplePagesInVb has a different calling convention than the equivalent iBoot function.
 			pstFTLCxt->pawReadCounterTable[pstFTLCxt->pawMapTable[lbn]] += pagesToRead;
 			readSuccessful = VFL_ReadMultiplePagesInVb(pstFTLCxt->pawMapTable[lbn], offset, pagesToRead, pBuf + (pagesRead * Geometry->bytesPerPage), FTLSpareBuffer, &refreshPage);
 			if(refreshPage) {
@@ -2039,166 +2508,168 @@ FTL_Read_Error_Release:
 	return ret;
 }
 
-static int ftl_commit_cxt()
+// Copies of the tables as they were last written to the control block. A table
+// page that still matches its copy, and whose last written copy is still in the
+// current control block, does not have to be written again.
+static uint8_t* CommittedEraseCounterTable = NULL;
+static uint8_t* CommittedReadCounterTable = NULL;
+static uint8_t* CommittedMapTable = NULL;
+static uint8_t* CommittedPageOffsets = NULL;
+static int CommittedTablesValid = FALSE;
+static int DeltaCommitEnabled = TRUE;
+static uint32_t CommitTablePagesWritten = 0;
+static uint32_t CommitTablePagesSkipped = 0;
+static uint32_t CommitFull = 0;
+static uint32_t CommitDelta = 0;
+
+static int ftl_counter_table_size()
 {
+	return (Geometry->userSuBlksTotal + 23) * sizeof(uint16_t);
+}
 
-	// TODO: We should use the StoreCxt for this. Not only would we be able to more easily do
-	// multiplanar writes, but if any of this fails, we can back out without changes to our
-	// working context
-
-	int i;
+static int ftl_map_table_size()
+{
+	return Geometry->userSuBlksTotal * sizeof(uint16_t);
+}
 
-	uint8_t* pageBuffer = malloc(Geometry->bytesPerPage);
-	SpareData* spareData = (SpareData*) malloc(Geometry->bytesPerSpare);
-	if(!pageBuffer || !spareData) {
-		bufferPrintf("ftl: ftl_commit_cxt ran out of memory!\r\n");
-		return ERROR_ARG;
-	}
+static int ftl_page_offsets_size()
+{
+	return Geometry->pagesPerSuBlk * (17 * sizeof(uint16_t));
+}
 
-	// We need to precalculate how many pages we'd need to write to determine if we should start a new block.
+static int ftl_alloc_committed_tables()
+{
+	CommittedEraseCounterTable = (uint8_t*) malloc(ftl_counter_table_size());
+	CommittedReadCounterTable = (uint8_t*) malloc(ftl_counter_table_size());
+	CommittedMapTable = (uint8_t*) malloc(ftl_map_table_size());
+	CommittedPageOffsets = (uint8_t*) malloc(ftl_page_offsets_size());
+	CommittedTablesValid = FALSE;
 
-	int eraseCounterPages;
-	int readCounterPages;
-	int mapPages;
-	int offsetsPages;
+	if(!CommittedEraseCounterTable || !CommittedReadCounterTable || !CommittedMapTable || !CommittedPageOffsets)
+		return FALSE;
 
-	eraseCounterPages = ((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) / Geometry->bytesPerPage;
-	if((((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) % Geometry->bytesPerPage) != 0)
-		eraseCounterPages++;
-
-	readCounterPages = eraseCounterPages;
-	
-	mapPages = (Geometry->userSuBlksTotal * sizeof(uint16_t)) / Geometry->bytesPerPage;
-	if(((Geometry->userSuBlksTotal * sizeof(uint16_t)) % Geometry->bytesPerPage) != 0)
-		mapPages++;
-
-	offsetsPages = (Geometry->pagesPerSuBlk * (17 * sizeof(uint16_t))) / Geometry->bytesPerPage;
-	if(((Geometry->pagesPerSuBlk * (17 * sizeof(uint16_t))) % Geometry->bytesPerPage) != 0)
-		offsetsPages++;
+	return TRUE;
+}
 
-	int totalPages = eraseCounterPages + readCounterPages + mapPages + offsetsPages + 1 /* for the SID */ + 1 /* for FTLCxt */;
+// Called once the in-memory tables are known to match what pages_for_* point to.
+static void ftl_snapshot_committed_tables()
+{
+	memcpy(CommittedEraseCounterTable, pstFTLCxt->pawEraseCounterTable, ftl_counter_table_size());
+	memcpy(CommittedReadCounterTable, pstFTLCxt->pawReadCounterTable, ftl_counter_table_size());
+	memcpy(CommittedMapTable, pstFTLCxt->pawMapTable, ftl_map_table_size());
+	memcpy(CommittedPageOffsets, pstFTLCxt->wPageOffsets, ftl_page_offsets_size());
+	CommittedTablesValid = TRUE;
+}
 
+static int ftl_commit_table(uint8_t* table, uint8_t* committed, int size, uint32_t* pages, uint8_t type, int full, uint8_t* pageBuffer, SpareData* spareData)
+{
+	int numPages = (size + Geometry->bytesPerPage - 1) / Geometry->bytesPerPage;
 	uint16_t curBlock = pstFTLCxt->FTLCtrlPage / Geometry->pagesPerSuBlk;
-	if((pstFTLCxt->FTLCtrlPage + totalPages) >= ((curBlock * Geometry->pagesPerSuBlk) + Geometry->pagesPerSuBlk))
-	{
-		// looks like we would be overflowing into the next block, force the next ctrl page to be on a fresh
-		// block in that case
-		pstFTLCxt->FTLCtrlPage = (curBlock * Geometry->pagesPerSuBlk) + Geometry->pagesPerSuBlk - 1;
-	}
-
-	int pagesToWrite;
-
-	pagesToWrite = eraseCounterPages;
-
-	for(i = 0; i < pagesToWrite; i++) {
-		if(!ftl_next_ctrl_page())
-		{
-			bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
-			goto ftl_commit_cxt_error_release;
-		}
-
-		pstFTLCxt->pages_for_pawEraseCounterTable[i] = pstFTLCxt->FTLCtrlPage;
 
+	int i;
+	for(i = 0; i < numPages; i++) {
 		int toWrite = Geometry->bytesPerPage;
-		if(toWrite > (((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) - (i * Geometry->bytesPerPage))) {
-			toWrite = ((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) - (i * Geometry->bytesPerPage);
+		if(toWrite > (size - (i * Geometry->bytesPerPage))) {
+			toWrite = size - (i * Geometry->bytesPerPage);
 		}
 
-		memcpy(pageBuffer, ((uint8_t*)pstFTLCxt->pawEraseCounterTable) + (i * Geometry->bytesPerPage), toWrite);
-		memset(pageBuffer + toWrite, 0, Geometry->bytesPerPage - toWrite);
-
-		memset(spareData, 0xFF, sizeof(SpareData));
-		spareData->meta.usnDec = pstFTLCxt->usnDec;
-		spareData->type1 = 0x46;
-		spareData->meta.idx = i;
-
-		if(VFL_Write(pstFTLCxt->pages_for_pawEraseCounterTable[i], pageBuffer, (uint8_t*) spareData) != 0)
-			goto ftl_commit_cxt_error_release;
-	}
+		uint8_t* data = table + (i * Geometry->bytesPerPage);
+		uint8_t* old = committed + (i * Geometry->bytesPerPage);
 
-	pagesToWrite = readCounterPages;
+		if(!full && (pages[i] / Geometry->pagesPerSuBlk) == curBlock && memcmp(data, old, toWrite) == 0) {
+			++CommitTablePagesSkipped;
+			continue;
+		}
 
-	for(i = 0; i < pagesToWrite; i++) {
 		if(!ftl_next_ctrl_page())
 		{
 			bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
-			goto ftl_commit_cxt_error_release;
+			return FALSE;
 		}
 
-		pstFTLCxt->pages_for_pawReadCounterTable[i] = pstFTLCxt->FTLCtrlPage;
-
-		int toWrite = Geometry->bytesPerPage;
-		if(toWrite > (((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) - (i * Geometry->bytesPerPage))) {
-			toWrite = ((Geometry->userSuBlksTotal + 23) * sizeof(uint16_t)) - (i * Geometry->bytesPerPage);
-		}
+		pages[i] = pstFTLCxt->FTLCtrlPage;
 
-		memcpy(pageBuffer, ((uint8_t*)pstFTLCxt->pawReadCounterTable) + (i * Geometry->bytesPerPage), toWrite);
+		memcpy(pageBuffer, data, toWrite);
 		memset(pageBuffer + toWrite, 0, Geometry->bytesPerPage - toWrite);
 
 		memset(spareData, 0xFF, sizeof(SpareData));
 		spareData->meta.usnDec = pstFTLCxt->usnDec;
-		spareData->type1 = 0x49;
+		spareData->type1 = type;
 		spareData->meta.idx = i;
 
-		if(VFL_Write(pstFTLCxt->pages_for_pawReadCounterTable[i], pageBuffer, (uint8_t*) spareData) != 0)
-			goto ftl_commit_cxt_error_release;
+		if(VFL_Write(pages[i], pageBuffer, (uint8_t*) spareData) != 0)
+			return FALSE;
+
+		memcpy(old, data, toWrite);
+		++CommitTablePagesWritten;
 	}
 
-	pagesToWrite = mapPages;
+	return TRUE;
+}
 
-	for(i = 0; i < pagesToWrite; i++) {
-		if(!ftl_next_ctrl_page())
-		{
-			bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
-			goto ftl_commit_cxt_error_release;
-		}
+static int ftl_commit_cxt()
+{
 
-		pstFTLCxt->pages_for_pawMapTable[i] = pstFTLCxt->FTLCtrlPage;
+	// TODO: We should use the StoreCxt for this. Not only would we be able to more easily do
+	// multiplanar writes, but if any of this fails, we can back out without changes to our
+	// working context
 
-		int toWrite = Geometry->bytesPerPage;
-		if(toWrite > ((Geometry->userSuBlksTotal * sizeof(uint16_t)) - (i * Geometry->bytesPerPage))) {
-			toWrite = (Geometry->userSuBlksTotal * sizeof(uint16_t)) - (i * Geometry->bytesPerPage);
-		}
+	uint8_t* pageBuffer = malloc(Geometry->bytesPerPage);
+	SpareData* spareData = (SpareData*) malloc(Geometry->bytesPerSpare);
+	if(!pageBuffer || !spareData) {
+		bufferPrintf("ftl: ftl_commit_cxt ran out of memory!\r\n");
+		return ERROR_ARG;
+	}
 
-		memcpy(pageBuffer, ((uint8_t*)pstFTLCxt->pawMapTable) + (i * Geometry->bytesPerPage), toWrite);
-		memset(pageBuffer + toWrite, 0, Geometry->bytesPerPage - toWrite);
+	// We need to precalculate how many pages we'd need to write to determine if we should start a new block.
+	// This assumes every table page has to be written, so a delta commit never has to span two blocks.
 
-		memset(spareData, 0xFF, sizeof(SpareData));
-		spareData->meta.usnDec = pstFTLCxt->usnDec;
-		spareData->type1 = 0x44;
-		spareData->meta.idx = i;
+	int eraseCounterPages;
+	int readCounterPages;
+	int mapPages;
+	int offsetsPages;
 
-		if(VFL_Write(pstFTLCxt->pages_for_pawMapTable[i], pageBuffer, (uint8_t*) spareData) != 0)
-			goto ftl_commit_cxt_error_release;
-	}
+	eraseCounterPages = (ftl_counter_table_size() + Geometry->bytesPerPage - 1) / Geometry->bytesPerPage;
+	readCounterPages = eraseCounterPages;
+	mapPages = (ftl_map_table_size() + Geometry->bytesPerPage - 1) / Geometry->bytesPerPage;
+	offsetsPages = (ftl_page_offsets_size() + Geometry->bytesPerPage - 1) / Geometry->bytesPerPage;
 
-	pagesToWrite = offsetsPages;
+	int totalPages = eraseCounterPages + readCounterPages + mapPages + offsetsPages + 1 /* for the SID */ + 1 /* for the summary */ + 1 /* for FTLCxt */;
 
-	for(i = 0; i < pagesToWrite; i++) {
-		if(!ftl_next_ctrl_page())
-		{
-			bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
-			goto ftl_commit_cxt_error_release;
-		}
+	uint16_t curBlock = pstFTLCxt->FTLCtrlPage / Geometry->pagesPerSuBlk;
+	if((pstFTLCxt->FTLCtrlPage + totalPages) >= ((curBlock * Geometry->pagesPerSuBlk) + Geometry->pagesPerSuBlk))
+	{
+		// looks like we would be overflowing into the next block, force the next ctrl page to be on a fresh
+		// block in that case
+		pstFTLCxt->FTLCtrlPage = (curBlock * Geometry->pagesPerSuBlk) + Geometry->pagesPerSuBlk - 1;
+	}
 
-		pstFTLCxt->pages_for_wPageOffsets[i] = pstFTLCxt->FTLCtrlPage;
+	// Moving to a fresh block compacts the context: everything is written out again, so none of the
+	// pages we refer to are left behind in a block that is going to be erased.
+	int full = !DeltaCommitEnabled || !CommittedTablesValid || ((pstFTLCxt->FTLCtrlPage + 1) % Geometry->pagesPerSuBlk) == 0;
+	if(full)
+		++CommitFull;
+	else
+		++CommitDelta;
 
-		int toWrite = Geometry->bytesPerPage;
-		if(toWrite > ((Geometry->pagesPerSuBlk * (17 * sizeof(uint16_t))) - (i * Geometry->bytesPerPage))) {
-			toWrite = (Geometry->pagesPerSuBlk * (17 * sizeof(uint16_t))) - (i * Geometry->bytesPerPage);
-		}
+	// a failure leaves pages_for_* pointing at pages that may not have been written
+	CommittedTablesValid = FALSE;
 
-		memcpy(pageBuffer, ((uint8_t*)pstFTLCxt->wPageOffsets) + (i * Geometry->bytesPerPage), toWrite);
-		memset(pageBuffer + toWrite, 0, Geometry->bytesPerPage - toWrite);
+	if(!ftl_commit_table((uint8_t*) pstFTLCxt->pawEraseCounterTable, CommittedEraseCounterTable, ftl_counter_table_size(),
+				pstFTLCxt->pages_for_pawEraseCounterTable, 0x46, full, pageBuffer, spareData))
+		goto ftl_commit_cxt_error_release;
 
-		memset(spareData, 0xFF, sizeof(SpareData));
-		spareData->meta.usnDec = pstFTLCxt->usnDec;
-		spareData->type1 = 0x45;
-		spareData->meta.idx = i;
+	if(!ftl_commit_table((uint8_t*) pstFTLCxt->pawReadCounterTable, CommittedReadCounterTable, ftl_counter_table_size(),
+				pstFTLCxt->pages_for_pawReadCounterTable, 0x49, full, pageBuffer, spareData))
+		goto ftl_commit_cxt_error_release;
 
-		if(VFL_Write(pstFTLCxt->pages_for_wPageOffsets[i], pageBuffer, (uint8_t*) spareData) != 0)
-			goto ftl_commit_cxt_error_release;
-	}
+	if(!ftl_commit_table((uint8_t*) pstFTLCxt->pawMapTable, CommittedMapTable, ftl_map_table_size(),
+				pstFTLCxt->pages_for_pawMapTable, 0x44, full, pageBuffer, spareData))
+		goto ftl_commit_cxt_error_release;
+
+	if(!ftl_commit_table((uint8_t*) pstFTLCxt->wPageOffsets, CommittedPageOffsets, ftl_page_offsets_size(),
+				pstFTLCxt->pages_for_wPageOffsets, 0x45, full, pageBuffer, spareData))
+		goto ftl_commit_cxt_error_release;
 
 	{
 		if(!ftl_next_ctrl_page())
@@ -2234,6 +2705,12 @@ static int ftl_commit_cxt()
 			goto ftl_commit_cxt_error_release;
 	}
 
+	// the journal of the previous commit ends here
+	JournalActive = FALSE;
+
+	if(SummaryEnabled && !ftl_write_summary(pageBuffer, spareData))
+		goto ftl_commit_cxt_error_release;
+
 	if(!ftl_next_ctrl_page())
 	{
 		bufferPrintf("ftl: cannot allocate next FTL ctrl page\r\n");
@@ -2248,6 +2725,11 @@ static int ftl_commit_cxt()
 	if(VFL_Write(pstFTLCxt->FTLCtrlPage, (uint8_t*) pstFTLCxt, (uint8_t*) spareData) != 0)
 		goto ftl_commit_cxt_error_release;
 
+	CommittedTablesValid = TRUE;
+
+	if(SummaryEnabled)
+		ftl_journal_start();
+
 	free(pageBuffer);
 	free(spareData);
 
@@ -2333,6 +2815,7 @@ static FTLCxtLog* ftl_prepare_log(uint16_t lbn)
 				return NULL;
 			} else if(pstFTLCxt->wNumOfFreeVb == 3)
 			{
+				++FTLMergeStat.inlineMerges;
 				if(!ftl_merge(NULL))
 				{
 					bufferPrintf("ftl: block merged failed!\r\n");
@@ -2357,6 +2840,7 @@ static FTLCxtLog* ftl_prepare_log(uint16_t lbn)
 
 		memset(pLog->wPageOffsets, 0xFF, Geometry->pagesPerSuBlk * sizeof(uint16_t));
 		pLog->wLbn = lbn;
+		LogSlotIndex[lbn] = pLog - pstFTLCxt->pLog;
 		pLog->pagesUsed = 0;
 		pLog->pagesCurrent = 0;
 		pLog->isSequential = 1;
@@ -2364,8 +2848,10 @@ static FTLCxtLog* ftl_prepare_log(uint16_t lbn)
 
 	pLog->usn = pstFTLCxt->nextblockusn - 1;
 
-	if(pstFTLCxt->nextblockusn == 1)
+	if(pstFTLCxt->nextblockusn == 1) {
 		memset(pstFTLCxt->pLog, 0, sizeof(FTLCxtLog) * 17);
+		ftl_rebuild_log_index();
+	}
 
 	return pLog;
 }
@@ -2451,7 +2937,7 @@ static int ftl_copy_block(uint16_t lSrc, uint16_t vDest)
 		++pstFTLCxt->pawEraseCounterTable[vDest];
 		pstFTLCxt->pawReadCounterTable[vDest] = 0;
 
-		if(VFL_Erase(vDest) != 0)
+		if(!ftl_journal_erase(vDest) || VFL_Erase(vDest) != 0)
 		{
 			bufferPrintf("ftl: ftl_copy_block failed to erase after failure!\r\n");
 			goto error_release;
@@ -2668,6 +3154,32 @@ static int ftl_copy_merge(FTLCxtLog* pLog)
 	return TRUE;
 }
 
+static int ftl_lbn_is_hot(uint16_t lbn)
+{
+	return HotColdEnabled && lbn < Geometry->userSuBlksTotal && LbnHeat[lbn] >= FTL_HEAT_HOT;
+}
+
+static void ftl_heat_update(uint16_t lbn)
+{
+	if(lbn < Geometry->userSuBlksTotal && LbnHeat[lbn] < FTL_HEAT_MAX)
+		++LbnHeat[lbn];
+}
+
+// Called once per write with the number of pages written, however many
+// blocks they span.
+static void ftl_heat_decay(int pages)
+{
+	PagesSinceDecay += pages;
+	if(PagesSinceDecay < FTL_HEAT_DECAY_PAGES)
+		return;
+
+	PagesSinceDecay = 0;
+
+	int i;
+	for(i = 0; i < Geometry->userSuBlksTotal; i++)
+		LbnHeat[i] >>= 1;
+}
+
 static int ftl_merge(FTLCxtLog* pLog)
 {
 	if(!ftl_mark_unclean())
@@ -2682,7 +3194,8 @@ static int ftl_merge(FTLCxtLog* pLog)
 	{
 		int i;
 
-		// find one to swap out
+		// find one to swap out, preferring the oldest cold one
+		int pickedHot = TRUE;
 		for(i = 0; i < 17; ++i)
 		{
 			if(pstFTLCxt->pLog[i].wVbn == 0xFFFF)
@@ -2694,16 +3207,26 @@ static int ftl_merge(FTLCxtLog* pLog)
 				return FALSE;
 			}
 
-			if(pstFTLCxt->pLog[i].usn < oldest || (pstFTLCxt->pLog[i].usn == oldest && pstFTLCxt->pLog[i].pagesCurrent > mostCurrent))
+			int hot = ftl_lbn_is_hot(pstFTLCxt->pLog[i].wLbn);
+			if(hot && !pickedHot)
+				continue;
+
+			if((!hot && pickedHot) || pstFTLCxt->pLog[i].usn < oldest || (pstFTLCxt->pLog[i].usn == oldest && pstFTLCxt->pLog[i].pagesCurrent > mostCurrent))
 			{
 				pLog = &pstFTLCxt->pLog[i];
 				oldest = pstFTLCxt->pLog[i].usn;
 				mostCurrent = pstFTLCxt->pLog[i].pagesCurrent;
+				pickedHot = hot;
 			}
 		}
 
 		if(pLog == NULL)
 			return FALSE;
+
+		if(pickedHot)
+			++FTLWriteStat.hotMergeVictims;
+		else
+			++FTLWriteStat.coldMergeVictims;
 	} else if(pLog->pagesCurrent < (Geometry->pagesPerSuBlk / 2))
 	{
 		// less than half the pages in this log seems to be current, let's get rid of the crap and just reuse this one.
@@ -2734,15 +3257,67 @@ static int ftl_merge(FTLCxtLog* pLog)
 	}
 }
 
+// Wear-leveling policies. Each one looks at the erase counters and decides
+// whether the least erased data block (static data that is rarely rewritten)
+// should be moved into the most erased free block, so the little-worn block
+// it occupied goes back into circulation. Free blocks are always handed out
+// least erased first by ftl_get_free_vb, whatever the policy.
+typedef struct FTLWearInfo {
+	uint16_t minDataEC;		// least erased data block without a log
+	uint16_t maxEC;			// most erased block, data or free
+	uint16_t maxFreeEC;		// most erased free block
+	uint32_t meanEC;		// average over all data blocks
+} FTLWearInfo;
+
+typedef struct FTLWearPolicy {
+	const char* name;
+	const char* description;
+	int (*shouldSwap)(const FTLWearInfo* info);
+} FTLWearPolicy;
+
+typedef struct FTLWearStats {
+	uint32_t runs;
+	uint32_t swaps;
+	uint32_t skipped;
+} FTLWearStats;
+
+static int WearThreshold = 5;
+static FTLWearStats FTLWearStat;
+
+static int ftl_wear_static(const FTLWearInfo* info)
+{
+	return info->maxEC != 0 && (info->maxEC - info->minDataEC) >= WearThreshold;
+}
+
+static int ftl_wear_mean(const FTLWearInfo* info)
+{
+	return info->minDataEC + WearThreshold <= info->meanEC && info->maxFreeEC > info->minDataEC;
+}
+
+static int ftl_wear_dynamic(const FTLWearInfo* info)
+{
+	return FALSE;
+}
+
+static const FTLWearPolicy FTLWearPolicies[] = {
+	{"static", "move static data once max - min erase count reaches the threshold", ftl_wear_static},
+	{"mean", "move static data once it is threshold erases below the mean", ftl_wear_mean},
+	{"dynamic", "never move static data, only allocate the least erased free block", ftl_wear_dynamic},
+};
+
+#define FTL_NUM_WEAR_POLICIES (sizeof(FTLWearPolicies) / sizeof(FTLWearPolicy))
+
+static const FTLWearPolicy* WearPolicy = &FTLWearPolicies[0];
+
 int ftl_auto_wearlevel()
 {
 	int i;
-	uint16_t smallestEraseCount = 0xFFFF;
 	uint16_t leastErasedBlock = 0;
 	uint16_t leastErasedBlockLbn = 0;
-	uint16_t largestEraseCount = 0;
 	uint16_t mostErasedFreeBlock = 0;
 	uint16_t mostErasedFreeBlockIdx = 20;
+	uint32_t totalEC = 0;
+	FTLWearInfo info;
 
 	if(!ftl_mark_unclean())
 	{
@@ -2750,6 +3325,12 @@ int ftl_auto_wearlevel()
 		return FALSE;
 	}
 
+	++FTLWearStat.runs;
+
+	info.minDataEC = 0xFFFF;
+	info.maxEC = 0;
+	info.maxFreeEC = 0;
+
 	for(i = 0; i < pstFTLCxt->wNumOfFreeVb; ++i)
 	{
 		int idx = (pstFTLCxt->nextFreeIdx + i) % 20;
@@ -2757,47 +3338,55 @@ int ftl_auto_wearlevel()
 		if(pstFTLCxt->awFreeVb[idx] == 0xFFFF)
 			continue;
 
-		if((mostErasedFreeBlockIdx == 20) || pstFTLCxt->pawEraseCounterTable[pstFTLCxt->awFreeVb[idx]] > largestEraseCount)
+		if((mostErasedFreeBlockIdx == 20) || pstFTLCxt->pawEraseCounterTable[pstFTLCxt->awFreeVb[idx]] > info.maxFreeEC)
 		{
 			mostErasedFreeBlockIdx = idx;
 			mostErasedFreeBlock = pstFTLCxt->awFreeVb[idx];
-			largestEraseCount = pstFTLCxt->pawEraseCounterTable[mostErasedFreeBlock];
+			info.maxFreeEC = pstFTLCxt->pawEraseCounterTable[mostErasedFreeBlock];
 		}
 	}
 
+	info.maxEC = info.maxFreeEC;
+
 	for(i = 0; i < Geometry->userSuBlksTotal; ++i)
 	{
-		if(pstFTLCxt->pawEraseCounterTable[pstFTLCxt->pawMapTable[i]] > largestEraseCount)
-			largestEraseCount = pstFTLCxt->pawEraseCounterTable[pstFTLCxt->pawMapTable[i]];
+		uint16_t ec = pstFTLCxt->pawEraseCounterTable[pstFTLCxt->pawMapTable[i]];
+		totalEC += ec;
+
+		if(ec > info.maxEC)
+			info.maxEC = ec;
 
 		// don't swap stuff with log blocks attached
 		if(ftl_get_log(i) != NULL)
 			continue;
 
-		if(pstFTLCxt->pawEraseCounterTable[pstFTLCxt->pawMapTable[i]] < smallestEraseCount)
+		if(ec < info.minDataEC)
 		{
 			leastErasedBlockLbn = i;
 			leastErasedBlock = pstFTLCxt->pawMapTable[i];
-			smallestEraseCount = pstFTLCxt->pawEraseCounterTable[leastErasedBlock];
+			info.minDataEC = ec;
 		}
 	}
 
-	if(largestEraseCount == 0)
-		return TRUE;
+	info.meanEC = totalEC / Geometry->userSuBlksTotal;
 
-	if((largestEraseCount - smallestEraseCount) < 5)
+	if(mostErasedFreeBlockIdx == 20 || info.minDataEC == 0xFFFF || !WearPolicy->shouldSwap(&info))
+	{
+		++FTLWearStat.skipped;
 		return TRUE;
+	}
 
 	++pstFTLCxt->pawEraseCounterTable[mostErasedFreeBlock];
 	pstFTLCxt->pawReadCounterTable[mostErasedFreeBlock] = 0;
 
-	if(VFL_Erase(mostErasedFreeBlock) != 0)
+	if(!ftl_journal_erase(mostErasedFreeBlock) || VFL_Erase(mostErasedFreeBlock) != 0)
 	{
 		bufferPrintf("ftl: auto wear-level cannot erase most erased free block\r\n");
 		return FALSE;
 	}
 
 	++FTLCountsTable.blockSwapCount;
+	++FTLWearStat.swaps;
 
 	if(!ftl_copy_block(leastErasedBlockLbn, mostErasedFreeBlock))
 	{
@@ -2810,7 +3399,7 @@ int ftl_auto_wearlevel()
 	++pstFTLCxt->pawEraseCounterTable[leastErasedBlock];
 	pstFTLCxt->pawReadCounterTable[leastErasedBlock] = 0;
 
-	if(VFL_Erase(leastErasedBlock) != 0)
+	if(!ftl_journal_erase(leastErasedBlock) || VFL_Erase(leastErasedBlock) != 0)
 	{
 		bufferPrintf("ftl: auto wear-level cannot erase previously least erased block\r\n");
 		return FALSE;
@@ -2821,7 +3410,7 @@ int ftl_auto_wearlevel()
 	return TRUE;
 }
 
-int FTL_Write(int logicalPageNumber, int totalPagesToWrite, uint8_t* pBuf) 
+static int ftl_write_pages(int logicalPageNumber, int totalPagesToWrite, uint8_t* pBuf)
 {
 	int i;
 
@@ -2850,6 +3439,12 @@ int FTL_Write(int logicalPageNumber, int totalPagesToWrite, uint8_t* pBuf)
 		return ERROR_ARG;
 	}
 
+	FTLWriteStat.hostPages += totalPagesToWrite;
+	for(i = logicalPageNumber / Geometry->pagesPerSuBlk; i <= (logicalPageNumber + totalPagesToWrite - 1) / Geometry->pagesPerSuBlk; i++)
+		ftl_heat_update(i);
+
+	ftl_heat_decay(totalPagesToWrite);
+
 	for(i = 0; i < totalPagesToWrite; )
 	{
 		int lbn = (logicalPageNumber + i) / Geometry->pagesPerSuBlk;
@@ -2935,6 +3530,7 @@ int FTL_Write(int logicalPageNumber, int totalPagesToWrite, uint8_t* pBuf)
 			if(pLog->pagesUsed == Geometry->pagesPerSuBlk)
 			{
 				// oh no, this log is full. we have to commit it
+				++FTLMergeStat.inlineMerges;
 				if(!ftl_merge(pLog))
 				{
 					bufferPrintf("ftl: write failed to merge in the log!\r\n");
@@ -3029,10 +3625,201 @@ error_release:
 	return ERROR_ARG;
 }
 
+// Write-back cache of logical pages for ftl_read/ftl_write. Partial page
+// accesses, which are what filesystem metadata updates mostly are, are served
+// from here instead of doing an FTL_Read/FTL_Write pair each time. Dirty pages
+// are written back in runs of consecutive pages with one FTL_Write per run.
+#define FTL_CACHE_PAGES 16
+
+typedef struct FTLCachePage {
+	int page;
+	int dirty;
+	uint32_t lastUsed;
+	uint8_t* buffer;
+} FTLCachePage;
+
+typedef struct FTLCacheStats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t flushes;
+	uint32_t flushedPages;
+	uint32_t flushWrites;
+} FTLCacheStats;
+
+static FTLCachePage FTLCache[FTL_CACHE_PAGES];
+static uint8_t* FTLCacheFlushBuffer = NULL;
+static uint32_t FTLCacheTick = 0;
+static FTLCacheStats FTLCacheStat;
+
+static int ftl_cache_init() {
+	if(FTLCacheFlushBuffer != NULL)
+		return TRUE;
+
+	FTLCacheFlushBuffer = (uint8_t*) malloc(FTL_CACHE_PAGES * Geometry->bytesPerPage);
+	if(FTLCacheFlushBuffer == NULL)
+		return FALSE;
+
+	int i;
+	for(i = 0; i < FTL_CACHE_PAGES; i++) {
+		FTLCache[i].page = -1;
+		FTLCache[i].dirty = FALSE;
+		FTLCache[i].lastUsed = 0;
+		FTLCache[i].buffer = (uint8_t*) malloc(Geometry->bytesPerPage);
+		if(FTLCache[i].buffer == NULL) {
+			while(i > 0) {
+				i--;
+				free(FTLCache[i].buffer);
+			}
+			free(FTLCacheFlushBuffer);
+			FTLCacheFlushBuffer = NULL;
+			return FALSE;
+		}
+	}
+
+	memset(&FTLCacheStat, 0, sizeof(FTLCacheStat));
+	return TRUE;
+}
+
+static FTLCachePage* ftl_cache_find(int page) {
+	if(FTLCacheFlushBuffer == NULL)
+		return NULL;
+
+	int i;
+	for(i = 0; i < FTL_CACHE_PAGES; i++) {
+		if(FTLCache[i].page == page)
+			return &FTLCache[i];
+	}
+
+	return NULL;
+}
+
+static int ftl_cache_flush() {
+	if(FTLCacheFlushBuffer == NULL)
+		return TRUE;
+
+	int ret = TRUE;
+	int flushed = FALSE;
+	int next = 0;
+	while(TRUE) {
+		// pick the lowest dirty page not yet tried, then extend the run with its successors
+		FTLCachePage* first = NULL;
+		int i;
+		for(i = 0; i < FTL_CACHE_PAGES; i++) {
+			if(FTLCache[i].dirty && FTLCache[i].page >= next && (first == NULL || FTLCache[i].page < first->page))
+				first = &FTLCache[i];
+		}
+
+		if(first == NULL)
+			break;
+
+		FTLCachePage* run[FTL_CACHE_PAGES];
+		int count = 0;
+		FTLCachePage* entry = first;
+		while(entry != NULL && entry->dirty && count < FTL_CACHE_PAGES) {
+			memcpy(FTLCacheFlushBuffer + (count * Geometry->bytesPerPage), entry->buffer, Geometry->bytesPerPage);
+			run[count++] = entry;
+			entry = ftl_cache_find(first->page + count);
+		}
+
+		next = first->page + count;
+
+		if(FTL_Write(first->page, count, FTLCacheFlushBuffer) != 0) {
+			// keep the pages dirty so that a later flush can retry them
+			bufferPrintf("ftl: cache flush of pages %d - %d failed\r\n", first->page, first->page + count - 1);
+			ret = FALSE;
+			continue;
+		}
+
+		for(i = 0; i < count; i++)
+			run[i]->dirty = FALSE;
+
+		FTLCacheStat.flushedPages += count;
+		FTLCacheStat.flushWrites++;
+		flushed = TRUE;
+	}
+
+	if(flushed)
+		FTLCacheStat.flushes++;
+
+	return ret;
+}
+
+// Returns the cache entry holding page, reading it in if fill is set.
+static FTLCachePage* ftl_cache_get(int page, int fill) {
+	FTLCachePage* entry = ftl_cache_find(page);
+	if(entry != NULL) {
+		FTLCacheStat.hits++;
+		entry->lastUsed = ++FTLCacheTick;
+		return entry;
+	}
+
+	FTLCacheStat.misses++;
+
+	int i;
+	for(i = 0; i < FTL_CACHE_PAGES; i++) {
+		if(entry == NULL || FTLCache[i].page == -1 || FTLCache[i].lastUsed < entry->lastUsed) {
+			entry = &FTLCache[i];
+			if(entry->page == -1)
+				break;
+		}
+	}
+
+	if(entry->page != -1) {
+		FTLCacheStat.evictions++;
+
+		// write back everything at once rather than one page per eviction
+		if(entry->dirty) {
+			ftl_cache_flush();
+			if(entry->dirty)
+				return NULL;
+		}
+	}
+
+	entry->page = -1;
+	entry->dirty = FALSE;
+
+	if(fill && FTL_Read(page, 1, entry->buffer) != 0)
+		return NULL;
+
+	entry->page = page;
+	entry->lastUsed = ++FTLCacheTick;
+	return entry;
+}
+
+// Drops cached copies of pages that are about to be overwritten directly.
+static void ftl_cache_discard(int page, int count) {
+	if(FTLCacheFlushBuffer == NULL)
+		return;
+
+	int i;
+	for(i = 0; i < FTL_CACHE_PAGES; i++) {
+		if(FTLCache[i].page >= page && FTLCache[i].page < (page + count)) {
+			FTLCache[i].page = -1;
+			FTLCache[i].dirty = FALSE;
+		}
+	}
+}
+
+// Copies dirty cached pages over data just read directly from the FTL.
+static void ftl_cache_overlay(uint8_t* buffer, int page, int count) {
+	if(FTLCacheFlushBuffer == NULL)
+		return;
+
+	int i;
+	for(i = 0; i < FTL_CACHE_PAGES; i++) {
+		if(FTLCache[i].dirty && FTLCache[i].page >= page && FTLCache[i].page < (page + count))
+			memcpy(buffer + ((FTLCache[i].page - page) * Geometry->bytesPerPage), FTLCache[i].buffer, Geometry->bytesPerPage);
+	}
+}
+
 int ftl_sync()
 {
 	int tries;
 
+	if(!ftl_cache_flush())
+		return FALSE;
+
 	if(pstFTLCxt->clean)
 		return TRUE;
 
@@ -3066,6 +3853,91 @@ int ftl_sync()
 	return FALSE;
 }
 
+// The write path merges a log block inline when it fills up or when it runs
+// out of free virtual blocks, which can stall a single FTL_Write for hundreds
+// of milliseconds. This task does that work ahead of time once writes have
+// gone quiet. Tasks are cooperative and the FTL never yields, so it can never
+// run in the middle of an FTL operation.
+#define FTL_BG_INTERVAL_MS	50
+#define FTL_BG_IDLE_US		(200 * 1000)
+#define FTL_BG_MIN_FREE_VB	6
+
+static TaskDescriptor ftl_bg_task;
+static int FTLBackgroundEnabled = TRUE;
+static uint64_t LastWriteTime = 0;
+
+int FTL_Write(int logicalPageNumber, int totalPagesToWrite, uint8_t* pBuf)
+{
+	uint64_t startTime = timer_get_system_microtime();
+	int ret = ftl_write_pages(logicalPageNumber, totalPagesToWrite, pBuf);
+	LastWriteTime = timer_get_system_microtime();
+
+	uint32_t elapsed = (uint32_t)(LastWriteTime - startTime);
+	int bucket = 0;
+	uint32_t limit = 1000;
+	while(bucket < 4 && elapsed >= limit) {
+		bucket++;
+		limit *= 10;
+	}
+
+	++FTLMergeStat.writes;
+	++FTLMergeStat.writeLatency[bucket];
+	if(elapsed > FTLMergeStat.maxWriteUs)
+		FTLMergeStat.maxWriteUs = elapsed;
+
+	return ret;
+}
+
+// Does one merge the write path would otherwise have had to do inline: a full
+// log first, then the oldest log (the same one ftl_merge(NULL) would pick in
+// ftl_prepare_log) if the free block pool is running low. Returns 1 after a
+// merge, 0 if there was nothing to do and -1 if the merge failed.
+//
+// A synced context is left alone even if it has a full log: merging would
+// leave the FTL unclean with nothing to commit it again, and the next boot
+// would have to do a full restore.
+static int ftl_bg_merge_one()
+{
+	if(pstFTLCxt->clean)
+		return 0;
+
+	int emptyLogs = 0;
+	int i;
+	for(i = 0; i < 17; ++i)
+	{
+		FTLCxtLog* pLog = &pstFTLCxt->pLog[i];
+		if(pLog->wVbn == 0xFFFF)
+			continue;
+
+		if(pLog->pagesUsed == 0)
+			++emptyLogs;
+		else if(pLog->pagesUsed == Geometry->pagesPerSuBlk)
+			return ftl_merge(pLog) ? 1 : -1;
+	}
+
+	if(emptyLogs == 0 && pstFTLCxt->wNumOfFreeVb < FTL_BG_MIN_FREE_VB)
+		return ftl_merge(NULL) ? 1 : -1;
+
+	return 0;
+}
+
+static void ftl_bg_run(uint32_t _arg)
+{
+	while(TRUE)
+	{
+		task_sleep(FTL_BG_INTERVAL_MS);
+
+		if(!FTLBackgroundEnabled || !has_elapsed(LastWriteTime, FTL_BG_IDLE_US))
+			continue;
+
+		int ret = ftl_bg_merge_one();
+		if(ret > 0)
+			++FTLMergeStat.backgroundMerges;
+		else if(ret < 0)
+			++FTLMergeStat.backgroundFailures;
+	}
+}
+
 int ftl_setup() {
 	if(HasFTLInit)
 		return 0;
@@ -3124,32 +3996,55 @@ int ftl_setup() {
 		return -1;
 	}
 
+	ftl_rebuild_log_index();
+
 	HasFTLInit = TRUE;
 
 	return 0;
 }
 
+// Runs of whole pages going to or from a word-aligned buffer are handed to
+// FTL_Read/FTL_Write directly, since the NAND DMA can use the caller's buffer.
+// Only partial pages at either end (or unaligned buffers) go through tBuffer.
+static int ftl_can_transfer_direct(uint8_t* curLoc, int pageOffset, int left) {
+	return pageOffset == 0 && left >= Geometry->bytesPerPage && (((uint32_t) curLoc) & 0x3) == 0;
+}
+
 int ftl_read(void* buffer, uint64_t offset, int size) {
 	uint8_t* curLoc = (uint8_t*) buffer;
 	int curPage = offset / Geometry->bytesPerPage;
 	int toRead = size;
 	int pageOffset = offset - (curPage * Geometry->bytesPerPage);
-	uint8_t* tBuffer = (uint8_t*) malloc(Geometry->bytesPerPage);
+
+	if(!ftl_cache_init())
+		return FALSE;
+
 	while(toRead > 0) {
-		if(FTL_Read(curPage, 1, tBuffer) != 0) {
-			free(tBuffer);
-			return FALSE;
+		if(ftl_can_transfer_direct(curLoc, pageOffset, toRead)) {
+			int pages = toRead / Geometry->bytesPerPage;
+			if(FTL_Read(curPage, pages, curLoc) != 0)
+				return FALSE;
+
+			ftl_cache_overlay(curLoc, curPage, pages);
+
+			curLoc += pages * Geometry->bytesPerPage;
+			toRead -= pages * Geometry->bytesPerPage;
+			curPage += pages;
+			continue;
 		}
 
+		FTLCachePage* entry = ftl_cache_get(curPage, TRUE);
+		if(entry == NULL)
+			return FALSE;
+
 		int read = (((Geometry->bytesPerPage-pageOffset) > toRead) ? toRead : Geometry->bytesPerPage-pageOffset);
-		memcpy(curLoc, tBuffer + pageOffset, read);
+		memcpy(curLoc, entry->buffer + pageOffset, read);
 		curLoc += read;
 		toRead -= read;
 		pageOffset = 0;
 		curPage++;
 	}
 
-	free(tBuffer);
 	return TRUE;
 }
 
@@ -3158,20 +4053,31 @@ int ftl_write(void* buffer, uint64_t offset, int size) {
 	int curPage = offset / Geometry->bytesPerPage;
 	int toWrite = size;
 	int pageOffset = offset - (curPage * Geometry->bytesPerPage);
-	uint8_t* tBuffer = (uint8_t*) malloc(Geometry->bytesPerPage);
+
+	if(!ftl_cache_init())
+		return FALSE;
+
 	while(toWrite > 0) {
-		if(FTL_Read(curPage, 1, tBuffer) != 0) {
-			free(tBuffer);
-			return FALSE;
+		if(ftl_can_transfer_direct(curLoc, pageOffset, toWrite)) {
+			// whole pages are overwritten, so any cached copies are obsolete
+			int pages = toWrite / Geometry->bytesPerPage;
+			ftl_cache_discard(curPage, pages);
+			if(FTL_Write(curPage, pages, curLoc) != 0)
+				return FALSE;
+
+			curLoc += pages * Geometry->bytesPerPage;
+			toWrite -= pages * Geometry->bytesPerPage;
+			curPage += pages;
+			continue;
 		}
 
 		int write = (((Geometry->bytesPerPage - pageOffset) > toWrite) ? toWrite : Geometry->bytesPerPage - pageOffset);
-		memcpy(tBuffer + pageOffset, curLoc, write);
-
-		if(FTL_Write(curPage, 1, tBuffer) != 0) {
-			free(tBuffer);
+		FTLCachePage* entry = ftl_cache_get(curPage, write < Geometry->bytesPerPage);
+		if(entry == NULL)
 			return FALSE;
-		}
+
+		memcpy(entry->buffer + pageOffset, curLoc, write);
+		entry->dirty = TRUE;
 
 		curLoc += write;
 		toWrite -= write;
@@ -3179,7 +4085,6 @@ int ftl_write(void* buffer, uint64_t offset, int size) {
 		curPage++;
 	}
 
-	free(tBuffer);
 	return TRUE;
 }
 
@@ -3262,12 +4167,62 @@ void ftl_printdata() {
 
 static int ftl_read_mtd(mtd_t *_dev, void *_dest, uint32_t _off, int _amt)
 {
-	return ftl_read(_dest, _off, _amt);
+	return ftl_read(_dest, _off, _amt) ? _amt : -1;
 }
 
 static int ftl_write_mtd(mtd_t *_dev, void *_src, uint32_t _off, int _amt)
 {
-	return ftl_write(_src, _off, _amt);
+	return ftl_write(_src, _off, _amt) ? _amt : -1;
+}
+
+// Pieces that carry on where the last one stopped, both on NAND and in
+// memory, are passed to the FTL as one transfer so whole pages go direct.
+static int ftl_xfer_vec_mtd(const block_device_iovec_t *_vec, int _count, int _write)
+{
+	int total = 0;
+	int i = 0;
+
+	while(i < _count)
+	{
+		uint64_t offset = _vec[i].offset;
+		uint8_t *buffer = _vec[i].buffer;
+		int size = _vec[i].size;
+
+		for(i++; i < _count; i++)
+		{
+			if(_vec[i].offset != (offset + size) || _vec[i].buffer != (buffer + size))
+				break;
+
+			size += _vec[i].size;
+		}
+
+		if(!(_write ? ftl_write(buffer, offset, size) : ftl_read(buffer, offset, size)))
+			return -1;
+
+		total += size;
+	}
+
+	return total;
+}
+
+static int ftl_readv_mtd(mtd_t *_dev, const block_device_iovec_t *_vec, int _count)
+{
+	return ftl_xfer_vec_mtd(_vec, _count, FALSE);
+}
+
+static int ftl_writev_mtd(mtd_t *_dev, const block_device_iovec_t *_vec, int _count)
+{
+	return ftl_xfer_vec_mtd(_vec, _count, TRUE);
+}
+
+static void ftl_finish_mtd(mtd_t *_dev)
+{
+	ftl_cache_flush();
+}
+
+static int ftl_sync_mtd(mtd_t *_dev)
+{
+	return ftl_cache_flush() ? 0 : -1;
 }
 
 static int ftl_block_size(mtd_t *_dev)
@@ -3282,8 +4237,12 @@ static mtd_t ftl_mtd = {
 		.name = "Apple FTL Layer",
 	},
 
+	.finish = ftl_finish_mtd,
 	.read = ftl_read_mtd,
 	.write = ftl_write_mtd,
+	.readv = ftl_readv_mtd,
+	.writev = ftl_writev_mtd,
+	.sync = ftl_sync_mtd,
 
 	.block_size = ftl_block_size,
 
@@ -3296,6 +4255,9 @@ void ftl_init()
 	{
 		if(!mtd_init(&ftl_mtd))
 			mtd_register(&ftl_mtd);
+
+		task_init(&ftl_bg_task, "ftl merge");
+		task_start(&ftl_bg_task, &ftl_bg_run, NULL);
 	}
 }
 MODULE_INIT(ftl_init);
@@ -3361,6 +4323,261 @@ void cmd_ftl_sync(int argc, char** argv) {
 }
 COMMAND("ftl_sync", "commit the current FTL context", cmd_ftl_sync);
 
+void cmd_ftl_log_index(int argc, char** argv) {
+	if(!HasFTLInit) {
+		bufferPrintf("ftl: FTL not initialized\r\n");
+		return;
+	}
+
+	int rounds = 16;
+	if(argc >= 2)
+		rounds = parseNumber(argv[1]);
+
+	int lbn;
+	int mismatches = 0;
+	for(lbn = 0; lbn < Geometry->userSuBlksTotal; lbn++) {
+		if(ftl_get_log(lbn) != ftl_get_log_scan(lbn))
+			mismatches++;
+	}
+
+	uint32_t lookups = LogLookups;
+	uint32_t hits = LogLookupHits;
+
+	// count the results so the compiler can't drop the lookups
+	int indexedFound = 0;
+	int scannedFound = 0;
+
+	int i;
+	uint64_t startTime = timer_get_system_microtime();
+	for(i = 0; i < rounds; i++)
+		for(lbn = 0; lbn < Geometry->userSuBlksTotal; lbn++)
+			if(ftl_get_log(lbn) != NULL)
+				indexedFound++;
+	uint32_t indexed = (uint32_t)(timer_get_system_microtime() - startTime);
+
+	startTime = timer_get_system_microtime();
+	for(i = 0; i < rounds; i++)
+		for(lbn = 0; lbn < Geometry->userSuBlksTotal; lbn++)
+			if(ftl_get_log_scan(lbn) != NULL)
+				scannedFound++;
+	uint32_t scanned = (uint32_t)(timer_get_system_microtime() - startTime);
+
+	// don't count the benchmark itself
+	LogLookups = lookups;
+	LogLookupHits = hits;
+
+	bufferPrintf("ftl: %u log lookups, %u found a log\r\n", LogLookups, LogLookupHits);
+	bufferPrintf("ftl: index %s the log table (%d mismatches)\r\n", mismatches ? "DISAGREES with" : "matches", mismatches);
+	bufferPrintf("ftl: %d x %d lookups: index %u us (%d found), linear scan %u us (%d found)\r\n",
+			rounds, Geometry->userSuBlksTotal, indexed, indexedFound, scanned, scannedFound);
+}
+COMMAND("ftl_log_index", "check and time the FTL log block index", cmd_ftl_log_index);
+
+void cmd_ftl_merge_stats(int argc, char** argv) {
+	if(argc >= 2) {
+		if(strcmp(argv[1], "on") == 0)
+			FTLBackgroundEnabled = TRUE;
+		else if(strcmp(argv[1], "off") == 0)
+			FTLBackgroundEnabled = FALSE;
+		else if(strcmp(argv[1], "reset") == 0)
+			memset(&FTLMergeStat, 0, sizeof(FTLMergeStat));
+		else {
+			bufferPrintf("Usage: %s [on|off|reset]\r\n", argv[0]);
+			return;
+		}
+	}
+
+	bufferPrintf("background merging: %s\r\n", FTLBackgroundEnabled ? "on" : "off");
+	bufferPrintf("merges: %u inline, %u in background (%u failed)\r\n",
+			FTLMergeStat.inlineMerges, FTLMergeStat.backgroundMerges, FTLMergeStat.backgroundFailures);
+	if(HasFTLInit)
+		bufferPrintf("free virtual blocks: %d\r\n", pstFTLCxt->wNumOfFreeVb);
+
+	bufferPrintf("FTL_Write calls: %u, slowest %u us\r\n", FTLMergeStat.writes, FTLMergeStat.maxWriteUs);
+	bufferPrintf("\t< 1ms: %u\r\n\t< 10ms: %u\r\n\t< 100ms: %u\r\n\t< 1s: %u\r\n\t>= 1s: %u\r\n",
+			FTLMergeStat.writeLatency[0], FTLMergeStat.writeLatency[1], FTLMergeStat.writeLatency[2],
+			FTLMergeStat.writeLatency[3], FTLMergeStat.writeLatency[4]);
+}
+COMMAND("ftl_merge_stats", "show FTL merge and write latency statistics, or toggle background merging", cmd_ftl_merge_stats);
+
+void cmd_ftl_wa_stats(int argc, char** argv) {
+	if(argc >= 2) {
+		if(strcmp(argv[1], "on") == 0)
+			HotColdEnabled = TRUE;
+		else if(strcmp(argv[1], "off") == 0)
+			HotColdEnabled = FALSE;
+		else if(strcmp(argv[1], "reset") == 0)
+			memset(&FTLWriteStat, 0, sizeof(FTLWriteStat));
+		else {
+			bufferPrintf("Usage: %s [on|off|reset]\r\n", argv[0]);
+			return;
+		}
+	}
+
+	bufferPrintf("hot/cold separation: %s\r\n", HotColdEnabled ? "on" : "off");
+	bufferPrintf("pages: %u written by host, %u data and %u control pages programmed\r\n",
+			FTLWriteStat.hostPages, FTLWriteStat.dataPagesProgrammed, FTLWriteStat.ctrlPagesProgrammed);
+	if(FTLWriteStat.hostPages > 0) {
+		uint32_t wa = (uint32_t)(((uint64_t)(FTLWriteStat.dataPagesProgrammed + FTLWriteStat.ctrlPagesProgrammed) * 100) / FTLWriteStat.hostPages);
+		bufferPrintf("write amplification: %d.%02d\r\n", wa / 100, wa % 100);
+	}
+	bufferPrintf("merge victims: %u cold, %u hot\r\n", FTLWriteStat.coldMergeVictims, FTLWriteStat.hotMergeVictims);
+
+	if(HasFTLInit) {
+		int i;
+		int hot = 0;
+		for(i = 0; i < Geometry->userSuBlksTotal; i++) {
+			if(LbnHeat[i] >= FTL_HEAT_HOT)
+				++hot;
+		}
+		bufferPrintf("hot logical blocks: %d of %d\r\n", hot, Geometry->userSuBlksTotal);
+	}
+}
+COMMAND("ftl_wa_stats", "show FTL write amplification and hot/cold statistics, or toggle hot/cold separation", cmd_ftl_wa_stats);
+
+#define FTL_WEAR_HISTOGRAM_BUCKETS 8
+
+void cmd_ftl_wearlevel(int argc, char** argv) {
+	if(argc >= 2) {
+		int i;
+		if(strcmp(argv[1], "threshold") == 0 && argc >= 3) {
+			WearThreshold = parseNumber(argv[2]);
+		} else if(strcmp(argv[1], "reset") == 0) {
+			memset(&FTLWearStat, 0, sizeof(FTLWearStat));
+		} else {
+			for(i = 0; i < FTL_NUM_WEAR_POLICIES; i++) {
+				if(strcmp(argv[1], FTLWearPolicies[i].name) == 0) {
+					WearPolicy = &FTLWearPolicies[i];
+					break;
+				}
+			}
+
+			if(i == FTL_NUM_WEAR_POLICIES) {
+				bufferPrintf("Usage: %s [<policy>|threshold <erases>|reset]\r\n", argv[0]);
+				for(i = 0; i < FTL_NUM_WEAR_POLICIES; i++)
+					bufferPrintf("\t%s: %s\r\n", FTLWearPolicies[i].name, FTLWearPolicies[i].description);
+				return;
+			}
+		}
+	}
+
+	bufferPrintf("wear-level policy: %s, threshold %d\r\n", WearPolicy->name, WearThreshold);
+	bufferPrintf("runs: %u, swaps: %u, skipped: %u\r\n", FTLWearStat.runs, FTLWearStat.swaps, FTLWearStat.skipped);
+
+	if(!HasFTLInit)
+		return;
+
+	int numVbs = ftl_num_vbs();
+	uint16_t minEC = 0xFFFF;
+	uint16_t maxEC = 0;
+	uint64_t sum = 0;
+	uint64_t sumSquares = 0;
+	int i;
+
+	for(i = 0; i < numVbs; i++) {
+		uint16_t ec = pstFTLCxt->pawEraseCounterTable[i];
+		if(ec < minEC)
+			minEC = ec;
+		if(ec > maxEC)
+			maxEC = ec;
+		sum += ec;
+		sumSquares += (uint64_t) ec * ec;
+	}
+
+	uint32_t mean = (uint32_t)(sum / numVbs);
+	uint32_t variance = (uint32_t)(sumSquares / numVbs - (uint64_t) mean * mean);
+	uint32_t stddev = 0;
+	while((stddev + 1) * (stddev + 1) <= variance)
+		++stddev;
+
+	bufferPrintf("erase counts over %d blocks: min %d, max %d, mean %d, stddev ~%d\r\n", numVbs, minEC, maxEC, mean, stddev);
+
+	uint32_t buckets[FTL_WEAR_HISTOGRAM_BUCKETS];
+	int width = (maxEC - minEC) / FTL_WEAR_HISTOGRAM_BUCKETS + 1;
+	memset(buckets, 0, sizeof(buckets));
+
+	for(i = 0; i < numVbs; i++)
+		++buckets[(pstFTLCxt->pawEraseCounterTable[i] - minEC) / width];
+
+	for(i = 0; i < FTL_WEAR_HISTOGRAM_BUCKETS; i++) {
+		if(buckets[i] == 0)
+			continue;
+
+		bufferPrintf("\t%d - %d: %u\r\n", minEC + i * width, minEC + (i + 1) * width - 1, buckets[i]);
+	}
+}
+COMMAND("ftl_wearlevel", "show FTL erase count distribution, or choose the wear-leveling policy", cmd_ftl_wearlevel);
+
+void cmd_ftl_commit_stats(int argc, char** argv) {
+	if(argc >= 2) {
+		if(strcmp(argv[1], "delta") == 0)
+			DeltaCommitEnabled = TRUE;
+		else if(strcmp(argv[1], "full") == 0)
+			DeltaCommitEnabled = FALSE;
+		else if(strcmp(argv[1], "reset") == 0) {
+			CommitFull = 0;
+			CommitDelta = 0;
+			CommitTablePagesWritten = 0;
+			CommitTablePagesSkipped = 0;
+		} else {
+			bufferPrintf("Usage: %s [delta|full|reset]\r\n", argv[0]);
+			return;
+		}
+	}
+
+	bufferPrintf("context commits: %s, %u full, %u delta\r\n", DeltaCommitEnabled ? "delta" : "full", CommitFull, CommitDelta);
+	bufferPrintf("table pages: %u written, %u unchanged and skipped\r\n", CommitTablePagesWritten, CommitTablePagesSkipped);
+}
+COMMAND("ftl_commit_stats", "show FTL context commit statistics, or choose delta or full commits", cmd_ftl_commit_stats);
+
+void cmd_ftl_restore_stats(int argc, char** argv) {
+	if(argc >= 2) {
+		if(strcmp(argv[1], "on") == 0)
+			SummaryEnabled = TRUE;
+		else if(strcmp(argv[1], "off") == 0) {
+			SummaryEnabled = FALSE;
+			JournalActive = FALSE;
+		} else {
+			bufferPrintf("Usage: %s [on|off]\r\n", argv[0]);
+			return;
+		}
+	}
+
+	bufferPrintf("mount summary: %s, journal %s, %u journal pages written\r\n", SummaryEnabled ? "on" : "off",
+			JournalActive ? "active" : "inactive", FTLRestoreStat.journalWrites);
+	bufferPrintf("restores: %u, %u of them using a summary\r\n", FTLRestoreStat.restores, FTLRestoreStat.fastRestores);
+	if(FTLRestoreStat.restores > 0) {
+		bufferPrintf("last restore: %u ms total, %u ms scanning\r\n", FTLRestoreStat.lastTotalUs / 1000, FTLRestoreStat.lastScanUs / 1000);
+		bufferPrintf("blocks scanned: %u, skipped: %u, journal entries: %u\r\n", FTLRestoreStat.lastBlocksScanned,
+				FTLRestoreStat.lastBlocksSkipped, FTLRestoreStat.lastJournalEntries);
+	}
+}
+COMMAND("ftl_restore_stats", "show FTL restore timing, or turn the mount summary on or off", cmd_ftl_restore_stats);
+
+void cmd_ftl_cache(int argc, char** argv) {
+	if(argc >= 2 && strcmp(argv[1], "flush") == 0) {
+		bufferPrintf("ftl: cache flush %s\r\n", ftl_cache_flush() ? "succeeded" : "failed");
+		return;
+	}
+
+	int dirty = 0;
+	int used = 0;
+	int i;
+	if(FTLCacheFlushBuffer != NULL) {
+		for(i = 0; i < FTL_CACHE_PAGES; i++) {
+			if(FTLCache[i].page != -1)
+				used++;
+			if(FTLCache[i].dirty)
+				dirty++;
+		}
+	}
+
+	bufferPrintf("ftl cache: %d/%d pages in use, %d dirty\r\n", used, FTL_CACHE_PAGES, dirty);
+	bufferPrintf("hits: %u, misses: %u, evictions: %u\r\n", FTLCacheStat.hits, FTLCacheStat.misses, FTLCacheStat.evictions);
+	bufferPrintf("flushes: %u, pages written back: %u in %u FTL_Write calls\r\n", FTLCacheStat.flushes, FTLCacheStat.flushedPages, FTLCacheStat.flushWrites);
+}
+COMMAND("ftl_cache", "show FTL page cache statistics, or flush it", cmd_ftl_cache);
+
 void cmd_bdev_read(int argc, char** argv) {
 	if(argc < 4) {
 		bufferPrintf("Usage: %s <address> <offset> <bytes>\r\n", argv[0]);
@@ -54,6 +54,7 @@
 
 #define NOR_MAX_READ 16
 #define NOR_BLOCK_SIZE 4096
+#define NOR_PAGE_SIZE 256
 
 #endif
 
@@ -83,6 +83,7 @@ int nand_setup();
 int nand_bank_reset(int bank, int timeout);
 int nand_read(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC, int checkBadBlocks);
 int nand_read_multiple(uint16_t* bank, uint32_t* pages, uint8_t* main, SpareData* spare, int pagesCount);
+int nand_read_batch(uint16_t* bank, uint32_t* pages, uint8_t* main, SpareData* spare, int pagesCount, int emptyOk);
 int nand_read_alternate_ecc(int bank, int page, uint8_t* buffer);
 int nand_erase(int bank, int block);
 int nand_write(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC);
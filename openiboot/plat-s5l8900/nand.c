@@ -668,16 +668,9 @@ int nand_calculate_ecc(uint8_t* data, uint8_t* ecc) {
 	return generateECC(ECCType, data, ecc);
 }
 
-int nand_read(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC, int checkBlank) {
-	if(bank >= Geometry.banksTotal)
-		return ERROR_ARG;
-
-	if(page >= Geometry.pagesPerBank)
-		return ERROR_ARG;
-
-	if(buffer == NULL && spare == NULL)
-		return ERROR_ARG;
-
+// Select the bank and have it load the page into its page register. The bank
+// stays busy after this returns, so several banks can be loading at once.
+static int nand_read_issue(int bank, int page, int withMain) {
 	SET_REG(NAND + FMCTRL0,
 		((WEHighHoldTime & FMCTRL_TWH_MASK) << FMCTRL_TWH_SHIFT) | ((WPPulseTime & FMCTRL_TWP_MASK) << FMCTRL_TWP_SHIFT)
 		| (1 << (banksTable[bank] + 1)) | FMCTRL0_ON | FMCTRL0_WPB);
@@ -685,12 +678,12 @@ int nand_read(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC, in
 	SET_REG(NAND + NAND_CMD, 0);
 	if(wait_for_ready(500) != 0) {
 		bufferPrintf("nand: bank setting failed\r\n");
-		goto FIL_read_error;
+		return ERROR_NAND;
 	}
 
 	SET_REG(NAND + FMANUM, FMANUM_TRANSFERSETTING);
 
-	if(buffer) {
+	if(withMain) {
 		SET_REG(NAND + FMADDR0, page << 16); // lower bits of the page number to the upper bits of CONFIG3
 		SET_REG(NAND + FMADDR1, (page >> 16) & 0xFF); // upper bits of the page number
 
@@ -702,15 +695,21 @@ int nand_read(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC, in
 	SET_REG(NAND + FMCTRL1, FMCTRL1_DOTRANSADDR);
 	if(wait_for_address_done(500) != 0) {
 		bufferPrintf("nand: sending address failed\r\n");
-		goto FIL_read_error;
+		return ERROR_NAND;
 	}
 	
 	SET_REG(NAND + NAND_CMD, NAND_CMD_READ);
 	if(wait_for_ready(500) != 0) {
 		bufferPrintf("nand: sending read command failed\r\n");
-		goto FIL_read_error;
+		return ERROR_NAND;
 	}
 
+	return 0;
+}
+
+// Wait for a bank that has had nand_read_issue called on it and pull the page
+// out of its page register.
+static int nand_read_fetch(int bank, uint8_t* buffer, uint8_t* spare, int doECC, int checkBlank) {
 	if(wait_for_nand_bank_ready(bank) != 0) {
 		bufferPrintf("nand: nand bank not ready after a long time\r\n");
 		goto FIL_read_error;
@@ -766,6 +765,24 @@ FIL_read_error:
 	return ERROR_NAND;
 }
 
+int nand_read(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC, int checkBlank) {
+	if(bank >= Geometry.banksTotal)
+		return ERROR_ARG;
+
+	if(page >= Geometry.pagesPerBank)
+		return ERROR_ARG;
+
+	if(buffer == NULL && spare == NULL)
+		return ERROR_ARG;
+
+	if(nand_read_issue(bank, page, buffer != NULL) != 0) {
+		nand_bank_reset(bank, 100);
+		return ERROR_NAND;
+	}
+
+	return nand_read_fetch(bank, buffer, spare, doECC, checkBlank);
+}
+
 int nand_write(int bank, int page, uint8_t* buffer, uint8_t* spare, int doECC) {
 	if(bank >= Geometry.banksTotal)
 		return ERROR_ARG;
@@ -853,20 +870,49 @@ NANDFTLData* nand_get_ftl_data() {
 	return &FTLData;
 }
 
-int nand_read_multiple(uint16_t* bank, uint32_t* pages, uint8_t* main, SpareData* spare, int pagesCount) {
-	int i;
-	unsigned int ret;
-	for(i = 0; i < pagesCount; i++) {
-		ret = nand_read(bank[i], pages[i], main, (uint8_t*) &spare[i], TRUE, TRUE);
-		if(ret > 1)
-			return ret;
+// Pages are read in runs that touch each bank at most once. The read command
+// goes out to every bank in the run before any data is transferred, so the
+// array-to-register load (tR) of all banks in the run happens in parallel and
+// only the transfers and ECC checks are serialized.
+int nand_read_batch(uint16_t* bank, uint32_t* pages, uint8_t* main, SpareData* spare, int pagesCount, int emptyOk) {
+	int i = 0;
+	while(i < pagesCount) {
+		uint32_t issued = 0;
+		int end = i;
+		while(end < pagesCount && (end - i) < Geometry.banksTotal && (issued & (1 << bank[end])) == 0) {
+			if(bank[end] >= Geometry.banksTotal || pages[end] >= Geometry.pagesPerBank)
+				return ERROR_ARG;
+
+			issued |= 1 << bank[end];
+			end++;
+		}
+
+		int j;
+		for(j = i; j < end; j++) {
+			if(nand_read_issue(bank[j], pages[j], TRUE) != 0) {
+				nand_bank_reset(bank[j], 100);
+				return ERROR_NAND;
+			}
+		}
 
-		main += Geometry.bytesPerPage;
+		for(j = i; j < end; j++) {
+			int ret = nand_read_fetch(bank[j], main, (uint8_t*) &spare[j], TRUE, TRUE);
+			if(ret > 1 || (ret != 0 && !emptyOk))
+				return ret;
+
+			main += Geometry.bytesPerPage;
+		}
+
+		i = end;
 	}
 
 	return 0;
 }
 
+int nand_read_multiple(uint16_t* bank, uint32_t* pages, uint8_t* main, SpareData* spare, int pagesCount) {
+	return nand_read_batch(bank, pages, main, spare, pagesCount, TRUE);
+}
+
 int nand_read_alternate_ecc(int bank, int page, uint8_t* buffer) {
 	int ret;
 	if((ret = nand_read(bank, page, buffer, aTemporarySBuf, FALSE, TRUE)) != 0) {
@@ -992,3 +1038,62 @@ void cmd_nand_status(int agc, char** argv) {
 	bufferPrintf("nand status: %x\r\n", nand_read_status());
 }
 COMMAND("nand_status", "read NAND status", cmd_nand_status);
+
+void cmd_nand_read_bench(int argc, char** argv) {
+	if(argc < 2) {
+		bufferPrintf("Usage: %s <block> [max pages]\r\n", argv[0]);
+		return;
+	}
+
+	uint32_t block = parseNumber(argv[1]);
+	int maxPages = Geometry.banksTotal * 4;
+	if(argc >= 3)
+		maxPages = parseNumber(argv[2]);
+
+	if(block >= Geometry.blocksPerBank || maxPages <= 0) {
+		bufferPrintf("nand: invalid arguments\r\n");
+		return;
+	}
+
+	uint8_t* buffer = malloc(maxPages * Geometry.bytesPerPage);
+	SpareData* spare = malloc(maxPages * sizeof(SpareData));
+	uint16_t* banks = malloc(maxPages * sizeof(uint16_t));
+	uint32_t* pages = malloc(maxPages * sizeof(uint32_t));
+	if(!buffer || !spare || !banks || !pages) {
+		bufferPrintf("nand: out of memory\r\n");
+		goto out;
+	}
+
+	// Lay the pages out the way the VFL stripes a virtual block: consecutive
+	// pages go to consecutive banks.
+	int i;
+	for(i = 0; i < maxPages; i++) {
+		banks[i] = i % Geometry.banksTotal;
+		pages[i] = block * Geometry.pagesPerBlock + ((i / Geometry.banksTotal) % Geometry.pagesPerBlock);
+	}
+
+	int count;
+	for(count = 1; count <= maxPages; count <<= 1) {
+		uint64_t startTime = timer_get_system_microtime();
+		for(i = 0; i < count; i++)
+			nand_read(banks[i], pages[i], buffer + i * Geometry.bytesPerPage, (uint8_t*) &spare[i], TRUE, TRUE);
+		uint32_t serial = (uint32_t)(timer_get_system_microtime() - startTime);
+
+		startTime = timer_get_system_microtime();
+		int ret = nand_read_multiple(banks, pages, buffer, spare, count);
+		uint32_t batched = (uint32_t)(timer_get_system_microtime() - startTime);
+
+		bufferPrintf("nand: %d pages: serial %d us, batched %d us (ret %d)\r\n", count, serial, batched, ret);
+	}
+
+out:
+	if(buffer)
+		free(buffer);
+	if(spare)
+		free(spare);
+	if(banks)
+		free(banks);
+	if(pages)
+		free(pages);
+}
+COMMAND("nand_read_bench", "compare serial and batched NAND reads", cmd_nand_read_bench);
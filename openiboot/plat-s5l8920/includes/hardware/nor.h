@@ -48,6 +48,7 @@
 
 #define NOR_MAX_READ 4
 #define NOR_BLOCK_SIZE 4096
+#define NOR_PAGE_SIZE 256
 
 #endif
 
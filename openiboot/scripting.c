@@ -6,44 +6,24 @@
 #include "hfs/fs.h"
 #include "hfs/hfsplus.h"
 #include "printf.h"
+#include "scripting.h"
 #include "util.h"
 
-uint8_t *script_load_hfs_file(int disk, int part, char *path, uint32_t *size)
+static uint8_t *script_load_hfs_file_alloc(int disk, int part, char *path, uint32_t *size, script_alloc_t alloc)
 {
-	bdevfs_device_t *dev = bdevfs_open(disk, part);
-	if(!dev)
-	{
-		bufferPrintf("fs: Cannot open partition hd%d,%d.\n", disk, part);
-		return NULL;
-	}
-
-	HFSPlusCatalogRecord* record;
-	char *name;
-	uint8_t *address;
-	uint32_t sz = 0;
-	record = getRecordFromPath(path, dev->volume, &name, NULL);
-	if(record != NULL)
-	{
-		if(record->recordType == kHFSPlusFolderRecord)
-			bufferPrintf("scripting: That path leads to a directory!\n");
-		else
-			sz = readHFSFile((HFSPlusCatalogFile*)record, &address, dev->volume);
-	}
-	else
-		bufferPrintf("scripting: No such file or directory %s.\n", path);
-
-	bdevfs_close(dev);
+	uint8_t *address = fs_load(disk, part, path, NULL, alloc, size);
+	if(address == NULL)
+		bufferPrintf("scripting: Failed to load %s.\n", path);
 
-	if(address)
-	{
-		*size = sz;
-		return address;
-	}
+	return address;
+}
 
-	return NULL;
+uint8_t *script_load_hfs_file(int disk, int part, char *path, uint32_t *size)
+{
+	return script_load_hfs_file_alloc(disk, part, path, size, NULL);
 }
 
-uint8_t *script_load_file(char *id, uint32_t *size)
+uint8_t *script_load_file_alloc(char *id, uint32_t *size, script_alloc_t alloc)
 {
 	if(*id == '(') // In format (hdX,Y)/some/path
 	{
@@ -69,7 +49,7 @@ uint8_t *script_load_file(char *id, uint32_t *size)
 			}
 
 			int device = parseNumber(ptr);
-			uint8_t *ret = script_load_hfs_file(device, part, devEnd, size); // TODO: Hahahah! I should really fix this. -- Ricky26
+			uint8_t *ret = script_load_hfs_file_alloc(device, part, devEnd, size, alloc); // TODO: Hahahah! I should really fix this. -- Ricky26
 
 			free(dupe);
 
@@ -78,7 +58,7 @@ uint8_t *script_load_file(char *id, uint32_t *size)
 	}
 	else if(*id == '/') // In format /some/path of the system partition
 	{
-		return script_load_hfs_file(0, 0, id, size);
+		return script_load_hfs_file_alloc(0, 0, id, size, alloc);
 	}
 	else if(*id >= '0' && *id <= '9')
 	{
@@ -93,8 +73,18 @@ uint8_t *script_load_file(char *id, uint32_t *size)
 
 			uint32_t sz = parseNumber(extent);
 			uint32_t addr = parseNumber(id);
-			*size = sz;
-			ret = (uint8_t*)addr;
+
+			if(alloc == NULL)
+				ret = (uint8_t*)addr;
+			else
+			{
+				ret = alloc(sz);
+				if(ret)
+					memcpy(ret, (uint8_t*)addr, sz);
+			}
+
+			if(ret)
+				*size = sz;
 		}
 		else
 			bufferPrintf("scripting: Invalid memory location, must be in the format location+size.\n");
@@ -107,6 +97,11 @@ uint8_t *script_load_file(char *id, uint32_t *size)
 	return NULL;
 }
 
+uint8_t *script_load_file(char *id, uint32_t *size)
+{
+	return script_load_file_alloc(id, size, NULL);
+}
+
 char **script_split_file(char *_data, uint32_t _sz, uint32_t *_count)
 {
 	int count = 0;